@@ -37,17 +37,25 @@ SOURCES += \
     src/renderer/utility.cpp \
     src/renderer/photonMapping.cpp \
     src/renderer/gridaccelerator.cpp \
+    src/renderer/importancemap.cpp \
+    src/renderer/instance.cpp \
+    src/renderer/integrator.cpp \
+    src/renderer/irradiancecache.cpp \
+    src/renderer/progressivephotonmap.cpp \
+    src/renderer/stats.cpp \
     src/renderer/aabb.cpp \
     src/gui/scene.cpp \
     src/gui/dialogmaterial.cpp \
     src/gui/dialogmeshfile.cpp \
     src/gui/dialogobject.cpp \
     src/io/filereader.cpp \
-    src/common/logger.cpp
+    src/common/logger.cpp \
+    src/common/tracer.cpp
 
 HEADERS += \
         src/gui/mainwindow.h \
     src/renderer/ray.h \
+    src/renderer/raypacket.h \
     src/renderer/render.h \
     src/renderer/rng.h \
     src/renderer/visualobject.h \
@@ -61,12 +69,20 @@ HEADERS += \
     src/renderer/photonMapping.h \
     src/renderer/aabb.h \
     src/renderer/gridaccelerator.h \
+    src/renderer/importancemap.h \
+    src/renderer/instance.h \
+    src/renderer/integrator.h \
+    src/renderer/irradiancecache.h \
+    src/renderer/progressivephotonmap.h \
+    src/renderer/sequence.h \
+    src/renderer/stats.h \
     src/gui/scene.h \
     src/gui/dialogmaterial.h \
     src/gui/dialogmeshfile.h \
     src/gui/dialogobject.h \
     src/io/filereader.h \
-    src/common/logger.h
+    src/common/logger.h \
+    src/common/tracer.h
 
 FORMS += \
         src/gui/mainwindow.ui \
@@ -0,0 +1,484 @@
+// couscous includes.
+#include "common/logger.h"
+#include "gui/scene.h"
+#include "io/filereader.h"
+#include "renderer/aabb.h"
+#include "renderer/camera.h"
+#include "renderer/gridaccelerator.h"
+#include "renderer/photonMapping.h"
+#include "renderer/ray.h"
+#include "renderer/raypacket.h"
+#include "renderer/render.h"
+#include "renderer/rng.h"
+#include "renderer/stats.h"
+#include "renderer/visualobject.h"
+
+// Qt includes.
+#include <QApplication>
+#include <QImage>
+#include <QProgressBar>
+
+// glm includes.
+#include <glm/glm.hpp>
+
+// Standard includes.
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace glm;
+using namespace std;
+
+//
+// Benchmarks of the renderer kernels and of the preset scenes.
+//
+// Each benchmark runs once to warm up, then repetitions times. The median
+// time is reported with the median absolute deviation, which outliers
+// such as a descheduled thread do not move, and with the minimum time.
+// Throughputs are computed from the median time.
+//
+// Usage: Couscous-raytracer-benchmark [--micro | --macro] [--repetitions n] [filter]
+// Only the benchmarks whose name contains the filter are run. Scenes load
+// their meshes from assets/: run it from the root of the repository.
+//
+
+// Default number of timed runs of each benchmark.
+#define BENCHMARK_REPETITIONS 10
+
+// Rays traced by the intersection microbenchmarks.
+#define BENCHMARK_RAYS_COUNT 262144
+
+// Triangles of the world tested by the triangle microbenchmarks.
+#define BENCHMARK_TRIANGLES_COUNT 64
+
+// Random numbers drawn by the RNG microbenchmark.
+#define BENCHMARK_RANDOM_COUNT 10000000
+
+// Photons of the map, and photons per lookup, of the kNN microbenchmark.
+#define BENCHMARK_PHOTONS_COUNT 100000
+#define BENCHMARK_LOOKUP_PHOTONS 100
+
+// Files parsed by the OFF microbenchmark.
+#define BENCHMARK_OFF_FILES_COUNT 20
+
+// Image size and samples per pixel of the scene benchmarks.
+#define BENCHMARK_RENDER_SIZE 256
+#define BENCHMARK_RENDER_SPP 4
+
+namespace
+{
+    // Results are accumulated here so that the compiler keeps the benchmarked code.
+    volatile float sink;
+
+    struct Measure
+    {
+        double  median;
+        double  deviation;
+        double  min;
+    };
+
+    struct Options
+    {
+        bool    micro = true;
+        bool    macro = true;
+        size_t  repetitions = BENCHMARK_REPETITIONS;
+        string  filter;
+    };
+
+    bool selected(
+        const Options&      options,
+        const string&       name)
+    {
+        return options.filter.empty() || name.find(options.filter) != string::npos;
+    }
+
+    double median(vector<double> values)
+    {
+        sort(values.begin(), values.end());
+
+        const size_t middle = values.size() / 2;
+
+        return values.size() % 2 == 1
+            ? values[middle]
+            : 0.5 * (values[middle - 1] + values[middle]);
+    }
+
+    // Time the job in milliseconds.
+    template <typename Job>
+    Measure measure(
+        const size_t        repetitions,
+        Job                 job)
+    {
+        job();
+
+        vector<double> times;
+
+        for (size_t i = 0; i < repetitions; ++i)
+        {
+            const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+            job();
+            times.push_back(chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+        }
+
+        Measure result;
+        result.median = median(times);
+        result.min = *min_element(times.begin(), times.end());
+
+        vector<double> deviations;
+
+        for (const double time : times)
+            deviations.push_back(abs(time - result.median));
+
+        result.deviation = median(deviations);
+
+        return result;
+    }
+
+    // Print a line of results. Throughput is ops millions of unit per second.
+    void report(
+        const string&       name,
+        const Measure&      measure,
+        const double        ops,
+        const char*         unit)
+    {
+        const double deviation = measure.median > 0.0 ? 100.0 * measure.deviation / measure.median : 0.0;
+
+        cout
+            << left << setw(36) << name << right << fixed
+            << setprecision(3) << setw(12) << measure.median << " ms"
+            << "  +/-" << setprecision(1) << setw(5) << deviation << "%"
+            << "  min " << setprecision(3) << setw(10) << measure.min << " ms"
+            << "  " << setprecision(2) << setw(10) << ops / (measure.median * 1000.0) << " M" << unit << "/s"
+            << endl;
+    }
+
+    Camera create_camera(
+        const SceneCamera&  cam,
+        const size_t        width,
+        const size_t        height)
+    {
+        return Camera(cam.position, vec3(0.0f, 1.0f, 0.0f),
+            cam.yaw, cam.pitch, cam.fov, width, height);
+    }
+
+    // Camera rays through random points of the image of the first camera of a scene.
+    vector<Ray> camera_rays(
+        const Scene&        scene,
+        const size_t        count,
+        RNG&                rng)
+    {
+        const Camera camera = create_camera(scene.cameras.front(), BENCHMARK_RENDER_SIZE, BENCHMARK_RENDER_SIZE);
+        vector<Ray> rays;
+        rays.reserve(count);
+
+        for (size_t i = 0; i < count; ++i)
+            rays.push_back(camera.get_ray(rng.next(), rng.next()));
+
+        return rays;
+    }
+
+    // Rays from a sphere around the [-1, 1] box toward random points near it.
+    vector<Ray> box_rays(
+        const size_t        count,
+        RNG&                rng)
+    {
+        vector<Ray> rays;
+        rays.reserve(count);
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            const vec3 origin = normalize(vec3(rng.next(), rng.next(), rng.next()) * 2.0f - 1.0f) * 4.0f;
+            const vec3 target = (vec3(rng.next(), rng.next(), rng.next()) * 2.0f - 1.0f) * 1.5f;
+            rays.push_back(Ray(origin, target - origin));
+        }
+
+        return rays;
+    }
+
+    void run_micro(const Options& options)
+    {
+        RNG rng;
+
+        cout << "microbenchmarks" << endl;
+
+        if (selected(options, "rng"))
+        {
+            RNG bench_rng;
+
+            const Measure m = measure(options.repetitions, [&]()
+            {
+                float sum = 0.0f;
+
+                for (size_t i = 0; i < BENCHMARK_RANDOM_COUNT; ++i)
+                    sum += bench_rng.next();
+
+                sink = sum;
+            });
+
+            report("rng next", m, BENCHMARK_RANDOM_COUNT, "numbers");
+        }
+
+        if (selected(options, "aabb"))
+        {
+            const AABB bbox(vec3(-1.0f), vec3(1.0f));
+            const vector<Ray> rays = box_rays(BENCHMARK_RAYS_COUNT, rng);
+
+            const Measure m = measure(options.repetitions, [&]()
+            {
+                size_t hits = 0;
+
+                for (const Ray& r : rays)
+                    hits += bbox.intersect(r) ? 1 : 0;
+
+                sink = static_cast<float>(hits);
+            });
+
+            report("aabb slab", m, rays.size(), "rays");
+        }
+
+        if (selected(options, "off"))
+        {
+            const Measure m = measure(options.repetitions, [&]()
+            {
+                size_t faces = 0;
+
+                for (size_t i = 0; i < BENCHMARK_OFF_FILES_COUNT; ++i)
+                    faces += read_off("assets/suzanne.off").faces.size();
+
+                sink = static_cast<float>(faces);
+            });
+
+            report("off parsing suzanne", m, BENCHMARK_OFF_FILES_COUNT, "files");
+        }
+
+        const bool triangles = selected(options, "triangle");
+        const bool grid_traversal = selected(options, "grid");
+        const bool photons = selected(options, "photon");
+
+        if (!triangles && !grid_traversal && !photons)
+            return;
+
+        // The suzanne cornell box mixes large walls and a dense mesh.
+        Scene scene = Scene::cornell_box_suzanne();
+        MeshGroup world;
+        InstanceGroup instances;
+        scene.create_scene(world, instances);
+
+        const vector<Ray> rays = camera_rays(scene, BENCHMARK_RAYS_COUNT, rng);
+
+        if (triangles)
+        {
+            const size_t triangles_count = std::min(world.size(), size_t(BENCHMARK_TRIANGLES_COUNT));
+            const vector<Ray> triangle_rays(rays.begin(), rays.begin() + BENCHMARK_RAYS_COUNT / 16);
+
+            const Measure single = measure(options.repetitions, [&]()
+            {
+                HitRecord rec;
+                size_t hits = 0;
+
+                for (const Ray& r : triangle_rays)
+                {
+                    for (size_t i = 0; i < triangles_count; ++i)
+                        hits += world[i]->hit(r, 0.0001f, numeric_limits<float>::max(), rec) ? 1 : 0;
+                }
+
+                sink = static_cast<float>(hits);
+            });
+
+            report("triangle hit", single, double(triangle_rays.size() * triangles_count), "tests");
+
+            vector<RayPacket> packets;
+
+            for (size_t i = 0; i < triangle_rays.size(); ++i)
+            {
+                if (i % RAY_PACKET_SIZE == 0)
+                    packets.push_back(RayPacket());
+
+                packets.back().add(triangle_rays[i]);
+            }
+
+            const Measure packet = measure(options.repetitions, [&]()
+            {
+                size_t hits = 0;
+
+                for (const RayPacket& p : packets)
+                {
+                    PacketHits packet_hits;
+
+                    for (size_t i = 0; i < triangles_count; ++i)
+                        world[i]->hit_packet(p, 0.0001f, packet_hits);
+
+                    for (size_t i = 0; i < p.size; ++i)
+                        hits += packet_hits.triangle[i] != nullptr ? 1 : 0;
+                }
+
+                sink = static_cast<float>(hits);
+            });
+
+            report("triangle hit packet", packet, double(triangle_rays.size() * triangles_count), "tests");
+        }
+
+        if (!grid_traversal && !photons)
+            return;
+
+        unique_ptr<VoxelGridAccelerator> grid;
+
+        const Measure build = measure(options.repetitions, [&]()
+        {
+            grid.reset(new VoxelGridAccelerator(world, instances));
+        });
+
+        if (grid_traversal)
+        {
+            report("grid build", build, double(world.size()), "triangles");
+
+            const Measure m = measure(options.repetitions, [&]()
+            {
+                HitRecord rec;
+                size_t hits = 0;
+
+                for (const Ray& r : rays)
+                    hits += grid->hit(r, 0.0001f, numeric_limits<float>::max(), rec) ? 1 : 0;
+
+                sink = static_cast<float>(hits);
+            });
+
+            report("grid traversal", m, rays.size(), "rays");
+        }
+
+        if (photons)
+        {
+            const MeshGroup lights = fetch_lights(world);
+            PhotonMap pmap;
+            pmap.compute_map(BENCHMARK_PHOTONS_COUNT, 32, *grid, lights, rng);
+
+            const Measure build_tree = measure(options.repetitions, [&]()
+            {
+                PhotonTree tree(pmap);
+                sink = static_cast<float>(tree.map.size());
+            });
+
+            report("photon tree build", build_tree, double(pmap.size()), "photons");
+
+            // Photons are looked up where the camera rays hit.
+            vector<vec3> points;
+            HitRecord rec;
+
+            for (const Ray& r : rays)
+            {
+                if (grid->hit(r, 0.0001f, numeric_limits<float>::max(), rec))
+                    points.push_back(rec.p);
+            }
+
+            const PhotonTree tree(pmap);
+            const float radius = grid->voxel_size() * 1.5f;
+
+            const Measure m = measure(options.repetitions, [&]()
+            {
+                vector<pair<size_t, float>> results;
+                size_t found = 0;
+
+                for (const vec3& p : points)
+                    found += tree.find_nearest(p, BENCHMARK_LOOKUP_PHOTONS, radius, results);
+
+                sink = static_cast<float>(found);
+            });
+
+            report("photon knn", m, points.size(), "lookups");
+        }
+    }
+
+    void run_macro(const Options& options)
+    {
+        cout << "scenes at " << BENCHMARK_RENDER_SIZE << "x" << BENCHMARK_RENDER_SIZE
+             << ", " << BENCHMARK_RENDER_SPP << " spp" << endl;
+
+        for (const string& name : Scene::preset_names())
+        {
+            if (!selected(options, name))
+                continue;
+
+            Scene scene;
+            Scene::preset(name, scene);
+
+            MeshGroup world;
+            InstanceGroup instances;
+            scene.create_scene(world, instances);
+
+            RenderSettings settings;
+            settings.width = BENCHMARK_RENDER_SIZE;
+            settings.height = BENCHMARK_RENDER_SIZE;
+            settings.spp = BENCHMARK_RENDER_SPP;
+
+            const Camera camera = create_camera(scene.cameras.front(), settings.width, settings.height);
+
+            Render render;
+            QProgressBar progress;
+            QImage image;
+            uint64_t rays = 0;
+
+            // Renders reset the counters: they hold the rays of the last one.
+            const Measure m = measure(options.repetitions, [&]()
+            {
+                render.get_render_image(settings, camera, world, instances, image, progress);
+
+                const RenderStats stats = Stats::collect();
+                rays = stats[StatCounter::CameraRays] + stats[StatCounter::ShadowRays]
+                    + stats[StatCounter::GatherRays] + stats[StatCounter::PhotonRays];
+            });
+
+            report(name, m, double(rays), "rays");
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    // Renders need an application for their progress bar.
+    QApplication a(argc, argv);
+
+    Options options;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--micro") == 0)
+            options.macro = false;
+        else if (strcmp(argv[i], "--macro") == 0)
+            options.micro = false;
+        else if (strcmp(argv[i], "--repetitions") == 0)
+        {
+            const int repetitions = i + 1 < argc ? atoi(argv[++i]) : 0;
+
+            if (repetitions < 1)
+            {
+                cerr << "--repetitions expects a number of runs of at least 1." << endl;
+                return 1;
+            }
+
+            options.repetitions = size_t(repetitions);
+        }
+        else
+            options.filter = argv[i];
+    }
+
+    // Only the results are printed.
+    Logger::set_level(LogLevel::Warning);
+
+    if (options.micro)
+        run_micro(options);
+
+    if (options.macro)
+        run_macro(options);
+
+    return 0;
+}
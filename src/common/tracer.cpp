@@ -0,0 +1,172 @@
+
+// Interface.
+#include "tracer.h"
+
+// Qt includes.
+#include <QMutex>
+#include <QMutexLocker>
+
+// Standard includes.
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <set>
+#include <vector>
+
+using namespace std;
+
+namespace
+{
+    struct Event
+    {
+        const char*     name;
+        char            phase;
+        int64_t         timestamp;
+        uint32_t        thread;
+        string          args;
+    };
+
+    class TracerImpl
+    {
+      public:
+        static TracerImpl& get_instance()
+        {
+            static TracerImpl instance;
+            return instance;
+        }
+
+        // Small thread ids, in the order threads record their first event.
+        static uint32_t thread_id()
+        {
+            static atomic<uint32_t> threads_count(0);
+            thread_local const uint32_t id = threads_count.fetch_add(1) + 1;
+            return id;
+        }
+
+        // Microseconds since the last clear.
+        int64_t now() const
+        {
+            return chrono::duration_cast<chrono::microseconds>(
+                chrono::steady_clock::now() - start).count();
+        }
+
+        void record(
+            const char*         name,
+            const char          phase,
+            const string&       args)
+        {
+            const Event event = { name, phase, now(), thread_id(), args };
+
+            QMutexLocker locker(&lock);
+            events.push_back(event);
+        }
+
+        QMutex                              lock;
+        vector<Event>                       events;
+        chrono::steady_clock::time_point    start;
+        uint32_t                            main_thread;
+
+      private:
+        TracerImpl()
+          : start(chrono::steady_clock::now())
+          , main_thread(thread_id())
+        {
+        }
+    };
+
+    void write_string(
+        ofstream&               file,
+        const char*             text)
+    {
+        file << '"';
+
+        for (const char* c = text; *c != '\0'; ++c)
+        {
+            if (*c == '"' || *c == '\\')
+                file << '\\';
+            file << *c;
+        }
+
+        file << '"';
+    }
+}
+
+//
+// Tracer class implementation.
+//
+
+void Tracer::clear()
+{
+    TracerImpl& tracer = TracerImpl::get_instance();
+    QMutexLocker locker(&tracer.lock);
+
+    tracer.events.clear();
+    tracer.start = chrono::steady_clock::now();
+    tracer.main_thread = TracerImpl::thread_id();
+}
+
+void Tracer::begin(
+    const char*         name,
+    const string&       args)
+{
+    TracerImpl::get_instance().record(name, 'B', args);
+}
+
+void Tracer::end(const char* name)
+{
+    TracerImpl::get_instance().record(name, 'E', string());
+}
+
+bool Tracer::save(const string& path)
+{
+    ofstream file(path.c_str());
+
+    if (!file)
+        return false;
+
+    TracerImpl& tracer = TracerImpl::get_instance();
+    QMutexLocker locker(&tracer.lock);
+
+    file << "{\"traceEvents\": [\n";
+
+    // Name the threads, so that the viewer tells the workers apart.
+    set<uint32_t> threads;
+
+    for (const Event& event : tracer.events)
+        threads.insert(event.thread);
+
+    bool first = true;
+
+    for (const uint32_t thread : threads)
+    {
+        file
+            << (first ? "" : ",\n")
+            << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << thread
+            << ", \"args\": {\"name\": \""
+            << (thread == tracer.main_thread ? "main" : "worker " + to_string(thread))
+            << "\"}}";
+
+        first = false;
+    }
+
+    for (const Event& event : tracer.events)
+    {
+        file << (first ? "" : ",\n") << "{\"name\": ";
+        write_string(file, event.name);
+        file
+            << ", \"ph\": \"" << event.phase << "\", \"ts\": " << event.timestamp
+            << ", \"pid\": 1, \"tid\": " << event.thread;
+
+        if (!event.args.empty())
+            file << ", \"args\": {" << event.args << "}";
+
+        file << "}";
+
+        first = false;
+    }
+
+    file << "\n]}\n";
+
+    return bool(file);
+}
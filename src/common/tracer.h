@@ -0,0 +1,57 @@
+#ifndef COMMON_TRACER_H
+#define COMMON_TRACER_H
+
+// Standard includes.
+#include <string>
+
+//
+// Timeline of the render phases.
+//
+// Scoped events are recorded with the thread they ran on, and saved in
+// the Chrome trace event format, which chrome://tracing and Perfetto
+// display as a timeline per thread. Events are meant for phases and
+// tiles, not for the inner loops: recording takes a lock.
+//
+
+class Tracer
+{
+  public:
+    // Drop the recorded events, timestamps restart from now.
+    static void clear();
+
+    // Record the beginning and the end of an event of the calling thread.
+    // Arguments are the members of a JSON object, shown with the event.
+    static void begin(
+        const char*         name,
+        const std::string&  args = std::string());
+    static void end(const char* name);
+
+    // Write the recorded events as a JSON trace file.
+    static bool save(const std::string& path);
+};
+
+// Record an event lasting until the end of the scope.
+class TraceScope
+{
+  public:
+    TraceScope(
+        const char*         name,
+        const std::string&  args = std::string())
+      : m_name(name)
+    {
+        Tracer::begin(name, args);
+    }
+
+    ~TraceScope()
+    {
+        Tracer::end(m_name);
+    }
+
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+  private:
+    const char* m_name;
+};
+
+#endif // COMMON_TRACER_H
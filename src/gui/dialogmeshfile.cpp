@@ -14,6 +14,7 @@ DialogMeshFile::DialogMeshFile(QWidget* parent, Scene& scene, SceneMeshFile& sce
     const QString name = QString::fromStdString(scene_file.name);
     const QString path = QString::fromStdString(scene_file.path);
     const Transform& transform = scene_file.transform;
+    const Transform& end_transform = scene_file.end_transform;
     const QString material = QString::fromStdString(scene_file.material);
 
     m_ui->lineEdit_name->setText(name);
@@ -27,6 +28,16 @@ DialogMeshFile::DialogMeshFile(QWidget* parent, Scene& scene, SceneMeshFile& sce
     m_ui->doubleSpinBox_scale_x->setValue(double(transform.scale[0]));
     m_ui->doubleSpinBox_scale_y->setValue(double(transform.scale[1]));
     m_ui->doubleSpinBox_scale_z->setValue(double(transform.scale[2]));
+    m_ui->doubleSpinBox_end_translate_x->setValue(double(end_transform.translate[0]));
+    m_ui->doubleSpinBox_end_translate_y->setValue(double(end_transform.translate[1]));
+    m_ui->doubleSpinBox_end_translate_z->setValue(double(end_transform.translate[2]));
+    m_ui->doubleSpinBox_end_rotate_x->setValue(double(end_transform.rotation[0]));
+    m_ui->doubleSpinBox_end_rotate_y->setValue(double(end_transform.rotation[1]));
+    m_ui->doubleSpinBox_end_rotate_z->setValue(double(end_transform.rotation[2]));
+    m_ui->doubleSpinBox_end_scale_x->setValue(double(end_transform.scale[0]));
+    m_ui->doubleSpinBox_end_scale_y->setValue(double(end_transform.scale[1]));
+    m_ui->doubleSpinBox_end_scale_z->setValue(double(end_transform.scale[2]));
+    m_ui->checkBox_animated->setChecked(scene_file.animated);
     m_ui->smoothShading->setChecked(scene_file.smooth_shading);
 
     for(size_t x = 0; x < scene.materials.size(); ++x)
@@ -57,10 +68,36 @@ void DialogMeshFile::on_buttonBox_accepted()
             m_ui->doubleSpinBox_scale_y->value(),
             m_ui->doubleSpinBox_scale_z->value()));
 
+    const Transform end_transform(
+        vec3(m_ui->doubleSpinBox_end_translate_x->value(),
+            m_ui->doubleSpinBox_end_translate_y->value(),
+            m_ui->doubleSpinBox_end_translate_z->value()),
+        vec3(m_ui->doubleSpinBox_end_rotate_x->value(),
+            m_ui->doubleSpinBox_end_rotate_y->value(),
+            m_ui->doubleSpinBox_end_rotate_z->value()),
+        vec3(m_ui->doubleSpinBox_end_scale_x->value(),
+            m_ui->doubleSpinBox_end_scale_y->value(),
+            m_ui->doubleSpinBox_end_scale_z->value()));
+
     m_scene_file.name = m_ui->lineEdit_name->text().toStdString();
     m_scene_file.path = m_ui->lineEdit_path->text().toStdString();
     m_scene_file.transform = transform;
     m_scene_file.material = m_ui->comboBox_material->currentText().toStdString();
     m_scene_file.smooth_shading = m_ui->smoothShading->isChecked();
+    m_scene_file.animated = m_ui->checkBox_animated->isChecked();
+    m_scene_file.end_transform = m_scene_file.animated ? end_transform : transform;
+}
+
+void DialogMeshFile::on_checkBox_animated_toggled(bool checked)
+{
+    m_ui->doubleSpinBox_end_translate_x->setEnabled(checked);
+    m_ui->doubleSpinBox_end_translate_y->setEnabled(checked);
+    m_ui->doubleSpinBox_end_translate_z->setEnabled(checked);
+    m_ui->doubleSpinBox_end_rotate_x->setEnabled(checked);
+    m_ui->doubleSpinBox_end_rotate_y->setEnabled(checked);
+    m_ui->doubleSpinBox_end_rotate_z->setEnabled(checked);
+    m_ui->doubleSpinBox_end_scale_x->setEnabled(checked);
+    m_ui->doubleSpinBox_end_scale_y->setEnabled(checked);
+    m_ui->doubleSpinBox_end_scale_z->setEnabled(checked);
 }
 
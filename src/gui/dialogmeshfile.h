@@ -23,6 +23,7 @@ class DialogMeshFile : public QDialog
 
   private slots:
     void on_buttonBox_accepted();
+    void on_checkBox_animated_toggled(bool checked);
 
   private:
     Ui::DialogMeshFile* m_ui;
@@ -19,6 +19,7 @@ DialogObject::DialogObject(QWidget *p, Scene *s, int i) :
 
         const QString name = QString::fromStdString(object.name);
         const Transform& transform = object.transform;
+        const Transform& end_transform = object.end_transform;
         const ObjectType type = object.type;
         const QString material = QString::fromStdString(object.material);
 
@@ -37,6 +38,16 @@ DialogObject::DialogObject(QWidget *p, Scene *s, int i) :
         ui->doubleSpinBox_scale_x->setValue(double(transform.scale[0]));
         ui->doubleSpinBox_scale_y->setValue(double(transform.scale[1]));
         ui->doubleSpinBox_scale_z->setValue(double(transform.scale[2]));
+        ui->doubleSpinBox_end_translate_x->setValue(double(end_transform.translate[0]));
+        ui->doubleSpinBox_end_translate_y->setValue(double(end_transform.translate[1]));
+        ui->doubleSpinBox_end_translate_z->setValue(double(end_transform.translate[2]));
+        ui->doubleSpinBox_end_rotate_x->setValue(double(end_transform.rotation[0]));
+        ui->doubleSpinBox_end_rotate_y->setValue(double(end_transform.rotation[1]));
+        ui->doubleSpinBox_end_rotate_z->setValue(double(end_transform.rotation[2]));
+        ui->doubleSpinBox_end_scale_x->setValue(double(end_transform.scale[0]));
+        ui->doubleSpinBox_end_scale_y->setValue(double(end_transform.scale[1]));
+        ui->doubleSpinBox_end_scale_z->setValue(double(end_transform.scale[2]));
+        ui->checkBox_animated->setChecked(object.animated);
 
         switch(type)
         {
@@ -109,12 +120,26 @@ void DialogObject::on_buttonBox_accepted()
             ui->doubleSpinBox_scale_y->value(),
             ui->doubleSpinBox_scale_z->value()));
 
+    const Transform end_transform(
+        vec3(ui->doubleSpinBox_end_translate_x->value(),
+            ui->doubleSpinBox_end_translate_y->value(),
+            ui->doubleSpinBox_end_translate_z->value()),
+        vec3(ui->doubleSpinBox_end_rotate_x->value(),
+            ui->doubleSpinBox_end_rotate_y->value(),
+            ui->doubleSpinBox_end_rotate_z->value()),
+        vec3(ui->doubleSpinBox_end_scale_x->value(),
+            ui->doubleSpinBox_end_scale_y->value(),
+            ui->doubleSpinBox_end_scale_z->value()));
+
     SceneObject so(
         ui->lineEdit_name->text().toStdString(),
         transform,
         ot,
         ui->comboBox_material->currentText().toStdString());
 
+    so.animated = ui->checkBox_animated->isChecked();
+    so.end_transform = so.animated ? end_transform : transform;
+
     if (ot == ObjectType::CYLINDER)
     {
         so.subdivisions = std::size_t(ui->spinBox_subdivisions->value());
@@ -129,6 +154,19 @@ void DialogObject::on_buttonBox_accepted()
         scene->objects.push_back(so);
 }
 
+void DialogObject::on_checkBox_animated_toggled(bool checked)
+{
+    ui->doubleSpinBox_end_translate_x->setEnabled(checked);
+    ui->doubleSpinBox_end_translate_y->setEnabled(checked);
+    ui->doubleSpinBox_end_translate_z->setEnabled(checked);
+    ui->doubleSpinBox_end_rotate_x->setEnabled(checked);
+    ui->doubleSpinBox_end_rotate_y->setEnabled(checked);
+    ui->doubleSpinBox_end_rotate_z->setEnabled(checked);
+    ui->doubleSpinBox_end_scale_x->setEnabled(checked);
+    ui->doubleSpinBox_end_scale_y->setEnabled(checked);
+    ui->doubleSpinBox_end_scale_z->setEnabled(checked);
+}
+
 void DialogObject::on_comboBox_object_type_currentIndexChanged(int index)
 {
     ObjectType ot;
@@ -27,6 +27,8 @@ private slots:
 
     void on_comboBox_object_type_currentIndexChanged(int index);
 
+    void on_checkBox_animated_toggled(bool checked);
+
 private:
     QWidget *parent;
     Scene *scene;
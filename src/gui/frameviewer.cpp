@@ -46,6 +46,12 @@ void FrameViewer::clear()
     m_image.fill(QColor(0, 0, 0));
 }
 
+void FrameViewer::show_image(const QImage& image)
+{
+    m_image = image.convertToFormat(QImage::Format_RGB888);
+    repaint();
+}
+
 void FrameViewer::on_render_begin(const size_t width, const size_t height)
 {
     resize(width, height);
@@ -27,6 +27,9 @@ class FrameViewer : public QWidget
 
     void clear();
 
+    // Display a whole image, such as a render heatmap.
+    void show_image(const QImage& image);
+
   public slots:
 
     // Clear the frame.
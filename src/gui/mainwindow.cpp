@@ -5,6 +5,7 @@
 
 // couscous includes.
 #include "common/logger.h"
+#include "common/tracer.h"
 #include "gui/scene.h"
 #include "gui/dialogmeshfile.h"
 #include "renderer/camera.h"
@@ -49,6 +50,10 @@ MainWindow::MainWindow(QWidget *parent)
     // Connect widgets events.
     connect(ui->pushButton_render, SIGNAL(released()), SLOT(slot_do_render()));
     connect(ui->actionSave_As_Image, SIGNAL(triggered()), SLOT(slot_save_as_image()));
+    connect(ui->actionRender_All_Cameras, SIGNAL(triggered()), SLOT(slot_do_batch_render()));
+    connect(ui->actionRender_Sequence, SIGNAL(triggered()), SLOT(slot_do_sequence_render()));
+    connect(ui->actionSave_Render_Trace, SIGNAL(triggered()), SLOT(slot_save_render_trace()));
+    connect(ui->actionShow_Render_Heatmap, SIGNAL(triggered(bool)), SLOT(slot_show_render_heatmap()));
     connect(ui->pushButton_zoom_in, SIGNAL(released()), SLOT(slot_zoom_in()));
     connect(ui->pushButton_zoom_out, SIGNAL(released()), SLOT(slot_zoom_out()));
     connect(ui->actionRun_Unit_Test, SIGNAL(triggered()), SLOT(slot_run_unit_test()));
@@ -67,6 +72,12 @@ MainWindow::MainWindow(QWidget *parent)
         &m_frame_viewer,
         SLOT(update_tile(size_t, size_t, size_t, size_t, QImage)));
 
+    connect(
+        &m_render,
+        SIGNAL(on_frame_begin(size_t, size_t)),
+        &m_frame_viewer,
+        SLOT(on_render_begin(size_t, size_t)));
+
     connect(ui->treeWidget_scene, SIGNAL(customContextMenuRequested(const QPoint&)),
             SLOT(slot_treeWidget_customContextMenuRequested(const QPoint&)));
 
@@ -92,6 +103,7 @@ MainWindow::MainWindow(QWidget *parent)
     debug_view_action_group->addAction(ui->actionDisplayDirectSpecular);
     debug_view_action_group->addAction(ui->actionDisplayDirectPhong);
     debug_view_action_group->addAction(ui->actionDisplayIndirectLight);
+    debug_view_action_group->addAction(ui->actionDisplayProgressivePhotonMap);
     debug_view_action_group->addAction(ui->actionDisplayNone);
 
     // Map log level events.
@@ -204,64 +216,254 @@ void MainWindow::slot_do_render()
 {
     ui->pushButton_render->setEnabled(false);
 
-    const size_t width     = size_t(ui->spinBox_width->value());
-    const size_t height    = size_t(ui->spinBox_height->value());
-    const size_t samples   = size_t(ui->spinBox_spp->value());
-    const size_t direct_light_rays_count   = size_t(ui->spinBox_dlrc->value());
-    const size_t indirect_light_rays_count = size_t(ui->spinBox_idlrc->value());
-    const size_t photons   = size_t(ui->spinBox_photons->value());
+    const RenderSettings settings = selected_render_settings();
+
     const float  pos_x     = float(ui->doubleSpinBox_position_x->value());
     const float  pos_y     = float(ui->doubleSpinBox_position_y->value());
     const float  pos_z     = float(ui->doubleSpinBox_position_z->value());
     const float  yaw       = float(ui->doubleSpinBox_yaw->value());
     const float  pitch     = float(ui->doubleSpinBox_pitch->value());
     const float  fov       = float(ui->doubleSpinBox_fov->value());
-    const bool   parallel  = ui->checkBox_parallel_rendering->isChecked();
 
-    m_image = QImage(int(width), int(height), QImage::Format_RGB888);
+    m_image = QImage(int(settings.width), int(settings.height), QImage::Format_RGB888);
 
     // Create the camera.
     Camera camera(vec3(pos_x, pos_y, pos_z), vec3(0.0f, 1.0f, 0.0f),
-        yaw, pitch, fov, width, height);
+        yaw, pitch, fov, settings.width, settings.height);
 
     // Create the scene.
     Logger::log_info("creating the scene...");
+    Tracer::clear();
+    Tracer::begin("create scene");
     MeshGroup world;
-    scene.create_scene(world);
+    InstanceGroup instances;
+    scene.create_scene(world, instances);
+    Tracer::end("create scene");
 
-    if (world.empty())
+    if (world.empty() && instances.empty())
     {
         Logger::log_warning("nothing to render.");
         ui->pushButton_render->setEnabled(true);
         return;
     }
 
-    m_frame_viewer.on_render_begin(width, height);
-
     m_render.get_render_image(
-        width,
-        height,
-        samples,
+        settings,
         camera,
         world,
-        direct_light_rays_count,
-        indirect_light_rays_count,
-        photons,
-        parallel,
-        ui->actionDisplayNormals->isChecked(),
-        ui->actionDisplayAlbedo->isChecked(),
-        ui->actionDisplayPhotonMap->isChecked(),
-        ui->actionDisplayDirectDiffuse->isChecked(),
-        ui->actionDisplayDirectSpecular->isChecked(),
-        ui->actionDisplayDirectPhong->isChecked(),
-        ui->actionDisplayIndirectLight->isChecked(),
+        instances,
         m_image,
         m_statusBarProgress);
 
     ui->pushButton_render->setEnabled(true);
+    update_viewer();
+}
+
+// Render every camera of the scene and save the images.
+void MainWindow::slot_do_batch_render()
+{
+    if (scene.cameras.empty())
+    {
+        Logger::log_warning("the scene has no camera.");
+        return;
+    }
+
+    ui->pushButton_render->setEnabled(false);
+
+    const RenderSettings settings = selected_render_settings();
+
+    // Create the views.
+    std::vector<RenderView> views;
+
+    for (size_t i = 0; i < scene.cameras.size(); ++i)
+    {
+        const SceneCamera& cam = scene.cameras.at(i);
+
+        RenderView view = {
+            Camera(cam.position, vec3(0.0f, 1.0f, 0.0f),
+                cam.yaw, cam.pitch, cam.fov, cam.width, cam.height),
+            cam.width,
+            cam.height
+        };
+
+        views.push_back(view);
+    }
+
+    // Create the scene.
+    Logger::log_info("creating the scene...");
+    Tracer::clear();
+    Tracer::begin("create scene");
+    MeshGroup world;
+    InstanceGroup instances;
+    scene.create_scene(world, instances);
+    Tracer::end("create scene");
+
+    if (world.empty() && instances.empty())
+    {
+        Logger::log_warning("nothing to render.");
+        ui->pushButton_render->setEnabled(true);
+        return;
+    }
+
+    std::vector<QImage> images;
+
+    m_render.get_batch_images(
+        settings,
+        views,
+        world,
+        instances,
+        images,
+        m_statusBarProgress);
+
+    ui->pushButton_render->setEnabled(true);
+
+    if (images.empty())
+        return;
+
+    std::vector<QString> names;
+
+    for (size_t i = 0; i < images.size(); ++i)
+        names.push_back(QString::fromStdString(scene.cameras.at(i).name));
+
+    save_images(images, names);
+    update_viewer();
+}
+
+// Render a sequence flying through the cameras of the scene and save the frames.
+void MainWindow::slot_do_sequence_render()
+{
+    if (scene.cameras.empty())
+    {
+        Logger::log_warning("the scene has no camera.");
+        return;
+    }
+
+    bool ok = false;
+    const int frames_count = QInputDialog::getInt(
+        this,
+        tr("Render Sequence"),
+        tr("Frames:"),
+        24, 1, 10000, 1, &ok);
+
+    if (!ok)
+        return;
+
+    ui->pushButton_render->setEnabled(false);
+
+    const RenderSettings settings = selected_render_settings();
+
+    // Create the scene and its animation.
+    Logger::log_info("creating the scene...");
+    MeshGroup world;
+    InstanceGroup instances;
+    RenderSequence sequence;
+    Tracer::clear();
+    Tracer::begin("create scene");
+    scene.create_sequence(size_t(frames_count), settings.width, settings.height, world, instances, sequence);
+    Tracer::end("create scene");
+
+    if (world.empty() && instances.empty())
+    {
+        Logger::log_warning("nothing to render.");
+        ui->pushButton_render->setEnabled(true);
+        return;
+    }
+
+    std::vector<QImage> images;
+
+    m_render.get_sequence_images(
+        settings,
+        sequence,
+        world,
+        instances,
+        images,
+        m_statusBarProgress);
+
+    ui->pushButton_render->setEnabled(true);
+
+    std::vector<QString> names;
+
+    for (size_t i = 0; i < images.size(); ++i)
+        names.push_back(QString("frame_%1").arg(int(i), 4, 10, QChar('0')));
+
+    save_images(images, names);
+    update_viewer();
+}
+
+void MainWindow::save_images(
+    const std::vector<QImage>&      images,
+    const std::vector<QString>&     names)
+{
+    if (images.empty())
+        return;
+
+    // The last frame stays in the viewer.
+    m_image = images.back();
+
+    const QString directory = QFileDialog::getExistingDirectory(
+        this,
+        tr("Save Images"),
+        QDir::currentPath());
+
+    if (directory.isEmpty())
+        return;
+
+    for (size_t i = 0; i < images.size(); ++i)
+    {
+        const QString path = directory + "/" + names[i] + ".png";
+
+        if (!images[i].save(path))
+            Logger::log_error("could not save " + path.toStdString());
+    }
+
+    Logger::log_info(to_string(images.size()) + " images saved in " + directory.toStdString() + ".");
 }
 
-// Save the last rendered image.
+// Returns the render settings entered in the window.
+RenderSettings MainWindow::selected_render_settings() const
+{
+    RenderSettings settings;
+    settings.width = size_t(ui->spinBox_width->value());
+    settings.height = size_t(ui->spinBox_height->value());
+    settings.spp = size_t(ui->spinBox_spp->value());
+    settings.direct_light_rays_count = size_t(ui->spinBox_dlrc->value());
+    settings.indirect_light_rays_count = size_t(ui->spinBox_idlrc->value());
+    settings.photons_count = size_t(ui->spinBox_photons->value());
+    settings.caustic_photons_count = size_t(ui->spinBox_caustic_photons->value());
+    settings.photons_importance = ui->checkBox_photons_importance->isChecked();
+    settings.reuse_photons = ui->checkBox_reuse_photons->isChecked();
+    settings.parallel = ui->checkBox_parallel_rendering->isChecked();
+    settings.irradiance_cache = ui->checkBox_irradiance_cache->isChecked();
+    settings.stream_tracing = ui->checkBox_stream_tracing->isChecked();
+    settings.integrator = selected_integrator();
+
+    return settings;
+}
+
+// Returns the integrator matching the selected debug view.
+IntegratorType MainWindow::selected_integrator() const
+{
+    if (ui->actionDisplayNormals->isChecked())
+        return IntegratorType::Normal;
+    else if (ui->actionDisplayAlbedo->isChecked())
+        return IntegratorType::Albedo;
+    else if (ui->actionDisplayPhotonMap->isChecked())
+        return IntegratorType::PhotonMap;
+    else if (ui->actionDisplayDirectDiffuse->isChecked())
+        return IntegratorType::DirectDiffuse;
+    else if (ui->actionDisplayDirectSpecular->isChecked())
+        return IntegratorType::DirectSpecular;
+    else if (ui->actionDisplayDirectPhong->isChecked())
+        return IntegratorType::DirectPhong;
+    else if (ui->actionDisplayIndirectLight->isChecked())
+        return IntegratorType::IndirectLight;
+    else if (ui->actionDisplayProgressivePhotonMap->isChecked())
+        return IntegratorType::ProgressivePhotonMap;
+    else
+        return IntegratorType::Final;
+}
+
+// Save the last rendered image, or its heatmap when it is shown.
 void MainWindow::slot_save_as_image()
 {
     // Create file filters.
@@ -297,7 +499,50 @@ void MainWindow::slot_save_as_image()
         path += selected_filter.mid(begin, end - begin);
     }
 
-    m_image.save(path);
+    displayed_image().save(path);
+}
+
+// Save the timeline of the last render, for chrome://tracing or Perfetto.
+void MainWindow::slot_save_render_trace()
+{
+    QString path = QFileDialog::getSaveFileName(
+        this,
+        tr("Save Render Trace"),
+        QDir::currentPath(),
+        "JSON (*.json);;All Files (*.*)");
+
+    if (path.isEmpty())
+        return;
+
+    if (QFileInfo(path).suffix().isEmpty())
+        path += ".json";
+
+    if (Tracer::save(path.toStdString()))
+        Logger::log_info("render trace saved in " + path.toStdString() + ".");
+    else
+        Logger::log_error("could not save " + path.toStdString());
+}
+
+// Switch the viewer between the last rendered image and its heatmap.
+void MainWindow::slot_show_render_heatmap()
+{
+    update_viewer();
+}
+
+const QImage& MainWindow::displayed_image() const
+{
+    const vector<QImage>& heatmaps = m_render.heatmaps();
+
+    // Heatmaps are only shown for tiled renders.
+    if (ui->actionShow_Render_Heatmap->isChecked() && !heatmaps.empty() && !heatmaps.back().isNull())
+        return heatmaps.back();
+
+    return m_image;
+}
+
+void MainWindow::update_viewer()
+{
+    m_frame_viewer.show_image(displayed_image());
 }
 
 // Zoom in the viewport.
@@ -6,6 +6,7 @@
 #include "gui/scene.h"
 #include "gui/dialogmaterial.h"
 #include "gui/dialogobject.h"
+#include "renderer/integrator.h"
 #include "renderer/render.h"
 #include "renderer/gridaccelerator.h"
 
@@ -13,6 +14,7 @@
 #include <QFileDialog>
 #include <QTime>
 #include <QImage>
+#include <QInputDialog>
 #include <QMainWindow>
 #include <QMessageBox>
 #include <QProgressBar>
@@ -45,9 +47,25 @@ class MainWindow : public QMainWindow
 
     Scene scene;
 
+    RenderSettings selected_render_settings() const;
+
+    // The last rendered image, or its heatmap when it is shown.
+    const QImage& displayed_image() const;
+    void update_viewer();
+    IntegratorType selected_integrator() const;
+
+    // Ask for a directory and save the images there as <name>.png.
+    void save_images(
+        const std::vector<QImage>&      images,
+        const std::vector<QString>&     names);
+
   private slots:
     void slot_do_render();
+    void slot_do_batch_render();
+    void slot_do_sequence_render();
     void slot_save_as_image();
+    void slot_save_render_trace();
+    void slot_show_render_heatmap();
     void slot_zoom_in();
     void slot_zoom_out();
     void slot_run_unit_test();
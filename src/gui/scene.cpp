@@ -7,6 +7,10 @@
 // glm includes.
 #include <glm/gtc/matrix_transform.hpp>
 
+// Standard includes.
+#include <map>
+#include <utility>
+
 using namespace std;
 using namespace glm;
 
@@ -65,6 +69,14 @@ mat4 Transform::matrix() const
     return transform;
 }
 
+Transform Transform::interpolate(const Transform& end, const float t) const
+{
+    return Transform(
+        mix(translate, end.translate, t),
+        mix(rotation, end.rotation, t),
+        mix(scale, end.scale, t));
+}
+
 
 
 //
@@ -80,6 +92,8 @@ SceneObject::SceneObject(
   , transform(transform)
   , type(ot)
   , material(material_name)
+  , animated(false)
+  , end_transform(transform)
   , subdivisions(0)
   , width(0.0f)
   , height(0.0f)
@@ -98,10 +112,15 @@ SceneMeshFile::SceneMeshFile(
   , transform(transform)
   , material(material_name)
   , smooth_shading(smooth_shading)
+  , animated(false)
+  , end_transform(transform)
 {
 }
 
-void Scene::create_scene(MeshGroup &world)
+void Scene::create_scene(
+    MeshGroup&          world,
+    InstanceGroup&      instances,
+    vector<size_t>*     first_triangles)
 {
     SceneMaterial *material;
     SceneObject *object;
@@ -129,6 +148,9 @@ void Scene::create_scene(MeshGroup &world)
     {
         object = &objects.at(i);
 
+        if(first_triangles)
+            first_triangles->push_back(world.size());
+
         const mat4 transform = object->transform.matrix();
 
         shared_ptr<Material> mat_default(
@@ -161,10 +183,27 @@ void Scene::create_scene(MeshGroup &world)
         }
     }
 
+    // Count the uses of each mesh file that could be instanced.
+    typedef pair<string, bool> MeshKey;
+    map<MeshKey, size_t> mesh_uses;
+    map<MeshKey, shared_ptr<InstancedMesh>> instanced_meshes;
+
     for(i = 0 ; i < object_files.size() ; ++i)
     {
         const auto& obj = object_files.at(i);
 
+        if(!obj.animated)
+            ++mesh_uses[MeshKey(obj.path, obj.smooth_shading)];
+    }
+
+    for(i = 0 ; i < object_files.size() ; ++i)
+    {
+        const auto& obj = object_files.at(i);
+        const MeshKey key(obj.path, obj.smooth_shading);
+
+        if(first_triangles)
+            first_triangles->push_back(world.size());
+
         shared_ptr<Material> mat_default(
             new Material(
                 vec3(1.0f, 0.0f, 1.0f),
@@ -179,6 +218,43 @@ void Scene::create_scene(MeshGroup &world)
             }
         }
 
+        // Lights and caustics are only fetched from the world:
+        // emissive and metallic meshes are not instanced.
+        if(!obj.animated
+            && mesh_uses[key] > 1
+            && mat_default->emission == vec3(0.0f)
+            && !mat_default->metallic)
+        {
+            shared_ptr<InstancedMesh>& mesh = instanced_meshes[key];
+
+            if(!mesh)
+            {
+                const MeshOffFile data = read_off(obj.path);
+
+                // The shared mesh stays in object space.
+                MeshGroup triangles;
+                create_triangle_mesh(triangles,
+                     data.faces.size() / 3,
+                     data.vertices.size(),
+                     data.faces.data(),
+                     data.vertices.data(),
+                     obj.smooth_shading ? data.vertex_normals.data() : data.face_normals.data(),
+                     mat_default,
+                     mat4(1.0f),
+                     obj.smooth_shading);
+
+                if(triangles.empty())
+                    continue;
+
+                mesh = make_shared<InstancedMesh>(triangles);
+            }
+
+            instances.push_back(
+                make_shared<MeshInstance>(mesh, obj.transform.matrix(), mat_default));
+
+            continue;
+        }
+
         const MeshOffFile data = read_off(obj.path);
 
         create_triangle_mesh(world,
@@ -191,6 +267,92 @@ void Scene::create_scene(MeshGroup &world)
              obj.transform.matrix(),
              obj.smooth_shading);
     }
+
+    if(first_triangles)
+        first_triangles->push_back(world.size());
+}
+
+void Scene::create_sequence(
+    const size_t        frames_count,
+    const size_t        width,
+    const size_t        height,
+    MeshGroup&          world,
+    InstanceGroup&      instances,
+    RenderSequence&     sequence)
+{
+    assert(frames_count > 0);
+
+    vector<size_t> first_triangles;
+    create_scene(world, instances, &first_triangles);
+
+    sequence.views.clear();
+    sequence.animated.clear();
+
+    // Position of a frame in the sequence.
+    auto frame_time = [&](const size_t frame)
+    {
+        return frames_count > 1
+            ? static_cast<float>(frame) / static_cast<float>(frames_count - 1)
+            : 0.0f;
+    };
+
+    // Record the triangles and the transform of each frame of an animated mesh.
+    auto add_animated = [&](const size_t index, const Transform& start, const Transform& end)
+    {
+        const size_t begin = first_triangles[index];
+        const size_t end_triangle = first_triangles[index + 1];
+
+        if(begin == end_triangle)
+            return;
+
+        AnimatedMesh animated;
+        animated.mesh = world[begin]->mesh();
+        animated.triangles.assign(world.begin() + begin, world.begin() + end_triangle);
+
+        for(size_t f = 0 ; f < frames_count ; ++f)
+            animated.transforms.push_back(start.interpolate(end, frame_time(f)).matrix());
+
+        sequence.animated.push_back(animated);
+    };
+
+    for(size_t i = 0 ; i < objects.size() ; ++i)
+    {
+        if(objects.at(i).animated)
+            add_animated(i, objects.at(i).transform, objects.at(i).end_transform);
+    }
+
+    for(size_t i = 0 ; i < object_files.size() ; ++i)
+    {
+        if(object_files.at(i).animated)
+            add_animated(objects.size() + i, object_files.at(i).transform, object_files.at(i).end_transform);
+    }
+
+    // Fly through the cameras.
+    for(size_t f = 0 ; f < frames_count && !cameras.empty() ; ++f)
+    {
+        const float key = frame_time(f) * static_cast<float>(cameras.size() - 1);
+        const size_t k = std::min(static_cast<size_t>(key), cameras.size() - 1);
+        const size_t next = std::min(k + 1, cameras.size() - 1);
+        const float t = key - static_cast<float>(k);
+
+        const SceneCamera& a = cameras.at(k);
+        const SceneCamera& b = cameras.at(next);
+
+        RenderView view = {
+            Camera(
+                mix(a.position, b.position, t),
+                vec3(0.0f, 1.0f, 0.0f),
+                mix(a.yaw, b.yaw, t),
+                mix(a.pitch, b.pitch, t),
+                mix(a.fov, b.fov, t),
+                width,
+                height),
+            width,
+            height
+        };
+
+        sequence.views.push_back(view);
+    }
 }
 
 Scene Scene::cornell_box()
@@ -549,6 +711,13 @@ Scene Scene::cornell_box_suzanne()
             vec3(50.0f)),
         "white");
 
+    // Suzanne turns to the right in sequences.
+    scene.object_files.back().animated = true;
+    scene.object_files.back().end_transform = Transform(
+        vec3(0.0f, 100.0f, 0.0f),
+        vec3(0.0f, 90.0f, 0.0f),
+        vec3(50.0f));
+
     scene.cameras.push_back(SceneCamera("CAM_1",
         vec3(0.0f, 100.0f, 385.0f),
         -90.0f,
@@ -736,6 +905,48 @@ Scene Scene::sphere()
     return scene;
 }
 
+namespace
+{
+    typedef Scene (*PresetFactory)();
+
+    const pair<const char*, PresetFactory> presets[] =
+    {
+        make_pair("cornell_box", &Scene::cornell_box),
+        make_pair("cornell_box_window", &Scene::cornell_box_window),
+        make_pair("cornell_box_metal", &Scene::cornell_box_metal),
+        make_pair("cornell_box_suzanne", &Scene::cornell_box_suzanne),
+        make_pair("cornell_box_orange_and_blue", &Scene::cornell_box_orange_and_blue),
+        make_pair("simple_cube", &Scene::simple_cube),
+        make_pair("sphere", &Scene::sphere)
+    };
+}
+
+vector<string> Scene::preset_names()
+{
+    vector<string> names;
+
+    for (const auto& preset : presets)
+        names.push_back(preset.first);
+
+    return names;
+}
+
+bool Scene::preset(
+    const string&       name,
+    Scene&              scene)
+{
+    for (const auto& preset : presets)
+    {
+        if (name == preset.first)
+        {
+            scene = preset.second();
+            return true;
+        }
+    }
+
+    return false;
+}
+
 SceneCamera::SceneCamera(
     const string&       name,
     const vec3&         position,
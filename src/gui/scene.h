@@ -2,7 +2,9 @@
 #define SCENE_H
 
 // couscous includes.
+#include "renderer/instance.h"
 #include "renderer/material.h"
+#include "renderer/sequence.h"
 #include "renderer/visualobject.h"
 
 // glm includes.
@@ -56,6 +58,9 @@ class Transform
 
     glm::mat4 matrix() const;
 
+    // Linear interpolation toward another transform, t in [0, 1].
+    Transform interpolate(const Transform& end, const float t) const;
+
     glm::vec3 translate;
     glm::vec3 rotation;
     glm::vec3 scale;
@@ -82,6 +87,11 @@ class SceneObject
     ObjectType      type;
     std::string     material;
 
+    // Animated objects move from transform to end_transform
+    // over the frames of a sequence.
+    bool            animated;
+    Transform       end_transform;
+
     std::size_t     subdivisions;
     float           width;
     float           height;
@@ -107,6 +117,11 @@ class SceneMeshFile
     Transform                   transform;
     std::string                 material;
     bool                        smooth_shading;
+
+    // Animated meshes move from transform to end_transform
+    // over the frames of a sequence.
+    bool                        animated;
+    Transform                   end_transform;
 };
 
 //
@@ -137,7 +152,25 @@ class SceneCamera
 class Scene
 {
   public:
-    void create_scene(MeshGroup& world);
+    // Mesh files used more than once are instanced: the mesh is loaded
+    // once and each use is a transformed instance of it. Animated,
+    // emissive and metallic meshes are always copied into the world.
+    // If first_triangles is given, it receives the index in the world of the
+    // first triangle of each object then of each object file, and the world size.
+    void create_scene(
+        MeshGroup&                  world,
+        InstanceGroup&              instances,
+        std::vector<size_t>*        first_triangles = nullptr);
+
+    // Create the world at the first frame, and a sequence of frames_count
+    // frames. Cameras are keyframes spread evenly over the sequence.
+    void create_sequence(
+        const size_t                frames_count,
+        const size_t                width,
+        const size_t                height,
+        MeshGroup&                  world,
+        InstanceGroup&              instances,
+        RenderSequence&             sequence);
 
     // Create a cornell box scene.
     static Scene cornell_box();
@@ -148,6 +181,15 @@ class Scene
     static Scene simple_cube();
     static Scene sphere();
 
+    // Names of the preset scenes, such as "cornell_box".
+    static std::vector<std::string> preset_names();
+
+    // Set the scene to the preset of the given name.
+    // Returns false if there is no such preset.
+    static bool preset(
+        const std::string&          name,
+        Scene&                      scene);
+
     std::vector<SceneMaterial>      materials;
     std::vector<SceneObject>        objects;
     std::vector<SceneMeshFile>      object_files;
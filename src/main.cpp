@@ -1,9 +1,86 @@
 // coucous includes.
+#include "common/logger.h"
 #include "gui/mainwindow.h"
+#include "gui/scene.h"
+#include "renderer/camera.h"
+#include "renderer/render.h"
 #include "test/test.h"
 
 // Qt includes.
 #include <QApplication>
+#include <QImage>
+#include <QProgressBar>
+
+// glm includes.
+#include <glm/glm.hpp>
+
+// Standard includes.
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace
+{
+    // Render the first camera of a preset scene with the default settings,
+    // and save the image and, if a path is given, its render time heatmap.
+    int render_preset(
+        const char*     preset,
+        const char*     image_path,
+        const char*     heatmap_path)
+    {
+        Scene scene;
+
+        if (!Scene::preset(preset, scene) || scene.cameras.empty())
+        {
+            std::string names;
+
+            for (const std::string& name : Scene::preset_names())
+                names += " " + name;
+
+            Logger::log_error(std::string("unknown preset ") + preset + ", presets are:" + names);
+            return 1;
+        }
+
+        const SceneCamera& cam = scene.cameras.front();
+
+        RenderSettings settings;
+        settings.width = cam.width;
+        settings.height = cam.height;
+
+        const Camera camera(cam.position, glm::vec3(0.0f, 1.0f, 0.0f),
+            cam.yaw, cam.pitch, cam.fov, cam.width, cam.height);
+
+        Logger::log_info("creating the scene...");
+        MeshGroup world;
+        InstanceGroup instances;
+        scene.create_scene(world, instances);
+
+        Render render;
+        QProgressBar progress;
+        QImage image;
+
+        render.get_render_image(settings, camera, world, instances, image, progress);
+
+        if (image.isNull() || !image.save(image_path))
+        {
+            Logger::log_error(std::string("could not save ") + image_path);
+            return 1;
+        }
+
+        if (heatmap_path != nullptr)
+        {
+            const std::vector<QImage>& heatmaps = render.heatmaps();
+
+            if (heatmaps.empty() || heatmaps[0].isNull() || !heatmaps[0].save(heatmap_path))
+            {
+                Logger::log_error(std::string("could not save ") + heatmap_path);
+                return 1;
+            }
+        }
+
+        return 0;
+    }
+}
 
 int main(int argc, char *argv[])
 {
@@ -13,6 +90,13 @@ int main(int argc, char *argv[])
     }
 
     QApplication a(argc, argv);
+
+    // couscous --render <preset> <image> [<heatmap>]
+    if ((argc == 4 || argc == 5) && strcmp(argv[1], "--render") == 0)
+    {
+        return render_preset(argv[2], argv[3], argc == 5 ? argv[4] : nullptr);
+    }
+
     MainWindow w;
     w.show();
 
@@ -4,13 +4,27 @@
 // couscous includes.
 #include "common/logger.h"
 #include "renderer/ray.h"
+#include "renderer/raypacket.h"
+#include "renderer/stats.h"
 #include "renderer/visualobject.h"
 
 // glm includes.
 #include <glm/glm.hpp>
 
+// Qt includes.
+#include <QFuture>
+#ifdef _MSC_VER
+#include <QtConcurrent/QtConcurrentRun>
+#else
+#include <QtConcurrentRun>
+#endif
+
 // Standard includes.
+#include <algorithm>
+#include <atomic>
+#include <cassert>
 #include <cmath>
+#include <limits>
 
 // Uncomment this if you don't want to use the grid
 // accelerator while rendering.
@@ -19,65 +33,220 @@
 using namespace glm;
 using namespace std;
 
-bool Voxel::hit(
-    const Ray&                          r,
-    const float                         tmin,
-    HitRecord&                          rec) const
+// Shapes processed by a job while building the grid.
+#define GRID_BUILD_CHUNK_SIZE 16384
+
+// Cells of the grid with at least this number of
+// shapes are subdivided by a grid of their own.
+#define GRID_SUBDIVIDE_MIN_SHAPES 32
+
+// Maximum number of voxels per axis of a cell grid.
+#define GRID_SUBDIVIDE_MAX_RESOLUTION 16
+
+// Cells subdivided by a job while building the grid.
+#define GRID_SUBDIVIDE_CHUNK_SIZE 64
+
+// The grid is relinked by a refit once the overflow
+// lists hold this fraction of the ids of the voxels.
+#define GRID_REFIT_RELINK_RATIO 0.25f
+
+// The arrays of the cell grids are compacted once the replaced
+// grids hold this fraction of them.
+#define GRID_REFIT_COMPACT_RATIO 0.5f
+
+namespace
 {
-    if (objects.empty())
-        return false;
+    // Run job(begin, end) over chunks of [0, count),
+    // on several threads when there is more than one chunk.
+    template <typename Job>
+    void run_chunks(
+        const size_t    count,
+        const size_t    chunk_size,
+        const Job&      job)
+    {
+        vector<QFuture<void>> threads;
 
-    bool hit_something = false;
+        for (size_t begin = 0; begin < count; begin += chunk_size)
+        {
+            const size_t end = std::min(begin + chunk_size, count);
+
+            if (count > chunk_size)
+                threads.push_back(QtConcurrent::run([&job, begin, end]() { job(begin, end); }));
+            else
+                job(begin, end);
+        }
 
-    // Test intersection will all the shapes in the voxel.
-    for (size_t i = 0, e = objects.size(); i < e; ++i)
+        for (size_t i = 0; i < threads.size(); ++i)
+        {
+            threads.at(i).waitForFinished();
+        }
+    }
+
+    // Number of voxels per axis of a grid over the given extent, for
+    // shapes_count shapes, with at most max_resolution voxels per axis.
+    //
+    // The goal is to have a cubic voxel if possible.
+    // If meshes are uniform and uniformly spreaded,
+    // using the number of meshes to deduce the number
+    // of voxels is a good idea.
+    ivec3 grid_resolution(
+        const vec3&     extent,
+        const size_t    shapes_count,
+        const int       max_resolution)
     {
-        const shared_ptr<VisualObject>& shape = objects[i];
-        hit_something |= shape->hit(r, tmin, rec.t, rec);
+        const float max_width = std::max(extent.x, std::max(extent.y, extent.z));
+        const float cube_root = 3.0f * pow(static_cast<float>(shapes_count), 1.0f / 3.0f);
+        const float voxels_per_unit = max_width > 0.0f ? cube_root / max_width : 0.0f;
+
+        ivec3 resolution;
+
+        for (size_t i = 0; i < 3; ++i)
+        {
+            resolution[i] = static_cast<int>(round(extent[i] * voxels_per_unit));
+            resolution[i] = clamp(resolution[i], 1, max_resolution);
+        }
+
+        return resolution;
     }
 
-    return hit_something;
+    // Digital Differental Analyser.
+    //
+    // Walk the voxels of the grid of the given origin, voxel size and
+    // resolution crossed by the ray, from the parameter t where it is
+    // in the grid, and call visit(voxel, t_in, t_out) on each of them.
+    // The walk stops when the current hit is closer than the next voxel.
+    template <typename Visit>
+    void walk_voxels(
+        const Ray&      r,
+        const float     t,
+        const vec3&     origin,
+        const vec3&     voxel_size,
+        const vec3&     inv_voxel_size,
+        const ivec3&    resolution,
+        const HitRecord& rec,
+        const Visit&    visit)
+    {
+        // Compute next voxel entry points.
+
+        // What we need to store:
+        // - Position of the current voxel in the grid space (pos).
+        // - Ray parameter t that intersects the next voxel (next_t).
+        // - Direction to the next voxel in the grid space (step).
+        // - Distance to the next voxel in each direction (delta_t).
+        // - Coordinates of the voxel where the ray leaves the grid (out).
+
+        // Setup variables.
+        const vec3 entry = r.point(t);
+        vec3 next_t(0.0f), delta_t(0.0f);
+        ivec3 step(0), out(0), pos(0);
+
+        for (size_t i = 0; i < 3; ++i)
+        {
+            pos[i] = clamp(
+                static_cast<int>((entry[i] - origin[i]) * inv_voxel_size[i]),
+                0,
+                resolution[i] - 1);
+
+            if (r.dir[i] >= 0.0f)
+            {
+                // Ray with positive direction.
+                // Next parameter t is simply
+                // the entry parameter t plus the axis distance to the next voxel
+                // and divided by the axis direction.
+
+                // If the ray direction is 0, then next_t will be INF.
+                // We use this to never go in this direction later.
+                next_t[i] = t + (origin[i] + (pos[i] + 1) * voxel_size[i] - entry[i]) / r.dir[i];
+                delta_t[i] = voxel_size[i] / r.dir[i];
+                step[i] = 1;
+                out[i] = resolution[i];
+            }
+            else
+            {
+                // Ray with negative direction.
+                next_t[i] = t + (origin[i] + pos[i] * voxel_size[i] - entry[i]) / r.dir[i];
+                delta_t[i] = -voxel_size[i] / r.dir[i];
+                step[i] = -1;
+                out[i] = -1;
+            }
+        }
+
+        float t_in = t;
+
+        while (true)
+        {
+            // Move to the next voxel.
+            // We choose the best axis.
+            // It's the one getting us to the closest voxel.
+            size_t axis = (next_t[1] < next_t[0]) ? 1 : 0;
+            axis = (next_t[2] < next_t[axis]) ? 2 : axis;
+
+            // Check intersection with the current voxel.
+            visit(pos, t_in, next_t[axis]);
+
+            // We stop if the current intersection point is
+            // closer than the next voxel.
+            if (rec.t < next_t[axis])
+                break;
+
+            pos[axis] += step[axis];
+
+            // Check if we are getting out of the grid.
+            if (pos[axis] == out[axis])
+                break;
+
+            t_in = next_t[axis];
+            next_t[axis] += delta_t[axis];
+        }
+    }
 }
 
 VoxelGridAccelerator::VoxelGridAccelerator(
-    const MeshGroup& world)
+    const MeshGroup&                    world,
+    const InstanceGroup&                instances)
   : m_world(world)
 {
-    assert(world.size());
+    assert(world.size() || instances.size());
 
     Logger::log_info("building a grid accelerator...");
 
-    m_bounds = world[0]->bbox();
+    if (!instances.empty())
+    {
+        m_instances.reset(new InstanceBVH(instances));
+        Logger::log_debug(to_string(instances.size()) + " mesh instances.");
+    }
 
-    // Create bbox and choose a resolution.
-    for (size_t i = 1; i < world.size(); ++i)
+    // A scene made of instances only has an empty grid
+    // over the instances, giving the scene scale.
+    if (world.empty())
     {
-        const shared_ptr<VisualObject> shape = world[i];
-        m_bounds += shape->bbox();
+        m_bounds = m_instances->bbox();
+    }
+    else
+    {
+        // Create bbox by chunks.
+        vector<AABB> bounds((world.size() + GRID_BUILD_CHUNK_SIZE - 1) / GRID_BUILD_CHUNK_SIZE);
+
+        run_chunks(world.size(), GRID_BUILD_CHUNK_SIZE, [&](const size_t begin, const size_t end)
+        {
+            AABB& chunk_bounds = bounds[begin / GRID_BUILD_CHUNK_SIZE];
+            chunk_bounds = world[begin]->bbox();
+
+            for (size_t i = begin + 1; i < end; ++i)
+                chunk_bounds += world[i]->bbox();
+        });
+
+        m_bounds = bounds[0];
+        for (size_t i = 1; i < bounds.size(); ++i)
+            m_bounds += bounds[i];
     }
 
     // Compute the grid size.
     const vec3 grid_size = m_bounds.max - m_bounds.min;
 
-    // Compute the ideal size of one voxel.
-    // The goal is to have a cubic voxel if possible.
-    // If meshes are uniform and uniformly spreaded,
-    // using the number of meshes to deduce the number
-    // of voxels is a good idea.
-    const size_t max_extent = m_bounds.max_extent();
-    const float inv_max_width = 1.0f / grid_size[max_extent];
-    const float cube_root = 3.0f * pow(
-        static_cast<float>(world.size()), 1.0f / 3.0f);
-    m_best_voxel_size = cube_root * inv_max_width;
-
     // Compute the number of voxels to create on each axis.
-    for (size_t i = 0; i < 3; ++i)
-    {
-        m_voxels_per_axis[i] =
-            static_cast<int>(
-                round(grid_size[i] * m_best_voxel_size));
-        m_voxels_per_axis[i] = clamp(m_voxels_per_axis[i], 1, 64);
-    }
+    // Dense voxels are subdivided later.
+    m_voxels_per_axis = grid_resolution(grid_size, world.size(), 64);
 
     // Compute the real size of voxels on each axis.
     for (size_t i = 0; i < 3; ++i)
@@ -89,7 +258,6 @@ VoxelGridAccelerator::VoxelGridAccelerator(
     m_best_voxel_size = length(m_voxel_size) / 3.0f;
 
     const size_t resolution = m_voxels_per_axis[0] * m_voxels_per_axis[1] * m_voxels_per_axis[2];
-    m_voxels.reset(new Voxel[resolution]);
 
     Logger::log_debug("grid voxel count: " + to_string(resolution) + ".");
     Logger::log_debug(
@@ -98,50 +266,630 @@ VoxelGridAccelerator::VoxelGridAccelerator(
         + to_string(m_voxels_per_axis[1]) + ","
         + to_string(m_voxels_per_axis[2]) + ").");
 
+    link_shapes();
+}
+
+void VoxelGridAccelerator::link_shapes()
+{
+    assert(m_world.size() < numeric_limits<uint32_t>::max());
+
+    const size_t resolution = m_voxels_per_axis[0] * m_voxels_per_axis[1] * m_voxels_per_axis[2];
+
+    m_shapes.resize(m_world.size());
+
+    // Count the shapes going through each voxel.
+    unique_ptr<atomic<uint32_t>[]> counts(new atomic<uint32_t>[resolution]());
+
+    run_chunks(m_world.size(), GRID_BUILD_CHUNK_SIZE, [&](const size_t begin, const size_t end)
+    {
+        for (size_t i = begin; i < end; ++i)
+        {
+            m_shapes[i] = m_world[i].get();
+
+            ivec3 index_min, index_max;
+            voxel_range(m_shapes[i]->bbox(), index_min, index_max);
+
+            for (int z = index_min[2]; z <= index_max[2]; ++z)
+                for (int y = index_min[1]; y <= index_max[1]; ++y)
+                    for (int x = index_min[0]; x <= index_max[0]; ++x)
+                        counts[offset(x, y, z)].fetch_add(1, memory_order_relaxed);
+        }
+    });
+
+    // Scan the counts into the voxels offsets.
+    // Counts become the next free slot of each voxel.
+    m_voxel_offsets.resize(resolution + 1);
+    m_voxel_offsets[0] = 0;
+    m_occupied.assign((resolution + 63) / 64, 0);
+
+    // All the shapes are linked: nothing overflows.
+    m_overflow.clear();
+    m_overflowed.assign((resolution + 63) / 64, 0);
+    m_overflow_count = 0;
+    m_dead_grid_ids = 0;
+
+    for (size_t i = 0; i < resolution; ++i)
+    {
+        const uint64_t count = counts[i].load(memory_order_relaxed);
+        const uint64_t next = m_voxel_offsets[i] + count;
+
+        assert(next < numeric_limits<uint32_t>::max());
+
+        counts[i].store(m_voxel_offsets[i], memory_order_relaxed);
+        m_voxel_offsets[i + 1] = static_cast<uint32_t>(next);
+
+        if (count > 0)
+            m_occupied[i >> 6] |= uint64_t(1) << (i & 63);
+    }
+
     // Link shapes to voxels.
-    for (size_t i = 0, e = world.size(); i < e; ++i)
+    m_voxel_ids.resize(m_voxel_offsets[resolution]);
+
+    run_chunks(m_world.size(), GRID_BUILD_CHUNK_SIZE, [&](const size_t begin, const size_t end)
+    {
+        for (size_t i = begin; i < end; ++i)
+        {
+            ivec3 index_min, index_max;
+            voxel_range(m_shapes[i]->bbox(), index_min, index_max);
+
+            for (int z = index_min[2]; z <= index_max[2]; ++z)
+                for (int y = index_min[1]; y <= index_max[1]; ++y)
+                    for (int x = index_min[0]; x <= index_max[0]; ++x)
+                        m_voxel_ids[counts[offset(x, y, z)].fetch_add(1, memory_order_relaxed)] = static_cast<uint32_t>(i);
+        }
+    });
+
+    subdivide_cells();
+
+    Logger::log_debug(
+        "grid memory: "
+        + to_string(
+            m_voxel_offsets.size() * sizeof(uint32_t)
+            + m_voxel_ids.size() * sizeof(uint32_t)
+            + m_occupied.size() * sizeof(uint64_t)
+            + m_shapes.size() * sizeof(const Triangle*)
+            + m_cell_grids.size() * sizeof(int32_t)
+            + m_grids.size() * sizeof(CellGrid)
+            + m_grid_offsets.size() * sizeof(uint32_t)
+            + m_grid_ids.size() * sizeof(uint32_t))
+        + " bytes.");
+}
+
+void VoxelGridAccelerator::subdivide_cells()
+{
+    const size_t resolution = m_voxels_per_axis[0] * m_voxels_per_axis[1] * m_voxels_per_axis[2];
+
+    m_cell_grids.assign(resolution, -1);
+    m_grids.clear();
+    m_grid_offsets.clear();
+    m_grid_ids.clear();
+
+    // Find the dense cells.
+    vector<uint32_t> cells;
+
+    for (size_t o = 0; o < resolution; ++o)
+    {
+        if (m_voxel_offsets[o + 1] - m_voxel_offsets[o] >= GRID_SUBDIVIDE_MIN_SHAPES)
+            cells.push_back(static_cast<uint32_t>(o));
+    }
+
+    if (cells.empty())
+        return;
+
+    // Cells are subdivided independently, then their arrays are concatenated.
+    struct CellArrays
+    {
+        CellGrid            grid;
+        vector<uint32_t>    offsets;
+        vector<uint32_t>    ids;
+    };
+
+    vector<CellArrays> arrays(cells.size());
+
+    run_chunks(cells.size(), GRID_SUBDIVIDE_CHUNK_SIZE, [&](const size_t begin, const size_t end)
+    {
+        for (size_t i = begin; i < end; ++i)
+        {
+            const size_t o = cells[i];
+
+            subdivide_cell(
+                o,
+                &m_voxel_ids[m_voxel_offsets[o]],
+                &m_voxel_ids[0] + m_voxel_offsets[o + 1],
+                arrays[i].grid,
+                arrays[i].offsets,
+                arrays[i].ids);
+        }
+    });
+
+    for (size_t i = 0; i < arrays.size(); ++i)
+        add_cell_grid(cells[i], arrays[i].grid, arrays[i].offsets, arrays[i].ids);
+
+    Logger::log_debug(
+        to_string(m_grids.size()) + " dense grid cells subdivided.");
+}
+
+void VoxelGridAccelerator::subdivide_cell(
+    const size_t                        o,
+    const uint32_t*                     ids_begin,
+    const uint32_t*                     ids_end,
+    CellGrid&                           grid,
+    vector<uint32_t>&                   offsets,
+    vector<uint32_t>&                   ids) const
+{
+    const ivec3 pos(
+        static_cast<int>(o % m_voxels_per_axis[0]),
+        static_cast<int>((o / m_voxels_per_axis[0]) % m_voxels_per_axis[1]),
+        static_cast<int>(o / (m_voxels_per_axis[0] * m_voxels_per_axis[1])));
+
+    grid.origin = m_bounds.min + vec3(pos) * m_voxel_size;
+    grid.resolution = grid_resolution(
+        m_voxel_size, ids_end - ids_begin, GRID_SUBDIVIDE_MAX_RESOLUTION);
+
+    for (size_t a = 0; a < 3; ++a)
+    {
+        grid.voxel_size[a] = m_voxel_size[a] / static_cast<float>(grid.resolution[a]);
+        grid.inv_voxel_size[a] = (grid.voxel_size[a] == 0.0f) ? 0.0f : 1.0f / grid.voxel_size[a];
+    }
+
+    // Voxels of the cell grid a shape goes through.
+    auto cell_range = [&](const AABB& bbox, ivec3& index_min, ivec3& index_max)
     {
-        // Find min and max voxels the shape is goind through.
-        const shared_ptr<VisualObject> shape = world[i];
-        const AABB& bbox = shape->bbox();
-        ivec3 index_min, index_max;
         for (size_t a = 0; a < 3; ++a)
         {
-            index_min[a] = voxel(bbox.min, a);
-            index_max[a] = voxel(bbox.max, a);
+            index_min[a] = clamp(
+                static_cast<int>((bbox.min[a] - grid.origin[a]) * grid.inv_voxel_size[a]),
+                0, grid.resolution[a] - 1);
+            index_max[a] = clamp(
+                static_cast<int>((bbox.max[a] - grid.origin[a]) * grid.inv_voxel_size[a]),
+                0, grid.resolution[a] - 1);
         }
+    };
+
+    auto cell_offset = [&](const int x, const int y, const int z)
+    {
+        return static_cast<size_t>((z * grid.resolution[1] + y) * grid.resolution[0] + x);
+    };
+
+    // Same counting, scanning and linking as the grid, on one thread.
+    const size_t cell_resolution = grid.resolution[0] * grid.resolution[1] * grid.resolution[2];
+    offsets.assign(cell_resolution + 1, 0);
+
+    for (const uint32_t* id = ids_begin; id != ids_end; ++id)
+    {
+        ivec3 index_min, index_max;
+        cell_range(m_shapes[*id]->bbox(), index_min, index_max);
+
+        for (int z = index_min[2]; z <= index_max[2]; ++z)
+            for (int y = index_min[1]; y <= index_max[1]; ++y)
+                for (int x = index_min[0]; x <= index_max[0]; ++x)
+                    ++offsets[cell_offset(x, y, z) + 1];
+    }
+
+    for (size_t c = 0; c < cell_resolution; ++c)
+        offsets[c + 1] += offsets[c];
+
+    vector<uint32_t> next(offsets.begin(), offsets.end() - 1);
+    ids.resize(offsets[cell_resolution]);
+
+    for (const uint32_t* id = ids_begin; id != ids_end; ++id)
+    {
+        ivec3 index_min, index_max;
+        cell_range(m_shapes[*id]->bbox(), index_min, index_max);
+
+        for (int z = index_min[2]; z <= index_max[2]; ++z)
+            for (int y = index_min[1]; y <= index_max[1]; ++y)
+                for (int x = index_min[0]; x <= index_max[0]; ++x)
+                    ids[next[cell_offset(x, y, z)]++] = *id;
+    }
+}
+
+void VoxelGridAccelerator::add_cell_grid(
+    const size_t                        o,
+    CellGrid                            grid,
+    const vector<uint32_t>&             offsets,
+    const vector<uint32_t>&             ids)
+{
+    const uint32_t ids_base = static_cast<uint32_t>(m_grid_ids.size());
+
+    grid.offsets = static_cast<uint32_t>(m_grid_offsets.size());
+
+    for (const uint32_t offset : offsets)
+        m_grid_offsets.push_back(ids_base + offset);
+
+    m_grid_ids.insert(m_grid_ids.end(), ids.begin(), ids.end());
+
+    // The arrays of a replaced grid stay unused until they are compacted.
+    if (m_cell_grids[o] >= 0)
+    {
+        CellGrid& replaced = m_grids[m_cell_grids[o]];
+        const size_t cell_resolution =
+            replaced.resolution[0] * replaced.resolution[1] * replaced.resolution[2];
+
+        m_dead_grid_ids +=
+            m_grid_offsets[replaced.offsets + cell_resolution] - m_grid_offsets[replaced.offsets];
+        replaced = grid;
+        return;
+    }
+
+    m_cell_grids[o] = static_cast<int32_t>(m_grids.size());
+    m_grids.push_back(grid);
+}
+
+const vector<uint32_t>& VoxelGridAccelerator::overflow(const size_t o) const
+{
+    assert(has_overflow(o));
+    return m_overflow.find(static_cast<uint32_t>(o))->second;
+}
 
-        // Link the shape to all the voxels
-        // from the minimum voxel to the maximal voxel.
-        const size_t z_min = static_cast<size_t>(index_min[2]);
-        const size_t z_max = static_cast<size_t>(index_max[2]);
-        const size_t y_min = static_cast<size_t>(index_min[1]);
-        const size_t y_max = static_cast<size_t>(index_max[1]);
-        const size_t x_min = static_cast<size_t>(index_min[0]);
-        const size_t x_max = static_cast<size_t>(index_max[0]);
-        for (size_t z = z_min; z <= z_max; ++z)
+bool VoxelGridAccelerator::hit(
+    const Ray&                          r,
+    const float                         tmin,
+    float                               tmax,
+    HitRecord&                          rec) const
+{
+    rec.t = tmax;
+
+    const bool hit_triangle = hit_triangles(r, tmin, tmax, rec);
+
+    // Instances only need to be hit closer than the triangles.
+    // Their hits come with all their attributes.
+    if (m_instances && m_instances->hit(r, tmin, rec.t, rec))
+        return true;
+
+    // Attributes of the closest triangle.
+    if (hit_triangle)
+        rec.triangle->compute_attributes(r, rec);
+
+    return hit_triangle;
+}
+
+void VoxelGridAccelerator::hit_packet(
+    const RayPacket&                    packet,
+    const float                         tmin,
+    HitRecord*                          recs) const
+{
+    PacketHits hits;
+    hit_packet_triangles(packet, tmin, hits);
+
+    for (size_t i = 0; i < packet.size; ++i)
+    {
+        const Ray r = packet.ray(i);
+        HitRecord& rec = recs[i];
+
+        rec.t = hits.t[i];
+        rec.u = hits.u[i];
+        rec.v = hits.v[i];
+        rec.triangle = hits.triangle[i];
+
+        // Instances are tested ray by ray.
+        if (m_instances && m_instances->hit(r, tmin, rec.t, rec))
+            continue;
+
+        if (rec.triangle)
+            rec.triangle->compute_attributes(r, rec);
+        else
+            rec.mat = nullptr;
+    }
+}
+
+void VoxelGridAccelerator::hit_stream(
+    const vector<Ray>&                  rays,
+    const float                         tmin,
+    vector<HitRecord>&                  recs) const
+{
+    assert(rays.size() <= numeric_limits<uint32_t>::max());
+
+    recs.resize(rays.size());
+
+    // Sort keys: the voxel of the origin and the octant
+    // of the direction above, the index of the ray below.
+    thread_local vector<uint64_t> keys;
+    keys.resize(rays.size());
+
+    for (size_t i = 0; i < rays.size(); ++i)
+    {
+        const Ray& r = rays[i];
+        const uint64_t cell = offset(voxel(r.origin, 0), voxel(r.origin, 1), voxel(r.origin, 2));
+        const uint64_t octant =
+            (r.dir.x < 0.0f ? 1 : 0) | (r.dir.y < 0.0f ? 2 : 0) | (r.dir.z < 0.0f ? 4 : 0);
+
+        keys[i] = (((cell << 3) | octant) << 32) | i;
+    }
+
+    sort(keys.begin(), keys.end());
+
+    for (const uint64_t key : keys)
+    {
+        const size_t i = static_cast<size_t>(key & 0xffffffff);
+        HitRecord& rec = recs[i];
+
+        rec.t = numeric_limits<float>::max();
+        rec.triangle = nullptr;
+        hit_triangles(rays[i], tmin, rec.t, rec);
+    }
+
+    for (const uint64_t key : keys)
+    {
+        const size_t i = static_cast<size_t>(key & 0xffffffff);
+        HitRecord& rec = recs[i];
+
+        if (m_instances && m_instances->hit(rays[i], tmin, rec.t, rec))
+            continue;
+
+        if (rec.triangle)
+            rec.triangle->compute_attributes(rays[i], rec);
+        else
+            rec.mat = nullptr;
+    }
+}
+
+void VoxelGridAccelerator::hit_packet_triangles(
+    const RayPacket&                    packet,
+    const float                         tmin,
+    PacketHits&                         hits) const
+{
+#ifdef DEBUG_DISABLE_ACCELERATOR
+    for (size_t i = 0; i < m_world.size(); ++i)
+        m_world[i]->hit_packet(packet, tmin, hits);
+#else
+    if (m_world.empty() || packet.size == 0)
+        return;
+
+    // Slices are taken across the main axis of the first ray.
+    const vec3 main_dir(packet.dir[0][0], packet.dir[1][0], packet.dir[2][0]);
+    const vec3 abs_dir = abs(main_dir);
+    const int k = (abs_dir.x > abs_dir.y)
+        ? (abs_dir.x > abs_dir.z ? 0 : 2)
+        : (abs_dir.y > abs_dir.z ? 1 : 2);
+    const int k1 = (k + 1) % 3;
+    const int k2 = (k + 2) % 3;
+    const int step = main_dir[k] > 0.0f ? 1 : -1;
+
+    // Segment of each ray in the grid, and the slices it goes through.
+    float t_in[RAY_PACKET_SIZE], t_out[RAY_PACKET_SIZE];
+    bool in_grid[RAY_PACKET_SIZE];
+    int first = -1, last = -1;
+
+    for (size_t i = 0; i < packet.size; ++i)
+    {
+        // Rays going the other way cannot walk the same slices.
+        if (packet.dir[k][i] * step <= 0.0f)
+        {
+            for (size_t j = 0; j < packet.size; ++j)
+            {
+                HitRecord rec;
+
+                if (hit_triangles(packet.ray(j), tmin, numeric_limits<float>::max(), rec))
+                {
+                    hits.t[j] = rec.t;
+                    hits.u[j] = rec.u;
+                    hits.v[j] = rec.v;
+                    hits.triangle[j] = rec.triangle;
+                }
+            }
+
+            return;
+        }
+
+        const Ray r = packet.ray(i);
+        in_grid[i] = m_bounds.intersect(r, tmin, hits.t[i], &t_in[i], &t_out[i]);
+
+        if (!in_grid[i])
+            continue;
+
+        const int first_slice = static_cast<int>(voxel(r.point(t_in[i]), k));
+        const int last_slice = static_cast<int>(voxel(r.point(t_out[i]), k));
+
+        if (first == -1 || (first_slice - first) * step < 0)
+            first = first_slice;
+
+        if (last == -1 || (last_slice - last) * step > 0)
+            last = last_slice;
+    }
+
+    if (first == -1)
+        return;
+
+    size_t voxels_visited = 0;
+    size_t triangles_tested = 0;
+
+    // Bounds across the main axis of the segments of the rays between
+    // the planes where they enter and leave a slice. Returns false if
+    // all the rays hit something or left the grid before the slice.
+    auto slice_frustum = [&](
+        const float     plane_in,
+        const float     plane_out,
+        vec2&           frustum_min,
+        vec2&           frustum_max)
+    {
+        frustum_min = vec2(numeric_limits<float>::max());
+        frustum_max = vec2(-numeric_limits<float>::max());
+        bool pending = false;
+
+        for (size_t i = 0; i < packet.size; ++i)
+        {
+            if (!in_grid[i])
+                continue;
+
+            const float inv_dir = 1.0f / packet.dir[k][i];
+            const float slice_t_in = std::max(t_in[i], (plane_in - packet.origin[k][i]) * inv_dir);
+            const float slice_t_out = std::min(
+                std::min(t_out[i], hits.t[i]),
+                (plane_out - packet.origin[k][i]) * inv_dir);
+
+            // The ray already hit something or left the grid before the slice.
+            if (hits.t[i] < slice_t_in || t_out[i] < slice_t_in)
+                continue;
+
+            pending = true;
+
+            if (slice_t_in > slice_t_out)
+                continue;
+
+            for (const float t : { slice_t_in, slice_t_out })
+            {
+                const vec2 p(
+                    packet.origin[k1][i] + t * packet.dir[k1][i],
+                    packet.origin[k2][i] + t * packet.dir[k2][i]);
+
+                frustum_min.x = std::min(frustum_min.x, p.x);
+                frustum_min.y = std::min(frustum_min.y, p.y);
+                frustum_max.x = std::max(frustum_max.x, p.x);
+                frustum_max.y = std::max(frustum_max.y, p.y);
+            }
+        }
+
+        return pending;
+    };
+
+    // Test the shapes of a voxel against all the rays.
+    auto hit_shapes = [&](const uint32_t* ids_begin, const uint32_t* ids_end)
+    {
+        triangles_tested += packet.size * (ids_end - ids_begin);
+
+        for (const uint32_t* id = ids_begin; id != ids_end; ++id)
+            m_shapes[*id]->hit_packet(packet, tmin, hits);
+    };
+
+    // Walk the grid of a dense cell slice by slice, as the cells.
+    auto hit_cell_grid = [&](const CellGrid& grid)
+    {
+        const uint32_t* offsets = &m_grid_offsets[grid.offsets];
+        const vec3 grid_max = grid.origin + vec3(grid.resolution) * grid.voxel_size;
+
+        for (int c = step > 0 ? 0 : grid.resolution[k] - 1; c >= 0 && c < grid.resolution[k]; c += step)
+        {
+            vec2 frustum_min, frustum_max;
+
+            if (!slice_frustum(
+                    grid.origin[k] + (step > 0 ? c : c + 1) * grid.voxel_size[k],
+                    grid.origin[k] + (step > 0 ? c + 1 : c) * grid.voxel_size[k],
+                    frustum_min,
+                    frustum_max))
+                break;
+
+            // The rays cross the slice beside the cell.
+            if (frustum_min.x > grid_max[k1] || frustum_max.x < grid.origin[k1]
+                || frustum_min.y > grid_max[k2] || frustum_max.y < grid.origin[k2])
+                continue;
+
+            ivec3 pos_min, pos_max;
+            pos_min[k] = pos_max[k] = c;
+            pos_min[k1] = clamp(
+                static_cast<int>((frustum_min.x - grid.origin[k1]) * grid.inv_voxel_size[k1]),
+                0, grid.resolution[k1] - 1);
+            pos_max[k1] = clamp(
+                static_cast<int>((frustum_max.x - grid.origin[k1]) * grid.inv_voxel_size[k1]),
+                0, grid.resolution[k1] - 1);
+            pos_min[k2] = clamp(
+                static_cast<int>((frustum_min.y - grid.origin[k2]) * grid.inv_voxel_size[k2]),
+                0, grid.resolution[k2] - 1);
+            pos_max[k2] = clamp(
+                static_cast<int>((frustum_max.y - grid.origin[k2]) * grid.inv_voxel_size[k2]),
+                0, grid.resolution[k2] - 1);
+
+            for (int z = pos_min[2]; z <= pos_max[2]; ++z)
+            {
+                for (int y = pos_min[1]; y <= pos_max[1]; ++y)
+                {
+                    for (int x = pos_min[0]; x <= pos_max[0]; ++x)
+                    {
+                        const size_t o = (z * grid.resolution[1] + y) * grid.resolution[0] + x;
+
+                        ++voxels_visited;
+
+                        hit_shapes(&m_grid_ids[0] + offsets[o], &m_grid_ids[0] + offsets[o + 1]);
+                    }
+                }
+            }
+        }
+    };
+
+    for (int s = first; (s - last) * step <= 0; s += step)
+    {
+        // Voxels of the slice crossed by the rays.
+        vec2 frustum_min, frustum_max;
+
+        // All the rays are done.
+        if (!slice_frustum(
+                position(step > 0 ? s : s + 1, k),
+                position(step > 0 ? s + 1 : s, k),
+                frustum_min,
+                frustum_max))
+            break;
+
+        if (frustum_min.x > frustum_max.x)
+            continue;
+
+        ivec3 pos_min, pos_max;
+        pos_min[k] = pos_max[k] = s;
+        pos_min[k1] = clamp(
+            static_cast<int>((frustum_min.x - m_bounds.min[k1]) * m_inv_voxel_size[k1]),
+            0, m_voxels_per_axis[k1] - 1);
+        pos_max[k1] = clamp(
+            static_cast<int>((frustum_max.x - m_bounds.min[k1]) * m_inv_voxel_size[k1]),
+            0, m_voxels_per_axis[k1] - 1);
+        pos_min[k2] = clamp(
+            static_cast<int>((frustum_min.y - m_bounds.min[k2]) * m_inv_voxel_size[k2]),
+            0, m_voxels_per_axis[k2] - 1);
+        pos_max[k2] = clamp(
+            static_cast<int>((frustum_max.y - m_bounds.min[k2]) * m_inv_voxel_size[k2]),
+            0, m_voxels_per_axis[k2] - 1);
+
+        for (int z = pos_min[2]; z <= pos_max[2]; ++z)
         {
-            for (size_t y = y_min; y <= y_max; ++y)
+            for (int y = pos_min[1]; y <= pos_max[1]; ++y)
             {
-                for (size_t x = x_min; x <= x_max; ++x)
+                for (int x = pos_min[0]; x <= pos_max[0]; ++x)
                 {
                     const size_t o = offset(x, y, z);
-                    m_voxels[o].objects.push_back(shape);
+
+                    ++voxels_visited;
+
+                    if (!is_occupied(o))
+                        continue;
+
+                    const int32_t cell_grid = m_cell_grids[o];
+
+                    // Dense cells are walked through their own grid.
+                    if (cell_grid >= 0)
+                    {
+                        hit_cell_grid(m_grids[cell_grid]);
+                        continue;
+                    }
+
+                    hit_shapes(&m_voxel_ids[m_voxel_offsets[o]], &m_voxel_ids[0] + m_voxel_offsets[o + 1]);
+
+                    if (has_overflow(o))
+                        hit_shapes(overflow(o).data(), overflow(o).data() + overflow(o).size());
                 }
             }
         }
     }
+
+    Stats::add(StatCounter::VoxelsVisited, voxels_visited);
+    Stats::add(StatCounter::TrianglesTested, triangles_tested);
+#endif
 }
 
-bool VoxelGridAccelerator::hit(
+bool VoxelGridAccelerator::hit_triangles(
     const Ray&                          r,
     const float                         tmin,
     float                               tmax,
     HitRecord&                          rec) const
 {
 #ifdef DEBUG_DISABLE_ACCELERATOR
-    return hit_world(m_world, r, tmin, tmax, rec);
+    bool hit_something = false;
+
+    for (size_t i = 0; i < m_world.size(); ++i)
+        hit_something |= m_world[i]->hit(r, tmin, rec.t, rec);
+
+    return hit_something;
 #else
+    if (m_world.empty())
+        return false;
+
     // Parameter for the point where the ray enters the grid.
     float t = 0.0f;
 
@@ -159,85 +907,228 @@ bool VoxelGridAccelerator::hit(
 
     rec.t = tmax;
 
-    // Digital Differental Analyser.
-    // Compute next voxel entry points.
+    // Test intersection with shapes.
+    bool hit_something = false;
+    size_t voxels_visited = 0;
+    size_t triangles_tested = 0;
 
-    // What we need to store:
-    // - Position of the current voxel in the grid space (pos).
-    // - Ray parameter t that intersects the next voxel (next_t).
-    // - Direction to the next voxel in the grid space (step).
-    // - Distance to the next voxel in each direction (delta_t).
-    // - Coordinates of the voxel where the ray leaves the grid (out).
+    // Test the shapes of the voxel with the given ids.
+    auto hit_shapes = [&](const uint32_t* ids_begin, const uint32_t* ids_end)
+    {
+        triangles_tested += ids_end - ids_begin;
 
-    // Setup variables.
-    const vec3 entry = r.point(t);
-    vec3 next_t(0.0f), delta_t(0.0f);
-    ivec3 step(0), out(0), pos(0);
+        for (const uint32_t* id = ids_begin; id != ids_end; ++id)
+            hit_something |= m_shapes[*id]->hit(r, tmin, rec.t, rec);
+    };
 
-    for (size_t i = 0; i < 3; ++i)
+    walk_voxels(
+        r, t, m_bounds.min, m_voxel_size, m_inv_voxel_size, m_voxels_per_axis, rec,
+        [&](const ivec3& pos, const float t_in, const float)
+        {
+            ++voxels_visited;
+
+            // Skip empty cells.
+            const size_t o = offset(pos[0], pos[1], pos[2]);
+
+            if (!is_occupied(o))
+                return;
+
+            const int32_t cell_grid = m_cell_grids[o];
+
+            if (cell_grid < 0)
+            {
+                hit_shapes(&m_voxel_ids[m_voxel_offsets[o]], &m_voxel_ids[0] + m_voxel_offsets[o + 1]);
+
+                if (has_overflow(o))
+                    hit_shapes(overflow(o).data(), overflow(o).data() + overflow(o).size());
+
+                return;
+            }
+
+            // Walk the grid of the cell from where the ray entered it.
+            const CellGrid& grid = m_grids[cell_grid];
+            const uint32_t* offsets = &m_grid_offsets[grid.offsets];
+
+            walk_voxels(
+                r, t_in, grid.origin, grid.voxel_size, grid.inv_voxel_size, grid.resolution, rec,
+                [&](const ivec3& cell_pos, const float, const float)
+                {
+                    ++voxels_visited;
+
+                    const size_t c =
+                        (cell_pos[2] * grid.resolution[1] + cell_pos[1]) * grid.resolution[0] + cell_pos[0];
+
+                    hit_shapes(&m_grid_ids[0] + offsets[c], &m_grid_ids[0] + offsets[c + 1]);
+                });
+        });
+
+    Stats::add(StatCounter::VoxelsVisited, voxels_visited);
+    Stats::add(StatCounter::TrianglesTested, triangles_tested);
+
+    return hit_something;
+#endif
+}
+
+float VoxelGridAccelerator::voxel_size() const
+{
+    return m_best_voxel_size;
+}
+
+bool VoxelGridAccelerator::refit(
+    const MeshGroup&                    shapes,
+    const vector<AABB>&                 previous_bboxes)
+{
+    assert(shapes.size() == previous_bboxes.size());
+
+    // Shapes out of the bounds would be missed by rays.
+    for (size_t i = 0, e = shapes.size(); i < e; ++i)
     {
-        pos[i] = voxel(entry, i);
+        const AABB& bbox = shapes[i]->bbox();
 
-        if (r.dir[i] >= 0.0f)
-        {
-            // Ray with positive direction.
-            // Next parameter t is simply
-            // the entry parameter t plus the axis distance to the next voxel
-            // and divided by the axis direction.
-
-            // If the ray direction is 0, then next_t will be INF.
-            // We use this to never go in this direction later.
-            next_t[i] = t + (position(pos[i] + 1, i) - entry[i]) / r.dir[i];
-            delta_t[i] = m_voxel_size[i] / r.dir[i];
-            step[i] = 1;
-            out[i] = m_voxels_per_axis[i];
-        }
-        else
+        if (!m_bounds.contains(bbox.min) || !m_bounds.contains(bbox.max))
+            return false;
+    }
+
+    if (m_shape_ids.empty())
+    {
+        for (size_t i = 0; i < m_shapes.size(); ++i)
+            m_shape_ids[m_shapes[i]] = static_cast<uint32_t>(i);
+    }
+
+    // Dense cells the shapes left, entered or moved in.
+    vector<uint32_t> cells;
+
+    for (size_t i = 0, e = shapes.size(); i < e; ++i)
+    {
+        const auto found = m_shape_ids.find(shapes[i].get());
+        assert(found != m_shape_ids.end());
+
+        const uint32_t id = found->second;
+
+        ivec3 old_min, old_max, new_min, new_max;
+        voxel_range(previous_bboxes[i], old_min, old_max);
+        voxel_range(shapes[i]->bbox(), new_min, new_max);
+
+        // The shape is listed in the voxels it was in:
+        // it only needs to be added to the new ones.
+        for (int z = new_min[2]; z <= new_max[2]; ++z)
         {
-            // Ray with negative direction.
-            next_t[i] = t + (position(pos[i], i) - entry[i]) / r.dir[i];
-            delta_t[i] = -m_voxel_size[i] / r.dir[i];
-            step[i] = -1;
-            out[i] = -1;
+            for (int y = new_min[1]; y <= new_max[1]; ++y)
+            {
+                for (int x = new_min[0]; x <= new_max[0]; ++x)
+                {
+                    const size_t o = offset(x, y, z);
+
+                    if (m_cell_grids[o] >= 0)
+                        cells.push_back(static_cast<uint32_t>(o));
+
+                    if (x >= old_min[0] && x <= old_max[0]
+                        && y >= old_min[1] && y <= old_max[1]
+                        && z >= old_min[2] && z <= old_max[2])
+                        continue;
+
+                    m_overflow[static_cast<uint32_t>(o)].push_back(id);
+                    m_overflowed[o >> 6] |= uint64_t(1) << (o & 63);
+                    m_occupied[o >> 6] |= uint64_t(1) << (o & 63);
+                    ++m_overflow_count;
+                }
+            }
         }
+
+        for (int z = old_min[2]; z <= old_max[2]; ++z)
+            for (int y = old_min[1]; y <= old_max[1]; ++y)
+                for (int x = old_min[0]; x <= old_max[0]; ++x)
+                    if (m_cell_grids[offset(x, y, z)] >= 0)
+                        cells.push_back(static_cast<uint32_t>(offset(x, y, z)));
     }
 
-    // Test intersection with shapes.
-    bool hit_something = false;
+    sort(cells.begin(), cells.end());
+    cells.erase(unique(cells.begin(), cells.end()), cells.end());
 
-    while (true)
+    // Relink the grid once it holds too many overflowing ids.
+    if (m_overflow_count > static_cast<size_t>(m_voxel_ids.size() * GRID_REFIT_RELINK_RATIO))
     {
-        // Check intersection with the current voxel.
-        const Voxel& voxel = m_voxels[offset(pos[0], pos[1], pos[2])];
-        hit_something |= voxel.hit(r, tmin, rec);
+        Logger::log_debug("relinking the grid after refits.");
+        link_shapes();
+        return true;
+    }
 
-        // Move to the next voxel.
-        // We choose the best axis.
-        // It's the one getting us to the closest voxel.
-        size_t axis = (next_t[1] < next_t[0]) ? 1 : 0;
-        axis = (next_t[2] < next_t[axis]) ? 2 : axis;
+    // Rebuild the grids of the dense cells the shapes went through,
+    // over the shapes of the cell and of its overflow list.
+    struct CellArrays
+    {
+        CellGrid            grid;
+        vector<uint32_t>    offsets;
+        vector<uint32_t>    ids;
+    };
 
-        // We stop if the current intersection point is
-        // closer than the next voxel.
-        if (rec.t < next_t[axis])
-            break;
+    vector<CellArrays> arrays(cells.size());
 
-        pos[axis] += step[axis];
+    run_chunks(cells.size(), GRID_SUBDIVIDE_CHUNK_SIZE, [&](const size_t begin, const size_t end)
+    {
+        vector<uint32_t> ids;
 
-        // Check if we are getting out of the grid.
-        if (pos[axis] == out[axis])
-            break;
+        for (size_t i = begin; i < end; ++i)
+        {
+            const size_t o = cells[i];
+
+            ids.assign(&m_voxel_ids[m_voxel_offsets[o]], &m_voxel_ids[0] + m_voxel_offsets[o + 1]);
+
+            if (has_overflow(o))
+                ids.insert(ids.end(), overflow(o).begin(), overflow(o).end());
+
+            subdivide_cell(
+                o, ids.data(), ids.data() + ids.size(),
+                arrays[i].grid, arrays[i].offsets, arrays[i].ids);
+        }
+    });
+
+    for (size_t i = 0; i < arrays.size(); ++i)
+        add_cell_grid(cells[i], arrays[i].grid, arrays[i].offsets, arrays[i].ids);
+
+    if (m_dead_grid_ids > static_cast<size_t>(m_grid_ids.size() * GRID_REFIT_COMPACT_RATIO))
+        compact_cell_grids();
+
+    return true;
+}
+
+void VoxelGridAccelerator::compact_cell_grids()
+{
+    vector<uint32_t> grid_offsets;
+    vector<uint32_t> grid_ids;
 
-        next_t[axis] += delta_t[axis];
+    grid_offsets.reserve(m_grid_offsets.size());
+    grid_ids.reserve(m_grid_ids.size() - m_dead_grid_ids);
+
+    for (CellGrid& grid : m_grids)
+    {
+        const size_t cell_resolution = grid.resolution[0] * grid.resolution[1] * grid.resolution[2];
+        const uint32_t* offsets = &m_grid_offsets[grid.offsets];
+        const uint32_t ids_base = static_cast<uint32_t>(grid_ids.size());
+
+        grid_ids.insert(grid_ids.end(), &m_grid_ids[0] + offsets[0], &m_grid_ids[0] + offsets[cell_resolution]);
+
+        grid.offsets = static_cast<uint32_t>(grid_offsets.size());
+
+        for (size_t c = 0; c <= cell_resolution; ++c)
+            grid_offsets.push_back(ids_base + offsets[c] - offsets[0]);
     }
 
-    return hit_something;
-#endif
+    m_grid_offsets.swap(grid_offsets);
+    m_grid_ids.swap(grid_ids);
+    m_dead_grid_ids = 0;
 }
 
-float VoxelGridAccelerator::voxel_size() const
+void VoxelGridAccelerator::voxel_range(
+    const AABB&                         bbox,
+    ivec3&                              index_min,
+    ivec3&                              index_max) const
 {
-    return m_best_voxel_size;
+    for (size_t a = 0; a < 3; ++a)
+    {
+        index_min[a] = static_cast<int>(voxel(bbox.min, a));
+        index_max[a] = static_cast<int>(voxel(bbox.max, a));
+    }
 }
 
 size_t VoxelGridAccelerator::voxel(const vec3& position, const size_t axis) const
@@ -3,33 +3,52 @@
 
 // couscous includes.
 #include "renderer/aabb.h"
+#include "renderer/instance.h"
 #include "renderer/visualobject.h"
 
 // Standard includes.
+#include <cstdint>
 #include <memory>
+#include <unordered_map>
 #include <vector>
 
 // Forward declarations.
+struct PacketHits;
 class Ray;
-
-// A voxel contains a list to
-// shapes that go through it.
-class Voxel
-{
-  public:
-    std::vector<std::shared_ptr<VisualObject>> objects;
-
-    bool hit(
-        const Ray&                          r,
-        const float                         tmin,
-        HitRecord&                          rec) const;
-};
+struct RayPacket;
 
 // A grid accelerator link shapes to a grid of voxel.
+// Instances are found by their own BVH, tested after the grid.
+//
+// The grid has two levels: the cells of the grid are sized for the
+// whole scene, and cells crossed by many shapes have a finer grid of
+// their own, so that dense regions of large scenes are not under
+// resolved. Rays walk the cells, skipping empty ones, and walk the
+// grid of a dense cell from where they enter it.
+//
+// The shapes of all the voxels are stored in one array of 32 bits shape
+// ids, voxel after voxel, and an offsets array gives where each voxel
+// starts. A bit per voxel tells if it has shapes, so that traversal skips
+// empty voxels without reading their offsets. Arrays are built in
+// parallel: shapes are counted per voxel, the counts are scanned into the
+// offsets, and shapes are then written at the offsets.
+//
+// Moving shapes are refit without relinking the grid: a shape entering
+// new voxels is added to an overflow list of each of them, and stays
+// listed in the voxels it left, where rays only test it for nothing.
+// The grids of the dense cells it goes through are rebuilt. The grid is
+// relinked once the overflow lists grow too large.
+//
+// Packets of coherent rays walk the grid together, slice by slice
+// across the main axis of their directions: the voxels of a slice
+// crossed by the packet frustum are visited once for all the rays.
+// The grids of dense cells are walked by the packet the same way.
 class VoxelGridAccelerator
 {
   public:
-    VoxelGridAccelerator(const MeshGroup& world);
+    VoxelGridAccelerator(
+        const MeshGroup&                    world,
+        const InstanceGroup&                instances = InstanceGroup());
 
     bool hit(
         const Ray&                          r,
@@ -37,17 +56,117 @@ class VoxelGridAccelerator
         float                               tmax,
         HitRecord&                          rec) const;
 
+    // Find the closest hit of each ray of the packet. The records of
+    // the rays hitting nothing have a null material. Rays going both
+    // ways along the main axis are traced one by one.
+    void hit_packet(
+        const RayPacket&                    packet,
+        const float                         tmin,
+        HitRecord*                          recs) const;
+
+    // Find the closest hit of each ray of a batch of incoherent rays.
+    // Rays are traced sorted by the voxel of their origin and the octant
+    // of their direction, so that consecutive rays walk the same voxels,
+    // and hit attributes are computed once all the rays are traced.
+    // The records of the rays hitting nothing have a null material.
+    void hit_stream(
+        const std::vector<Ray>&             rays,
+        const float                         tmin,
+        std::vector<HitRecord>&             recs) const;
+
     float voxel_size() const;
 
+    // Update the voxels of the given shapes after they moved, and the
+    // grids of the dense cells they leave or enter. The grid bounds and
+    // resolution are kept: returns false, leaving the grid unchanged,
+    // if a shape moved out of the grid bounds.
+    bool refit(
+        const MeshGroup&                    shapes,
+        const std::vector<AABB>&            previous_bboxes);
+
   private:
     const MeshGroup&            m_world;
     glm::ivec3                  m_voxels_per_axis;
     glm::vec3                   m_voxel_size;
     glm::vec3                   m_inv_voxel_size;
     AABB                        m_bounds;
-    std::unique_ptr<Voxel[]>    m_voxels;
     float                       m_best_voxel_size;
 
+    // Shapes of the world, indexed by id.
+    std::vector<const Triangle*> m_shapes;
+
+    // Ids of the shapes of voxel i are m_voxel_ids[m_voxel_offsets[i], m_voxel_offsets[i + 1]).
+    std::vector<std::uint32_t>  m_voxel_offsets;
+    std::vector<std::uint32_t>  m_voxel_ids;
+
+    // Bit i is set if voxel i has shapes.
+    std::vector<std::uint64_t>  m_occupied;
+
+    // Grid subdividing a dense cell. The shapes of its voxel i are
+    // m_grid_ids[m_grid_offsets[offsets + i], m_grid_offsets[offsets + i + 1]).
+    struct CellGrid
+    {
+        glm::vec3               origin;
+        glm::vec3               voxel_size;
+        glm::vec3               inv_voxel_size;
+        glm::ivec3              resolution;
+        std::uint32_t           offsets;
+    };
+
+    // Index in m_grids of the grid of each cell, or -1.
+    std::vector<std::int32_t>   m_cell_grids;
+    std::vector<CellGrid>       m_grids;
+    std::vector<std::uint32_t>  m_grid_offsets;
+    std::vector<std::uint32_t>  m_grid_ids;
+    std::unique_ptr<InstanceBVH> m_instances;
+
+    // Shapes that entered a voxel since the grid was linked.
+    // Bit i is set if voxel i has an overflow list.
+    std::unordered_map<std::uint32_t, std::vector<std::uint32_t>> m_overflow;
+    std::vector<std::uint64_t>  m_overflowed;
+    std::unordered_map<const Triangle*, std::uint32_t> m_shape_ids; // built by the first refit
+    size_t                      m_overflow_count;
+    size_t                      m_dead_grid_ids; // in the arrays of replaced cell grids
+
+    // Fill the voxels with the shapes of the world.
+    void link_shapes();
+
+    // Create the grids of the dense cells.
+    void subdivide_cells();
+
+    // Build the grid of the dense cell o over the given shapes.
+    void subdivide_cell(
+        const size_t                        o,
+        const std::uint32_t*                ids_begin,
+        const std::uint32_t*                ids_end,
+        CellGrid&                           grid,
+        std::vector<std::uint32_t>&         offsets,
+        std::vector<std::uint32_t>&         ids) const;
+
+    // Append the arrays of a cell grid, and make it the grid of cell o.
+    void add_cell_grid(
+        const size_t                        o,
+        CellGrid                            grid,
+        const std::vector<std::uint32_t>&   offsets,
+        const std::vector<std::uint32_t>&   ids);
+
+    // Drop the arrays of the replaced cell grids.
+    void compact_cell_grids();
+
+    // Find the closest triangle of the grid hit by the ray,
+    // without computing the attributes of the hit.
+    bool hit_triangles(
+        const Ray&                          r,
+        const float                         tmin,
+        float                               tmax,
+        HitRecord&                          rec) const;
+
+    // Find the closest triangle hit by each ray of the packet.
+    void hit_packet_triangles(
+        const RayPacket&                    packet,
+        const float                         tmin,
+        PacketHits&                         hits) const;
+
     // Given a 3D position and an axis, return the index of
     // the voxel where the point is.
     size_t voxel(const glm::vec3& position, const size_t axis) const;
@@ -56,11 +175,33 @@ class VoxelGridAccelerator
     // coordinate of the voxel.
     float position(const size_t voxel, const size_t axis) const;
 
+    // Find the min and max voxels a bounding box is going through.
+    void voxel_range(
+        const AABB&                         bbox,
+        glm::ivec3&                         index_min,
+        glm::ivec3&                         index_max) const;
+
+    inline bool is_occupied(const size_t offset) const;
+    inline bool has_overflow(const size_t offset) const;
+
+    // Shapes added to voxel o since the grid was linked.
+    const std::vector<std::uint32_t>& overflow(const size_t o) const;
+
     // Return the memory index of a given indexed voxel.
     inline size_t offset(const size_t x, const size_t y, const size_t z) const;
     inline size_t offset(const glm::ivec3& pos) const;
 };
 
+bool VoxelGridAccelerator::is_occupied(const size_t offset) const
+{
+    return (m_occupied[offset >> 6] >> (offset & 63)) & 1;
+}
+
+bool VoxelGridAccelerator::has_overflow(const size_t offset) const
+{
+    return (m_overflowed[offset >> 6] >> (offset & 63)) & 1;
+}
+
 size_t VoxelGridAccelerator::offset(const size_t x, const size_t y, const size_t z) const
 {
     return z * m_voxels_per_axis[0] * m_voxels_per_axis[1] + y * m_voxels_per_axis[0] + x;
@@ -0,0 +1,171 @@
+// Interface.
+#include "renderer/importancemap.h"
+
+// couscous includes.
+#include "common/logger.h"
+#include "renderer/camera.h"
+#include "renderer/gridaccelerator.h"
+#include "renderer/material.h"
+#include "renderer/rng.h"
+#include "renderer/utility.h"
+
+// Qt includes.
+#include <QFuture>
+#ifdef _MSC_VER
+#include <QtConcurrent/QtConcurrentRun>
+#else
+#include <QtConcurrentRun>
+#endif
+#include <QTime>
+
+// Standard includes.
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <string>
+
+using namespace glm;
+using namespace std;
+
+// Bounces on metallic surfaces followed by camera rays.
+#define IMPORTANCE_MAX_DEPTH 8
+
+// Rows of the coarse image processed by a job.
+#define IMPORTANCE_ROWS_PER_JOB 64
+
+//
+// ImportanceMap class implementation.
+//
+
+ImportanceMap::ImportanceMap(const float cell_size)
+  : m_inv_cell_size(1.0f / cell_size)
+{
+}
+
+void ImportanceMap::compute(
+    const Camera&                   camera,
+    const VoxelGridAccelerator&     grid,
+    const size_t                    width,
+    const size_t                    height,
+    const size_t                    pixels_step,
+    const size_t                    gather_rays_count,
+    const bool                      parallel,
+    RNG&                            rng)
+{
+    QTime timer;
+    timer.start();
+
+    // Job marking the cells seen from the pixels of rows [y1, y2).
+    auto compute =
+    [&](
+        const size_t                y1,
+        const size_t                y2,
+        vector<uint64_t>*           cells)
+    {
+        HitRecord rec, gather_rec;
+
+        for (size_t y = y1; y < y2; y += pixels_step)
+        {
+            for (size_t x = 0; x < width; x += pixels_step)
+            {
+                // In Qt, y is going from top to bottom.
+                Ray r = camera.get_ray(
+                    (x + rng.next() * pixels_step) / static_cast<float>(width),
+                    (height - y - 1 + rng.next() * pixels_step) / static_cast<float>(height));
+
+                for (size_t depth = 0; depth < IMPORTANCE_MAX_DEPTH; ++depth)
+                {
+                    if (!grid.hit(r, 0.0001f, numeric_limits<float>::max(), rec) || rec.mat->light)
+                        break;
+
+                    mark(rec.p, *cells);
+
+                    // Follow metallic reflections.
+                    if (rec.mat->metallic)
+                    {
+                        r = Ray(rec.p, reflect(r.dir, rec.normal));
+                        continue;
+                    }
+
+                    // Final gather rays look photons up where they hit.
+                    for (size_t i = 0; i < gather_rays_count; ++i)
+                    {
+                        const Ray gather_ray(rec.p, random_in_hemisphere(rec.normal, rng));
+
+                        if (grid.hit(gather_ray, 0.000001f, numeric_limits<float>::max(), gather_rec))
+                            mark(gather_rec.p, *cells);
+                    }
+
+                    break;
+                }
+            }
+        }
+    };
+
+    const size_t jobs_count = (height + IMPORTANCE_ROWS_PER_JOB - 1) / IMPORTANCE_ROWS_PER_JOB;
+    vector<vector<uint64_t>> cells(jobs_count);
+    vector<QFuture<void>> threads;
+
+    for (size_t i = 0; i < jobs_count; ++i)
+    {
+        const size_t y1 = i * IMPORTANCE_ROWS_PER_JOB;
+        const size_t y2 = std::min(y1 + IMPORTANCE_ROWS_PER_JOB, height);
+
+        if (parallel)
+            threads.push_back(QtConcurrent::run(compute, y1, y2, &cells[i]));
+        else
+            compute(y1, y2, &cells[i]);
+    }
+
+    for (size_t i = 0; i < threads.size(); ++i)
+    {
+        threads.at(i).waitForFinished();
+    }
+
+    for (size_t i = 0; i < cells.size(); ++i)
+        m_cells.insert(cells[i].begin(), cells[i].end());
+
+    Logger::log_debug(
+        "importance map: " + to_string(m_cells.size()) + " cells marked in "
+        + to_string(timer.elapsed()) + "ms.");
+}
+
+bool ImportanceMap::is_important(const vec3& position) const
+{
+    return m_cells.count(cell(cell_coords(position))) > 0;
+}
+
+size_t ImportanceMap::size() const
+{
+    return m_cells.size();
+}
+
+uint64_t ImportanceMap::cell(const ivec3& coords) const
+{
+    // Pack 21 bits per axis.
+    const uint64_t mask = (uint64_t(1) << 21) - 1;
+
+    return (uint64_t(coords.x) & mask)
+        | ((uint64_t(coords.y) & mask) << 21)
+        | ((uint64_t(coords.z) & mask) << 42);
+}
+
+ivec3 ImportanceMap::cell_coords(const vec3& position) const
+{
+    return ivec3(
+        static_cast<int>(floor(position.x * m_inv_cell_size)),
+        static_cast<int>(floor(position.y * m_inv_cell_size)),
+        static_cast<int>(floor(position.z * m_inv_cell_size)));
+}
+
+void ImportanceMap::mark(
+    const vec3&                     position,
+    vector<uint64_t>&               cells) const
+{
+    const ivec3 coords = cell_coords(position);
+
+    for (int z = -1; z <= 1; ++z)
+        for (int y = -1; y <= 1; ++y)
+            for (int x = -1; x <= 1; ++x)
+                cells.push_back(cell(coords + ivec3(x, y, z)));
+}
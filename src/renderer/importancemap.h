@@ -0,0 +1,64 @@
+#ifndef RENDERER_IMPORTANCEMAP_H
+#define RENDERER_IMPORTANCEMAP_H
+
+// glm includes.
+#include <glm/glm.hpp>
+
+// Standard includes.
+#include <cstddef>
+#include <cstdint>
+#include <unordered_set>
+#include <vector>
+
+// Forward declarations.
+class Camera;
+class RNG;
+class VoxelGridAccelerator;
+
+//
+// Regions of the scene where photons are looked up.
+//
+// A coarse camera pass marks the cells of the surfaces seen by the camera,
+// and of the surfaces seen by final gather rays from there. Photon tracing
+// uses it to emit toward these regions and to thin out the photons stored
+// elsewhere. Cells are at least as large as the photon search radius and
+// marking a cell also marks its neighbours, so a lookup never misses a
+// photon because it landed in an unmarked cell.
+//
+
+class ImportanceMap
+{
+  public:
+    ImportanceMap(const float cell_size);
+
+    // Trace one camera ray every pixels_step pixels of a width * height
+    // image, and gather_rays_count final gather rays from each diffuse hit.
+    void compute(
+        const Camera&                   camera,
+        const VoxelGridAccelerator&     grid,
+        const size_t                    width,
+        const size_t                    height,
+        const size_t                    pixels_step,
+        const size_t                    gather_rays_count,
+        const bool                      parallel,
+        RNG&                            rng);
+
+    bool is_important(const glm::vec3& position) const;
+
+    // Number of marked cells.
+    size_t size() const;
+
+  private:
+    std::uint64_t cell(const glm::ivec3& coords) const;
+    glm::ivec3 cell_coords(const glm::vec3& position) const;
+
+    // Mark the cell of the position and its neighbours.
+    void mark(
+        const glm::vec3&                position,
+        std::vector<std::uint64_t>&     cells) const;
+
+    const float                         m_inv_cell_size;
+    std::unordered_set<std::uint64_t>   m_cells;
+};
+
+#endif // RENDERER_IMPORTANCEMAP_H
@@ -0,0 +1,403 @@
+// Interface.
+#include "renderer/instance.h"
+
+// couscous includes.
+#include "renderer/gridaccelerator.h"
+#include "renderer/material.h"
+#include "renderer/ray.h"
+#include "renderer/stats.h"
+
+// Qt includes.
+#include <QFuture>
+#ifdef _MSC_VER
+#include <QtConcurrent/QtConcurrentRun>
+#else
+#include <QtConcurrentRun>
+#endif
+
+// Standard includes.
+#include <algorithm>
+#include <cassert>
+#include <limits>
+
+using namespace glm;
+using namespace std;
+
+// Maximum number of instances in a leaf of the top level BVH.
+#define INSTANCE_BVH_LEAF_SIZE 2
+
+// Maximum depth of the top level BVH traversal.
+#define INSTANCE_BVH_STACK_SIZE 64
+
+// Deeper nodes are split at the median instead of with the surface area
+// heuristic, so that they add at most 32 levels for 2^32 instances and
+// the tree depth stays below INSTANCE_BVH_STACK_SIZE.
+#define INSTANCE_BVH_SAH_MAX_DEPTH 32
+
+// Number of bins the surface area heuristic is evaluated on.
+#define INSTANCE_BVH_BINS 16
+
+// Subtrees with fewer instances are built on the current thread.
+#define INSTANCE_BVH_PARALLEL_MIN_INSTANCES 4096
+
+namespace
+{
+    float surface_area(const AABB& bbox)
+    {
+        const vec3 d = bbox.max - bbox.min;
+        return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+    }
+
+    vec3 centroid(const MeshInstance& instance)
+    {
+        return (instance.bbox().min + instance.bbox().max) * 0.5f;
+    }
+
+    // Bin of a centroid coordinate along an axis of the centroids bounds.
+    size_t bin(
+        const float     coordinate,
+        const float     min,
+        const float     extent)
+    {
+        const size_t index = static_cast<size_t>(INSTANCE_BVH_BINS * (coordinate - min) / extent);
+        return std::min(index, size_t(INSTANCE_BVH_BINS - 1));
+    }
+}
+
+//
+// InstancedMesh class implementation.
+//
+
+InstancedMesh::InstancedMesh(const MeshGroup& triangles)
+  : m_triangles(triangles)
+  , m_grid(new VoxelGridAccelerator(m_triangles))
+{
+    assert(!m_triangles.empty());
+
+    m_bbox = m_triangles[0]->bbox();
+
+    for (size_t i = 1; i < m_triangles.size(); ++i)
+        m_bbox += m_triangles[i]->bbox();
+}
+
+InstancedMesh::~InstancedMesh()
+{
+}
+
+bool InstancedMesh::hit(
+    const Ray&                          r,
+    const float                         tmin,
+    const float                         tmax,
+    HitRecord&                          rec) const
+{
+    return m_grid->hit(r, tmin, tmax, rec);
+}
+
+const AABB& InstancedMesh::bbox() const
+{
+    return m_bbox;
+}
+
+size_t InstancedMesh::size() const
+{
+    return m_triangles.size();
+}
+
+
+//
+// MeshInstance class implementation.
+//
+
+MeshInstance::MeshInstance(
+    const shared_ptr<InstancedMesh>&    mesh,
+    const mat4&                         transform,
+    const shared_ptr<Material>&         material)
+  : m_mesh(mesh)
+  , m_mat(material)
+  , m_to_object(inverse(transform))
+  , m_normals_transform(transpose(mat3(m_to_object)))
+{
+    // World bounding box of the transformed object bounding box corners.
+    const AABB& object_bbox = m_mesh->bbox();
+
+    for (size_t i = 0; i < 8; ++i)
+    {
+        const vec3 corner(
+            (i & 1) ? object_bbox.max.x : object_bbox.min.x,
+            (i & 2) ? object_bbox.max.y : object_bbox.min.y,
+            (i & 4) ? object_bbox.max.z : object_bbox.min.z);
+        const vec3 p = vec3(transform * vec4(corner, 1.0f));
+
+        if (i == 0)
+            m_bbox = AABB(p);
+        else
+            m_bbox.add_point(p);
+    }
+}
+
+bool MeshInstance::hit(
+    const Ray&                          r,
+    const float                         tmin,
+    const float                         tmax,
+    HitRecord&                          rec) const
+{
+    if (!m_bbox.intersect(r, tmin, tmax))
+        return false;
+
+    // The direction is not normalized, so that
+    // t is the same in object and world spaces.
+    const Ray object_ray(
+        vec3(m_to_object * vec4(r.origin, 1.0f)),
+        vec3(m_to_object * vec4(r.dir, 0.0f)));
+
+    if (!m_mesh->hit(object_ray, tmin, tmax, rec))
+        return false;
+
+    rec.p = r.point(rec.t);
+    rec.normal = normalize(m_normals_transform * rec.normal);
+    rec.mat = m_mat.get();
+
+    return true;
+}
+
+const AABB& MeshInstance::bbox() const
+{
+    return m_bbox;
+}
+
+const shared_ptr<Material>& MeshInstance::mat() const
+{
+    return m_mat;
+}
+
+
+//
+// InstanceBVH class implementation.
+//
+
+InstanceBVH::InstanceBVH(const InstanceGroup& instances)
+  : m_instances(instances)
+{
+    if (m_instances.empty())
+        return;
+
+    // A binary tree has at most 2n - 1 nodes.
+    m_nodes.resize(2 * m_instances.size() - 1);
+
+    atomic<size_t> nodes_count(1);
+    build(0, 0, m_instances.size(), 0, nodes_count);
+
+    m_nodes.resize(nodes_count);
+}
+
+void InstanceBVH::build(
+    const size_t                        node,
+    const size_t                        begin,
+    const size_t                        end,
+    const size_t                        depth,
+    atomic<size_t>&                     nodes_count)
+{
+    const size_t count = end - begin;
+
+    AABB bbox = m_instances[begin]->bbox();
+    AABB centroids(centroid(*m_instances[begin]));
+
+    for (size_t i = begin + 1; i < end; ++i)
+    {
+        bbox += m_instances[i]->bbox();
+        centroids.add_point(centroid(*m_instances[i]));
+    }
+
+    m_nodes[node].bbox = bbox;
+
+    if (count <= INSTANCE_BVH_LEAF_SIZE)
+    {
+        m_nodes[node].first = static_cast<uint32_t>(begin);
+        m_nodes[node].count = static_cast<uint32_t>(count);
+        return;
+    }
+
+    // Find the bin boundary with the lowest surface area heuristic cost.
+    size_t best_axis = 0;
+    size_t best_split = 0;
+    float best_cost = numeric_limits<float>::max();
+
+    for (size_t axis = 0; axis < 3 && depth < INSTANCE_BVH_SAH_MAX_DEPTH; ++axis)
+    {
+        const float min = centroids.min[axis];
+        const float extent = centroids.max[axis] - min;
+
+        if (extent <= 0.0f)
+            continue;
+
+        AABB bins[INSTANCE_BVH_BINS];
+        size_t counts[INSTANCE_BVH_BINS] = {};
+
+        for (size_t i = begin; i < end; ++i)
+        {
+            const size_t b = bin(centroid(*m_instances[i])[axis], min, extent);
+            bins[b] = counts[b] ? bins[b] + m_instances[i]->bbox() : m_instances[i]->bbox();
+            ++counts[b];
+        }
+
+        // Cost of the right side of each boundary.
+        float right_costs[INSTANCE_BVH_BINS];
+        AABB right;
+        size_t right_count = 0;
+
+        for (size_t b = INSTANCE_BVH_BINS - 1; b > 0; --b)
+        {
+            if (counts[b])
+            {
+                right = right_count ? right + bins[b] : bins[b];
+                right_count += counts[b];
+            }
+
+            right_costs[b] = right_count ? right_count * surface_area(right) : 0.0f;
+        }
+
+        AABB left;
+        size_t left_count = 0;
+
+        for (size_t b = 1; b < INSTANCE_BVH_BINS; ++b)
+        {
+            if (counts[b - 1])
+            {
+                left = left_count ? left + bins[b - 1] : bins[b - 1];
+                left_count += counts[b - 1];
+            }
+
+            if (left_count == 0 || left_count == count)
+                continue;
+
+            const float cost = left_count * surface_area(left) + right_costs[b];
+
+            if (cost < best_cost)
+            {
+                best_cost = cost;
+                best_axis = axis;
+                best_split = b;
+            }
+        }
+    }
+
+    size_t middle = begin + count / 2;
+
+    if (depth >= INSTANCE_BVH_SAH_MAX_DEPTH)
+    {
+        // Median split along the largest extent of the centroids.
+        const size_t axis = centroids.max_extent();
+
+        nth_element(
+            m_instances.begin() + begin,
+            m_instances.begin() + middle,
+            m_instances.begin() + end,
+            [axis](const shared_ptr<MeshInstance>& lhs, const shared_ptr<MeshInstance>& rhs)
+            {
+                return centroid(*lhs)[axis] < centroid(*rhs)[axis];
+            });
+    }
+    else if (best_split > 0)
+    {
+        const float min = centroids.min[best_axis];
+        const float extent = centroids.max[best_axis] - min;
+
+        middle = static_cast<size_t>(partition(
+            m_instances.begin() + begin,
+            m_instances.begin() + end,
+            [&](const shared_ptr<MeshInstance>& instance)
+            {
+                return bin(centroid(*instance)[best_axis], min, extent) < best_split;
+            }) - m_instances.begin());
+    }
+
+    // Instances with the same centroid are split in two halves.
+    if (middle == begin || middle == end)
+        middle = begin + count / 2;
+
+    const size_t first = nodes_count.fetch_add(2);
+    m_nodes[node].first = static_cast<uint32_t>(first);
+    m_nodes[node].count = 0;
+
+    // Children cover disjoint instances and nodes:
+    // the first one is built on another thread.
+    if (count >= INSTANCE_BVH_PARALLEL_MIN_INSTANCES)
+    {
+        QFuture<void> left = QtConcurrent::run(
+            [this, first, begin, middle, depth, &nodes_count]()
+            {
+                build(first, begin, middle, depth + 1, nodes_count);
+            });
+
+        build(first + 1, middle, end, depth + 1, nodes_count);
+
+        // If no worker picked the first child yet, it runs here.
+        left.waitForFinished();
+    }
+    else
+    {
+        build(first, begin, middle, depth + 1, nodes_count);
+        build(first + 1, middle, end, depth + 1, nodes_count);
+    }
+}
+
+bool InstanceBVH::hit(
+    const Ray&                          r,
+    const float                         tmin,
+    const float                         tmax,
+    HitRecord&                          rec) const
+{
+    if (m_nodes.empty())
+        return false;
+
+    bool hit_something = false;
+    float closest = tmax;
+
+    uint32_t stack[INSTANCE_BVH_STACK_SIZE];
+    size_t stack_size = 0;
+    size_t node = 0;
+    size_t nodes_visited = 0;
+
+    while (true)
+    {
+        const Node& current = m_nodes[node];
+        ++nodes_visited;
+
+        if (current.bbox.intersect(r, tmin, closest))
+        {
+            if (current.count > 0)
+            {
+                for (size_t i = current.first, e = current.first + current.count; i < e; ++i)
+                {
+                    if (m_instances[i]->hit(r, tmin, closest, rec))
+                    {
+                        hit_something = true;
+                        closest = rec.t;
+                    }
+                }
+            }
+            else
+            {
+                assert(stack_size < INSTANCE_BVH_STACK_SIZE);
+                stack[stack_size++] = current.first + 1;
+                node = current.first;
+                continue;
+            }
+        }
+
+        if (stack_size == 0)
+            break;
+
+        node = stack[--stack_size];
+    }
+
+    Stats::add(StatCounter::NodesVisited, nodes_visited);
+
+    return hit_something;
+}
+
+const AABB& InstanceBVH::bbox() const
+{
+    assert(!m_nodes.empty());
+    return m_nodes[0].bbox;
+}
@@ -0,0 +1,134 @@
+#ifndef RENDERER_INSTANCE_H
+#define RENDERER_INSTANCE_H
+
+// couscous includes.
+#include "renderer/aabb.h"
+#include "renderer/visualobject.h"
+
+// glm includes.
+#include <glm/glm.hpp>
+
+// Standard includes.
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Forward declarations.
+class Material;
+class Ray;
+class VoxelGridAccelerator;
+
+//
+// Object instancing.
+//
+// A mesh placed many times in a scene is stored once, in object space,
+// with its own grid accelerator: the bottom level structure. Each
+// placement is a MeshInstance holding only a transform and a material.
+// Rays are transformed into object space to be intersected with the
+// shared mesh, and the hit is transformed back into world space.
+// Instances are found by a BVH over their world bounding boxes: the
+// top level structure.
+//
+// Instances are not light sources, nor caustic targets: emissive and
+// metallic meshes must be created with create_triangle_mesh so that
+// they are fetched as lights and as metallic objects. As
+// triangles are culled in object space, mirroring transforms flip
+// the side they are visible from.
+//
+
+// A mesh shared by instances, with its acceleration structure.
+class InstancedMesh
+{
+  public:
+    // Triangles are expected in object space.
+    InstancedMesh(const MeshGroup& triangles);
+    ~InstancedMesh();
+
+    bool hit(
+        const Ray&                          r,
+        const float                         tmin,
+        const float                         tmax,
+        HitRecord&                          rec) const;
+
+    const AABB& bbox() const;
+
+    size_t size() const;
+
+  private:
+    const MeshGroup                         m_triangles;
+    std::unique_ptr<VoxelGridAccelerator>   m_grid;
+    AABB                                    m_bbox;
+};
+
+// A placement of an instanced mesh.
+class MeshInstance : public VisualObject
+{
+  public:
+    MeshInstance(
+        const std::shared_ptr<InstancedMesh>&   mesh,
+        const glm::mat4&                        transform,
+        const std::shared_ptr<Material>&        material);
+
+    // The hit record triangle is the triangle of the shared
+    // mesh, its vertices are in object space.
+    bool hit(
+        const Ray&                          r,
+        const float                         tmin,
+        const float                         tmax,
+        HitRecord&                          rec) const override;
+
+    const AABB& bbox() const override;
+
+    const std::shared_ptr<Material>& mat() const override;
+
+  private:
+    std::shared_ptr<InstancedMesh>          m_mesh;
+    std::shared_ptr<Material>               m_mat;
+    glm::mat4                               m_to_object;
+    glm::mat3                               m_normals_transform;
+    AABB                                    m_bbox;
+};
+
+typedef std::vector<std::shared_ptr<MeshInstance>> InstanceGroup;
+
+// Bounding volume hierarchy over the instances of a scene.
+// Nodes are split with the surface area heuristic evaluated on bins of
+// the instances centroids, and large subtrees are built in parallel.
+class InstanceBVH
+{
+  public:
+    InstanceBVH(const InstanceGroup& instances);
+
+    bool hit(
+        const Ray&                          r,
+        const float                         tmin,
+        const float                         tmax,
+        HitRecord&                          rec) const;
+
+    const AABB& bbox() const;
+
+  private:
+    // Leaves reference count instances from first,
+    // inner nodes have their children at first and first + 1.
+    struct Node
+    {
+        AABB            bbox;
+        std::uint32_t   first;
+        std::uint32_t   count;
+    };
+
+    InstanceGroup                           m_instances;
+    std::vector<Node>                       m_nodes;
+
+    // Fill the given node, at the given depth, with the instances [begin, end)
+    // and create its children. Pairs of children nodes are allocated from nodes_count.
+    void build(
+        const size_t                        node,
+        const size_t                        begin,
+        const size_t                        end,
+        const size_t                        depth,
+        std::atomic<size_t>&                nodes_count);
+};
+
+#endif // RENDERER_INSTANCE_H
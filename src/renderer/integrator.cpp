@@ -0,0 +1,24 @@
+// Interface.
+#include "renderer/integrator.h"
+
+using namespace std;
+
+// Photon queries rarely return more photons than this,
+// so the buffer does not grow once the first tiles are done.
+#define SCRATCH_PHOTONS_CAPACITY 4096
+
+//
+// ShadingScratch implementation.
+//
+
+ShadingScratch::ShadingScratch()
+{
+    photons.reserve(SCRATCH_PHOTONS_CAPACITY);
+}
+
+void ShadingScratch::reset()
+{
+    photons.clear();
+    hemisphere_radiance.clear();
+    hemisphere_distance.clear();
+}
@@ -0,0 +1,122 @@
+#ifndef RENDERER_INTEGRATOR_H
+#define RENDERER_INTEGRATOR_H
+
+// couscous includes.
+#include "renderer/visualobject.h"
+
+// Standard includes.
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+// Forward declarations.
+class IrradianceCache;
+class PhotonTree;
+class RNG;
+class VoxelGridAccelerator;
+
+//
+// Available integrators.
+//
+// An integrator is a type exposing:
+//
+//   static glm::vec3 li(const Ray& r, ShadingContext& ctx);
+//
+// which returns the color seen along a camera ray. Camera rays are
+// traced by packets beforehand, and their closest hit is given to the
+// integrator by the context. The tile loop
+// is instantiated once per integrator type, so the render mode is
+// chosen once per frame instead of once per sample.
+//
+// ProgressivePhotonMap is not a per-sample integrator: it runs
+// spp iterations of stochastic progressive photon mapping, each
+// tracing photons_count photons.
+//
+// With stream_tracing, Final shades the camera rays of a block of
+// pixels first, then traces the final gather rays of the whole block
+// together instead of depth first. Records of the irradiance cache
+// are still computed depth first.
+//
+
+enum class IntegratorType
+{
+    Normal,
+    Albedo,
+    PhotonMap,
+    DirectDiffuse,
+    DirectSpecular,
+    DirectPhong,
+    IndirectLight,
+    ProgressivePhotonMap,
+    Final
+};
+
+
+//
+// Settings of a render.
+//
+
+struct RenderSettings
+{
+    size_t          width = 512;
+    size_t          height = 512;
+    size_t          spp = 8;
+    size_t          direct_light_rays_count = 8;
+    size_t          indirect_light_rays_count = 8;
+    size_t          photons_count = 12000;
+    size_t          caustic_photons_count = 10000;
+    bool            photons_importance = true;
+    bool            reuse_photons = false;
+    bool            parallel = true;
+    bool            irradiance_cache = false;
+    bool            stream_tracing = false;
+    IntegratorType  integrator = IntegratorType::Final;
+};
+
+
+//
+// Per-thread temporaries of the shading kernels.
+//
+// Kernels must not allocate per sample: every buffer they need lives
+// here, is reserved once per worker thread and reused by all the
+// samples shaded on that thread. reset() is called after each sample.
+//
+
+struct ShadingScratch
+{
+    ShadingScratch();
+
+    void reset();
+
+    // Results of photon queries (index, squared distance).
+    std::vector<std::pair<size_t, float>>       photons;
+
+    // Radiance and hit distance of the hemisphere
+    // samples of a new irradiance cache record.
+    std::vector<glm::vec3>                      hemisphere_radiance;
+    std::vector<float>                          hemisphere_distance;
+};
+
+
+//
+// Everything an integrator needs to shade a sample.
+// One context is created per tile job. The irradiance cache
+// and the caustic tree are null when they are not used.
+// camera_hit is the closest hit of the camera ray being shaded,
+// or null when it was not traced beforehand.
+//
+
+struct ShadingContext
+{
+    const RenderSettings&                       settings;
+    const VoxelGridAccelerator&                 grid;
+    const MeshGroup&                            lights;
+    const PhotonTree&                           ptree;
+    const PhotonTree*                           caustic_tree;
+    RNG&                                        rng;
+    ShadingScratch&                             scratch;
+    IrradianceCache*                            irradiance_cache;
+    const HitRecord*                            camera_hit;
+};
+
+#endif // RENDERER_INTEGRATOR_H
@@ -0,0 +1,289 @@
+// Interface.
+#include "renderer/irradiancecache.h"
+
+// couscous includes.
+#include "renderer/utility.h"
+
+// Qt includes.
+#include <QReadLocker>
+#include <QWriteLocker>
+
+// Standard includes.
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+using namespace glm;
+using namespace std;
+
+#define COUCOUS_M_PI 3.1416f
+#define COUCOUS_M_2PI 2.0f * 3.1416f
+
+// Records in front of a point by more than this fraction
+// of their radius are not used to shade it.
+#define RECORD_FRONT_TOLERANCE 0.05f
+
+namespace
+{
+    // Unit vector of the tangent plane at angle phi.
+    vec3 planar_direction(
+        const vec3& tangent,
+        const vec3& bitangent,
+        const float phi)
+    {
+        return tangent * cos(phi) + bitangent * sin(phi);
+    }
+
+    // Polar angle of the j-th boundary of the cosine weighted strata.
+    float theta_boundary(const size_t j, const size_t theta_count)
+    {
+        return asin(sqrt(static_cast<float>(j) / static_cast<float>(theta_count)));
+    }
+}
+
+IrradianceCache::IrradianceCache(
+    const float                     error,
+    const float                     min_radius,
+    const float                     max_radius)
+  : m_error(error)
+  , m_min_radius(min_radius)
+  , m_max_radius(max_radius)
+  , m_inv_cell_size(1.0f / (error * max_radius))
+{
+}
+
+void IrradianceCache::strata(
+    const size_t                    ray_count,
+    size_t&                         theta_count,
+    size_t&                         phi_count)
+{
+    // Ward suggests pi times more strata along phi than along theta.
+    theta_count = std::max(
+        size_t(2), static_cast<size_t>(sqrt(static_cast<float>(ray_count) / COUCOUS_M_PI)));
+    phi_count = std::max(size_t(3), ray_count / theta_count);
+}
+
+vec3 IrradianceCache::sample_direction(
+    const vec3&                     normal,
+    const size_t                    theta_count,
+    const size_t                    phi_count,
+    const size_t                    j,
+    const size_t                    k,
+    const float                     u,
+    const float                     v)
+{
+    vec3 tangent, bitangent;
+    make_basis(normal, tangent, bitangent);
+
+    const float sin_theta = sqrt((j + u) / static_cast<float>(theta_count));
+    const float cos_theta = sqrt(std::max(0.0f, 1.0f - sin_theta * sin_theta));
+    const float phi = COUCOUS_M_2PI * (k + v) / static_cast<float>(phi_count);
+
+    return planar_direction(tangent, bitangent, phi) * sin_theta + normal * cos_theta;
+}
+
+bool IrradianceCache::lookup(
+    const vec3&                     position,
+    const vec3&                     normal,
+    vec3&                           irradiance) const
+{
+    QReadLocker locker(&m_lock);
+
+    const auto it = m_cells.find(cell(cell_coords(position)));
+
+    if (it == m_cells.end())
+        return false;
+
+    vec3 sum(0.0f);
+    float weight_sum = 0.0f;
+
+    for (const size_t index : it->second)
+    {
+        const Record& record = m_records[index];
+        const vec3 d = position - record.position;
+
+        // Ward's error estimate.
+        const float error =
+            length(d) / record.radius
+            + sqrt(std::max(0.0f, 1.0f - dot(normal, record.normal)));
+
+        if (error >= m_error)
+            continue;
+
+        // Skip the records that are in front of the point.
+        if (dot(d, (normal + record.normal) * 0.5f) < -RECORD_FRONT_TOLERANCE * record.radius)
+            continue;
+
+        const float weight = 1.0f / std::max(error, 1.0e-4f);
+        const vec3 rotation = cross(record.normal, normal);
+
+        vec3 value;
+        for (size_t c = 0; c < 3; ++c)
+        {
+            value[c] = record.irradiance[c]
+                + dot(rotation, record.rotational[c])
+                + dot(d, record.translational[c]);
+        }
+
+        sum += max(value, vec3(0.0f)) * weight;
+        weight_sum += weight;
+    }
+
+    if (weight_sum == 0.0f)
+        return false;
+
+    irradiance = sum / weight_sum;
+
+    return true;
+}
+
+vec3 IrradianceCache::insert(
+    const vec3&                     position,
+    const vec3&                     normal,
+    const size_t                    theta_count,
+    const size_t                    phi_count,
+    const vector<vec3>&             radiance,
+    const vector<float>&            distance)
+{
+    assert(radiance.size() == theta_count * phi_count);
+    assert(distance.size() == theta_count * phi_count);
+
+    const float samples_count = static_cast<float>(theta_count * phi_count);
+    const float delta_phi = COUCOUS_M_2PI / static_cast<float>(phi_count);
+
+    vec3 tangent, bitangent;
+    make_basis(normal, tangent, bitangent);
+
+    Record record;
+    record.position = position;
+    record.normal = normal;
+    record.irradiance = vec3(0.0f);
+
+    for (size_t c = 0; c < 3; ++c)
+    {
+        record.rotational[c] = vec3(0.0f);
+        record.translational[c] = vec3(0.0f);
+    }
+
+    float inv_distance_sum = 0.0f;
+
+    for (size_t k = 0; k < phi_count; ++k)
+    {
+        const size_t previous_k = (k + phi_count - 1) % phi_count;
+        const float phi = delta_phi * (k + 0.5f);
+        const float phi_boundary = delta_phi * k;
+
+        const vec3 u_k = planar_direction(tangent, bitangent, phi);
+        const vec3 v_k = planar_direction(tangent, bitangent, phi + 0.5f * COUCOUS_M_PI);
+        const vec3 v_boundary = planar_direction(tangent, bitangent, phi_boundary + 0.5f * COUCOUS_M_PI);
+
+        vec3 rotational(0.0f), theta_changes(0.0f), phi_changes(0.0f);
+
+        for (size_t j = 0; j < theta_count; ++j)
+        {
+            const size_t index = j * phi_count + k;
+            const vec3& l = radiance[index];
+
+            const float theta_min = theta_boundary(j, theta_count);
+            const float theta_max = theta_boundary(j + 1, theta_count);
+            const float theta = asin(sqrt((j + 0.5f) / static_cast<float>(theta_count)));
+
+            record.irradiance += l;
+            inv_distance_sum += 1.0f / distance[index];
+            rotational -= l * tan(theta);
+
+            // Change across the boundary with the previous theta stratum.
+            if (j > 0)
+            {
+                const size_t previous = (j - 1) * phi_count + k;
+                const float cos_theta_min = cos(theta_min);
+
+                theta_changes += (l - radiance[previous])
+                    * (sin(theta_min) * cos_theta_min * cos_theta_min
+                        / std::min(distance[index], distance[previous]));
+            }
+
+            // Change across the boundary with the previous phi stratum.
+            {
+                const size_t previous = j * phi_count + previous_k;
+
+                phi_changes += (l - radiance[previous])
+                    * ((cos(theta_min) - cos(theta_max))
+                        / (sin(theta) * std::min(distance[index], distance[previous])));
+            }
+        }
+
+        for (size_t c = 0; c < 3; ++c)
+        {
+            record.rotational[c] += v_k * rotational[c];
+            record.translational[c] += u_k * (delta_phi * theta_changes[c]) + v_boundary * phi_changes[c];
+        }
+    }
+
+    // The record stores the cosine weighted mean of the radiance,
+    // gradients are scaled the same way.
+    record.irradiance /= samples_count;
+
+    for (size_t c = 0; c < 3; ++c)
+    {
+        record.rotational[c] /= samples_count;
+        record.translational[c] /= COUCOUS_M_PI;
+    }
+
+    // Harmonic mean distance to the surfaces seen by the samples, reduced
+    // where the translational gradient says the irradiance changes fast.
+    float radius = inv_distance_sum > 0.0f
+        ? samples_count / inv_distance_sum
+        : m_max_radius;
+
+    for (size_t c = 0; c < 3; ++c)
+    {
+        const float gradient = length(record.translational[c]);
+
+        if (gradient > 0.0f && record.irradiance[c] > 0.0f)
+            radius = std::min(radius, record.irradiance[c] / gradient);
+    }
+
+    record.radius = std::min(std::max(radius, m_min_radius), m_max_radius);
+
+    // A record is only used within error * radius of its position.
+    const float extent = m_error * record.radius;
+    const ivec3 min_cell = cell_coords(position - vec3(extent));
+    const ivec3 max_cell = cell_coords(position + vec3(extent));
+
+    QWriteLocker locker(&m_lock);
+
+    const size_t index = m_records.size();
+    m_records.push_back(record);
+
+    for (int z = min_cell.z; z <= max_cell.z; ++z)
+        for (int y = min_cell.y; y <= max_cell.y; ++y)
+            for (int x = min_cell.x; x <= max_cell.x; ++x)
+                m_cells[cell(ivec3(x, y, z))].push_back(index);
+
+    return record.irradiance;
+}
+
+size_t IrradianceCache::size() const
+{
+    QReadLocker locker(&m_lock);
+    return m_records.size();
+}
+
+uint64_t IrradianceCache::cell(const ivec3& coords) const
+{
+    // Pack 21 bits per axis.
+    const uint64_t mask = (uint64_t(1) << 21) - 1;
+
+    return (uint64_t(coords.x) & mask)
+        | ((uint64_t(coords.y) & mask) << 21)
+        | ((uint64_t(coords.z) & mask) << 42);
+}
+
+ivec3 IrradianceCache::cell_coords(const vec3& position) const
+{
+    return ivec3(
+        static_cast<int>(floor(position.x * m_inv_cell_size)),
+        static_cast<int>(floor(position.y * m_inv_cell_size)),
+        static_cast<int>(floor(position.z * m_inv_cell_size)));
+}
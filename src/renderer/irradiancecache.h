@@ -0,0 +1,101 @@
+#ifndef RENDERER_IRRADIANCECACHE_H
+#define RENDERER_IRRADIANCECACHE_H
+
+// QT includes.
+#include <QReadWriteLock>
+
+// glm includes.
+#include <glm/glm.hpp>
+
+// Standard includes.
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+//
+// Ward irradiance cache.
+//
+// Indirect diffuse lighting varies slowly on diffuse surfaces, so it is
+// computed at sparse records and interpolated elsewhere. A record is made
+// from a stratified, cosine weighted hemisphere of samples: it stores the
+// mean radiance, the harmonic mean distance to the surfaces seen, and the
+// rotational and translational gradients (Ward & Heckbert 1992) used to
+// extrapolate it. A record is used at a point when Ward's error estimate
+// is below the cache error bound.
+//
+// Records are stored in a hash grid. The cache is shared by all the
+// rendering threads: lookups take a read lock, insertions a write lock.
+//
+
+class IrradianceCache
+{
+  public:
+    // Radii of records are clamped to [min_radius, max_radius].
+    IrradianceCache(
+        const float                     error,
+        const float                     min_radius,
+        const float                     max_radius);
+
+    // Number of hemisphere strata of a record computed with about ray_count rays.
+    static void strata(
+        const size_t                    ray_count,
+        size_t&                         theta_count,
+        size_t&                         phi_count);
+
+    // Direction of the sample of stratum (j, k), jittered by (u, v).
+    static glm::vec3 sample_direction(
+        const glm::vec3&                normal,
+        const size_t                    theta_count,
+        const size_t                    phi_count,
+        const size_t                    j,
+        const size_t                    k,
+        const float                     u,
+        const float                     v);
+
+    // Interpolate the records valid at the given point.
+    // Returns false if there is none.
+    bool lookup(
+        const glm::vec3&                position,
+        const glm::vec3&                normal,
+        glm::vec3&                      irradiance) const;
+
+    // Create a record from the radiance and the hit distance of the
+    // samples of each stratum, indexed by j * phi_count + k, and return
+    // its irradiance. Distances of samples that hit nothing are infinite.
+    glm::vec3 insert(
+        const glm::vec3&                position,
+        const glm::vec3&                normal,
+        const size_t                    theta_count,
+        const size_t                    phi_count,
+        const std::vector<glm::vec3>&   radiance,
+        const std::vector<float>&       distance);
+
+    size_t size() const;
+
+  private:
+    struct Record
+    {
+        glm::vec3   position;
+        glm::vec3   normal;
+        glm::vec3   irradiance;
+        float       radius;
+
+        // Gradients of each color channel.
+        glm::vec3   rotational[3];
+        glm::vec3   translational[3];
+    };
+
+    std::uint64_t cell(const glm::ivec3& coords) const;
+    glm::ivec3 cell_coords(const glm::vec3& position) const;
+
+    const float                                             m_error;
+    const float                                             m_min_radius;
+    const float                                             m_max_radius;
+    const float                                             m_inv_cell_size;
+    std::vector<Record>                                     m_records;
+    std::unordered_map<std::uint64_t, std::vector<size_t>>  m_cells;
+    mutable QReadWriteLock                                  m_lock;
+};
+
+#endif // RENDERER_IRRADIANCECACHE_H
@@ -2,7 +2,9 @@
 
 // couscous includes.
 #include "common/logger.h"
+#include "renderer/importancemap.h"
 #include "renderer/rng.h"
+#include "renderer/stats.h"
 #include "renderer/utility.h"
 
 // Qt includes.
@@ -13,9 +15,14 @@
 #endif
 #include <QFuture>
 #include <QObject>
+#include <QThread>
 #include <QTime>
 
 // Standard includes.
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
 #include <string>
 
 using namespace std;
@@ -24,6 +31,33 @@ using namespace glm;
 // For the creation of the photon map on a single thread.
 // #define FORCE_SINGLE_THREAD
 
+#define COUCOUS_M_PI 3.1416f
+
+// Photon flags layout.
+#define PHOTON_AXIS_SHIFT 14
+#define PHOTON_MATERIAL_MASK 0x3FFF
+
+// Subtrees with fewer photons are balanced on the calling thread.
+#define PARALLEL_BALANCE_MIN_PHOTONS 32768
+
+// Irradiance estimates computed by a job.
+#define IRRADIANCE_ESTIMATES_PER_JOB 1024
+
+// Photon map files.
+#define PHOTON_FILE_MAGIC "CPM1"
+
+// Probability to keep a photon stored out of the important regions.
+#define IMPORTANCE_THINNING 0.1f
+
+// Strata of the hemisphere of a light, uniform in solid angle.
+#define EMISSION_THETA_STRATA 4
+#define EMISSION_PHI_STRATA 8
+
+// Pilot rays per stratum to estimate its importance,
+// and importance given to strata that hit nothing important.
+#define EMISSION_PILOT_RAYS 8
+#define EMISSION_MIN_IMPORTANCE 0.1f
+
 namespace
 {
     // Generate a random number U between 0-1, 0<alpha<1
@@ -39,6 +73,401 @@ namespace
 
         return energy / (1.0f - alpha);
     }
+
+    // Order photon query results by squared distance.
+    bool is_closer(
+        const pair<size_t, float>&  lhs,
+        const pair<size_t, float>&  rhs)
+    {
+        return lhs.second < rhs.second;
+    }
+
+    // Keep the k nearest photons in a max-heap.
+    // The farthest photon stays at the front so it can be replaced
+    // in O(log k) when a closer one is found.
+    class NearestPhotons
+    {
+      public:
+        NearestPhotons(
+            const size_t                    capacity,
+            const float                     max_squared_dist,
+            vector<pair<size_t, float>>&    results)
+          : m_capacity(capacity)
+          , m_worst_dist(max_squared_dist)
+          , m_results(results)
+        {
+            m_results.clear();
+        }
+
+        inline size_t size() const
+        {
+            return m_results.size();
+        }
+
+        inline bool full() const
+        {
+            return m_results.size() == m_capacity;
+        }
+
+        inline void add(const float dist, const size_t index)
+        {
+            if (dist >= m_worst_dist)
+                return;
+
+            if (full())
+            {
+                pop_heap(m_results.begin(), m_results.end(), is_closer);
+                m_results.back() = make_pair(index, dist);
+            }
+            else
+            {
+                m_results.emplace_back(index, dist);
+            }
+
+            push_heap(m_results.begin(), m_results.end(), is_closer);
+
+            // Once the heap is full, only closer photons are accepted.
+            if (full())
+                m_worst_dist = m_results.front().second;
+        }
+
+        inline float worst_dist() const
+        {
+            return m_worst_dist;
+        }
+
+      private:
+        const size_t                    m_capacity;
+        float                           m_worst_dist;
+        vector<pair<size_t, float>>&    m_results;
+    };
+
+    // Recursive nearest photons search in a left-balanced kd-tree.
+    void locate_photons(
+        const vector<Photon>&   photons,
+        const size_t            node,
+        const vec3&             point,
+        NearestPhotons&         nearest)
+    {
+        const Photon& photon = photons[node];
+        const size_t left = 2 * node + 1;
+
+        if (left < photons.size())
+        {
+            // Visit the side of the splitting plane the point is
+            // in first, then the other side if it can hold closer photons.
+            const size_t axis = photon.axis();
+            const float delta = point[axis] - photon.position[axis];
+            const size_t near_child = delta < 0.0f ? left : left + 1;
+            const size_t far_child = delta < 0.0f ? left + 1 : left;
+
+            if (near_child < photons.size())
+                locate_photons(photons, near_child, point, nearest);
+
+            if (far_child < photons.size() && delta * delta < nearest.worst_dist())
+                locate_photons(photons, far_child, point, nearest);
+        }
+
+        const vec3 d = point - photon.pos();
+        nearest.add(dot(d, d), node);
+    }
+
+    // Recursive search of the single nearest photon accepted by the filter,
+    // closer than nearest_dist. Does not need any result buffer.
+    template <typename Filter>
+    void locate_nearest_photon(
+        const vector<Photon>&   photons,
+        const size_t            node,
+        const vec3&             point,
+        const Filter&           accept,
+        size_t&                 nearest,
+        float&                  nearest_dist)
+    {
+        const Photon& photon = photons[node];
+        const size_t left = 2 * node + 1;
+
+        if (left < photons.size())
+        {
+            const size_t axis = photon.axis();
+            const float delta = point[axis] - photon.position[axis];
+            const size_t near_child = delta < 0.0f ? left : left + 1;
+            const size_t far_child = delta < 0.0f ? left + 1 : left;
+
+            if (near_child < photons.size())
+                locate_nearest_photon(photons, near_child, point, accept, nearest, nearest_dist);
+
+            if (far_child < photons.size() && delta * delta < nearest_dist)
+                locate_nearest_photon(photons, far_child, point, accept, nearest, nearest_dist);
+        }
+
+        if (!accept(node))
+            return;
+
+        const vec3 d = point - photon.pos();
+        const float dist = dot(d, d);
+
+        if (dist < nearest_dist)
+        {
+            nearest = node;
+            nearest_dist = dist;
+        }
+    }
+
+    // Emission of a light driven by an importance map.
+    //
+    // The hemisphere of the light is split in strata of equal solid angle,
+    // and each stratum is chosen with a probability growing with the
+    // fraction of its pilot rays that hit an important region. Photons
+    // are weighted by the inverse of that probability so the emitted
+    // power does not change.
+    class LightEmission
+    {
+      public:
+        LightEmission(
+            const Triangle&                 light,
+            const VoxelGridAccelerator&     grid,
+            const ImportanceMap&            importance,
+            RNG&                            rng)
+        {
+            const vec3& va = light.vertice(0);
+            const vec3& vb = light.vertice(1);
+            const vec3& vc = light.vertice(2);
+
+            m_normal = normalize(cross(vb - va, vc - va));
+            make_basis(m_normal, m_tangent, m_bitangent);
+
+            HitRecord rec;
+            float total = 0.0f;
+
+            for (size_t j = 0; j < EMISSION_THETA_STRATA; ++j)
+            {
+                for (size_t k = 0; k < EMISSION_PHI_STRATA; ++k)
+                {
+                    size_t hits = 0;
+
+                    for (size_t i = 0; i < EMISSION_PILOT_RAYS; ++i)
+                    {
+                        const Ray r(
+                            random_point_in_triangle(va, vb, vc, rng),
+                            direction(j, k, rng.next(), rng.next()));
+
+                        if (grid.hit(r, 0.0001f, std::numeric_limits<float>::max(), rec)
+                            && importance.is_important(rec.p))
+                            ++hits;
+                    }
+
+                    Stats::add(StatCounter::PhotonRays, EMISSION_PILOT_RAYS);
+
+                    total += EMISSION_MIN_IMPORTANCE + float(hits) / float(EMISSION_PILOT_RAYS);
+                    m_cdf.push_back(total);
+                }
+            }
+
+            for (size_t i = 0; i < m_cdf.size(); ++i)
+                m_cdf[i] /= total;
+        }
+
+        // Sample a direction and scale the energy of the photon.
+        vec3 sample(RNG& rng, float& energy) const
+        {
+            const size_t strata = m_cdf.size();
+            const size_t index = std::min(
+                static_cast<size_t>(upper_bound(m_cdf.begin(), m_cdf.end(), rng.next()) - m_cdf.begin()),
+                strata - 1);
+
+            const float pdf = m_cdf[index] - (index > 0 ? m_cdf[index - 1] : 0.0f);
+            energy /= float(strata) * pdf;
+
+            return direction(
+                index / EMISSION_PHI_STRATA, index % EMISSION_PHI_STRATA, rng.next(), rng.next());
+        }
+
+      private:
+        vec3            m_normal;
+        vec3            m_tangent;
+        vec3            m_bitangent;
+        vector<float>   m_cdf;
+
+        // Direction of stratum (j, k) jittered by (u, v).
+        vec3 direction(const size_t j, const size_t k, const float u, const float v) const
+        {
+            const float cos_theta = 1.0f - (j + u) / float(EMISSION_THETA_STRATA);
+            const float sin_theta = sqrt(std::max(0.0f, 1.0f - cos_theta * cos_theta));
+            const float phi = 2.0f * COUCOUS_M_PI * (k + v) / float(EMISSION_PHI_STRATA);
+
+            return (m_tangent * cos(phi) + m_bitangent * sin(phi)) * sin_theta + m_normal * cos_theta;
+        }
+    };
+
+    // Distinct materials of the world, in order of first appearance.
+    vector<const Material*> world_materials(const MeshGroup& world)
+    {
+        vector<const Material*> materials;
+
+        for (const auto& mesh : world)
+        {
+            const Material* mat = mesh->mat().get();
+
+            if (find(materials.begin(), materials.end(), mat) == materials.end())
+                materials.push_back(mat);
+        }
+
+        return materials;
+    }
+
+    // 64 bits FNV-1a hash.
+    void hash_bytes(uint64_t& hash, const void* data, const size_t size)
+    {
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+
+        for (size_t i = 0; i < size; ++i)
+        {
+            hash ^= bytes[i];
+            hash *= 1099511628211ull;
+        }
+    }
+
+    template <typename T>
+    void hash_value(uint64_t& hash, const T& value)
+    {
+        hash_bytes(hash, &value, sizeof(T));
+    }
+
+    // Number of nodes in the left subtree of a
+    // left-balanced (complete) binary tree of count nodes.
+    size_t left_subtree_size(const size_t count)
+    {
+        if (count <= 1)
+            return 0;
+
+        // Nodes of the largest perfect tree that fits.
+        size_t full = 1;
+        while (2 * full + 1 <= count)
+            full = 2 * full + 1;
+
+        // The last level is filled from the left.
+        const size_t last_level = count - full;
+        const size_t left_last_level = std::min(last_level, (full + 1) / 2);
+
+        return (full - 1) / 2 + left_last_level;
+    }
+
+    // Bounding box of the photons of [begin, end).
+    AABB photons_bbox(
+        const vector<Photon>&   photons,
+        const size_t*           begin,
+        const size_t*           end)
+    {
+        AABB bbox(photons[*begin].pos());
+        for (const size_t* it = begin + 1; it != end; ++it)
+            bbox.add_point(photons[*it].pos());
+
+        return bbox;
+    }
+
+    // Bounding box of the photons of [begin, end), computed
+    // by chunks on several threads for large ranges.
+    AABB parallel_photons_bbox(
+        const vector<Photon>&   photons,
+        const size_t*           begin,
+        const size_t*           end)
+    {
+        const size_t count = static_cast<size_t>(end - begin);
+        const size_t chunks_count = std::min(
+            static_cast<size_t>(std::max(QThread::idealThreadCount(), 1)),
+            count / PARALLEL_BALANCE_MIN_PHOTONS);
+
+        if (chunks_count <= 1)
+            return photons_bbox(photons, begin, end);
+
+        vector<AABB> bboxes(chunks_count);
+        vector<QFuture<void>> threads;
+        const size_t chunk_size = count / chunks_count;
+
+        for (size_t i = 0; i < chunks_count; ++i)
+        {
+            const size_t* chunk_begin = begin + i * chunk_size;
+            const size_t* chunk_end = (i + 1 == chunks_count) ? end : chunk_begin + chunk_size;
+
+            threads.push_back(QtConcurrent::run(
+                [&photons, &bboxes, i, chunk_begin, chunk_end]()
+                {
+                    bboxes[i] = photons_bbox(photons, chunk_begin, chunk_end);
+                }));
+        }
+
+        for (size_t i = 0; i < threads.size(); ++i)
+        {
+            threads.at(i).waitForFinished();
+        }
+
+        AABB bbox = bboxes[0];
+        for (size_t i = 1; i < bboxes.size(); ++i)
+            bbox += bboxes[i];
+
+        return bbox;
+    }
+
+    // Place the photons of [begin, end) in the heap, under the given node.
+    //
+    // The two subtrees of a node are independent: they read disjoint
+    // ranges of indices and write disjoint nodes of the heap, so the left
+    // one is balanced on another thread while this one balances the right.
+    void balance_photons(
+        const vector<Photon>&   photons,
+        size_t*                 begin,
+        size_t*                 end,
+        const size_t            node,
+        vector<Photon>&         heap)
+    {
+        const size_t count = static_cast<size_t>(end - begin);
+
+        if (count == 0)
+            return;
+
+#ifdef FORCE_SINGLE_THREAD
+        const bool parallel = false;
+#else
+        const bool parallel = count >= PARALLEL_BALANCE_MIN_PHOTONS;
+#endif
+
+        // Split along the largest extent of the photons.
+        const AABB bbox = parallel
+            ? parallel_photons_bbox(photons, begin, end)
+            : photons_bbox(photons, begin, end);
+
+        const size_t axis = bbox.max_extent();
+
+        // The median is chosen so that the tree stays left-balanced.
+        size_t* median = begin + left_subtree_size(count);
+        nth_element(begin, median, end,
+            [&](const size_t lhs, const size_t rhs)
+            {
+                return photons[lhs].position[axis] < photons[rhs].position[axis];
+            });
+
+        heap[node] = photons[*median];
+        heap[node].set_axis(axis);
+
+        if (parallel)
+        {
+            QFuture<void> left = QtConcurrent::run(
+                [&photons, begin, median, node, &heap]()
+                {
+                    balance_photons(photons, begin, median, 2 * node + 1, heap);
+                });
+
+            balance_photons(photons, median + 1, end, 2 * node + 2, heap);
+
+            // If no worker picked the left subtree yet, it runs here.
+            left.waitForFinished();
+        }
+        else
+        {
+            balance_photons(photons, begin, median, 2 * node + 1, heap);
+            balance_photons(photons, median + 1, end, 2 * node + 2, heap);
+        }
+    }
 }
 
 
@@ -46,16 +475,37 @@ namespace
 // Photon implementation.
 //
 
+Photon::Photon()
+  : energy(0.0f)
+  , m_theta(0)
+  , m_phi(0)
+  , m_flags(0)
+{
+    position[0] = position[1] = position[2] = 0.0f;
+}
+
 Photon::Photon(
     const vec3&     position,
     const vec3&     inDirection,
     const float     energy,
-    const Material* mat)
-  : position(position)
-  , inDirection(inDirection)
-  , energy(energy)
-  , mat(mat)
+    const size_t    material)
+  : energy(energy)
+  , m_flags(static_cast<uint16_t>(material & PHOTON_MATERIAL_MASK))
 {
+    assert(material <= PHOTON_MATERIAL_MASK);
+
+    this->position[0] = position.x;
+    this->position[1] = position.y;
+    this->position[2] = position.z;
+
+    // Quantize the direction in spherical coordinates.
+    const vec3 dir = normalize(inDirection);
+    const float theta = acos(clamp(dir.z, -1.0f, 1.0f));
+    const float phi = atan2(dir.y, dir.x);
+
+    m_theta = static_cast<uint8_t>(std::min(255.0f, theta * (256.0f / COUCOUS_M_PI)));
+    m_phi = static_cast<uint8_t>(
+        std::min(255.0f, (phi + COUCOUS_M_PI) * (256.0f / (2.0f * COUCOUS_M_PI))));
 }
 
 float Photon::compute_energy(
@@ -65,24 +515,51 @@ float Photon::compute_energy(
     return inEnergy * fr;
 }
 
+vec3 Photon::pos() const
+{
+    return vec3(position[0], position[1], position[2]);
+}
 
-//
-// PhotonMap class implementation.
-//
+vec3 Photon::direction() const
+{
+    const float theta = (m_theta + 0.5f) * (COUCOUS_M_PI / 256.0f);
+    const float phi = (m_phi + 0.5f) * (2.0f * COUCOUS_M_PI / 256.0f) - COUCOUS_M_PI;
 
-PhotonMap::PhotonMap()
-  : alpha(0.6f)
+    return vec3(
+        sin(theta) * cos(phi),
+        sin(theta) * sin(phi),
+        cos(theta));
+}
+
+size_t Photon::material() const
 {
+    return m_flags & PHOTON_MATERIAL_MASK;
 }
 
-PhotonMap::~PhotonMap()
+size_t Photon::axis() const
 {
-    for (auto it = map.begin(); it != map.end(); ++it)
-    {
-        delete (*it);
-    }
+    return m_flags >> PHOTON_AXIS_SHIFT;
+}
+
+void Photon::set_axis(const size_t axis)
+{
+    assert(axis < 3);
+    m_flags = static_cast<uint16_t>(
+        (m_flags & PHOTON_MATERIAL_MASK) | (axis << PHOTON_AXIS_SHIFT));
+}
+
+static_assert(sizeof(Photon) == 20, "photons are expected to be packed in 20 bytes");
+
+
+//
+// PhotonMap class implementation.
+//
 
-    map.clear();
+PhotonMap::PhotonMap()
+  : m_importance(nullptr)
+  , m_balanced(false)
+  , alpha(0.6f)
+{
 }
 
 void PhotonMap::trace_photon_ray(
@@ -95,6 +572,8 @@ void PhotonMap::trace_photon_ray(
 {
     HitRecord rec;
 
+    Stats::add(StatCounter::PhotonRays);
+
     if(grid.hit(r, 0.0001f, std::numeric_limits<float>::max(), rec))
     {
         const vec3 reflection = reflect(r.dir, rec.normal);
@@ -107,8 +586,17 @@ void PhotonMap::trace_photon_ray(
 
         float hitPointEnergy = Photon::compute_energy(inEnergy, rec.mat->brdf());
 
-        Photon* photon = new Photon(rec.p, r.origin, hitPointEnergy, rec.mat);
-        add_photon(photon);
+        // Photons landing where nothing is looked up are thinned out,
+        // the ones that are kept carry the energy of the others.
+        if (m_importance && !m_importance->is_important(rec.p))
+        {
+            if (rng.next() < IMPORTANCE_THINNING)
+                add_photon(rec.p, r.dir, hitPointEnergy / IMPORTANCE_THINNING, rec.mat);
+        }
+        else
+        {
+            add_photon(rec.p, r.dir, hitPointEnergy, rec.mat);
+        }
 
         // Russian roulette here to know if we stop ourselves or not
         hitPointEnergy = russian_roulette(alpha, hitPointEnergy, rng);
@@ -121,10 +609,66 @@ void PhotonMap::trace_photon_ray(
     }
 }
 
-void PhotonMap::add_photon(const Photon* photon)
+void PhotonMap::trace_caustic_ray(
+    const Ray&                      r,
+    const size_t                    ray_max_depth,
+    const VoxelGridAccelerator&     grid,
+    const float                     inEnergy,
+    RNG&                            rng,
+    const size_t                    depth)
+{
+    HitRecord rec;
+
+    Stats::add(StatCounter::PhotonRays);
+
+    if (!grid.hit(r, 0.0001f, std::numeric_limits<float>::max(), rec) || rec.mat->light)
+        return;
+
+    // The path ends on the first diffuse surface, it is
+    // only a caustic if it bounced on a metallic one before.
+    if (!rec.mat->metallic)
+    {
+        if (depth > 0)
+            add_photon(rec.p, r.dir, inEnergy, rec.mat);
+
+        return;
+    }
+
+    if (depth >= ray_max_depth)
+        return;
+
+    const vec3 reflection = reflect(r.dir, rec.normal);
+    const Ray scattered(rec.p, rec.mat->roughness
+            ? random_in_cone(reflection, rec.mat->roughness, rng)
+            : reflection);
+
+    // Check validity.
+    if (dot(scattered.dir, rec.normal) <= 0.0f)
+        return;
+
+    trace_caustic_ray(
+        scattered, ray_max_depth, grid, Photon::compute_energy(inEnergy, rec.mat->brdf()), rng, depth + 1);
+}
+
+void PhotonMap::add_photon(
+    const vec3&                     position,
+    const vec3&                     inDirection,
+    const float                     energy,
+    const Material*                 mat)
 {
     mapMutex.lock();
-    map.push_back(photon);
+
+    // Scenes only have a handful of materials.
+    size_t material = 0;
+    while (material < m_materials.size() && m_materials[material] != mat)
+        ++material;
+
+    if (material == m_materials.size())
+        m_materials.push_back(mat);
+
+    map.emplace_back(position, inDirection, energy, material);
+    m_balanced = false;
+
     mapMutex.unlock();
 }
 
@@ -133,7 +677,8 @@ void PhotonMap::compute_map(
     const size_t                    ray_max_depth,
     const VoxelGridAccelerator&     grid,
     const MeshGroup&                lights,
-    RNG&                            rng)
+    RNG&                            rng,
+    const ImportanceMap*            importance)
 {
     if(lights.size() == 0)
     {
@@ -148,6 +693,16 @@ void PhotonMap::compute_map(
 
     Logger::log_debug("pm rays per light: " + to_string(nbRaysPerLight) + ".");
 
+    m_importance = importance;
+
+    // Emission of each light over its hemisphere.
+    vector<LightEmission> emissions;
+    if (importance)
+    {
+        for (auto it = lights.begin(); it != lights.end(); ++it)
+            emissions.push_back(LightEmission(**it, grid, *importance, rng));
+    }
+
     // Job for computing a photon path
     auto compute =
     [&](
@@ -161,33 +716,43 @@ void PhotonMap::compute_map(
     std::vector<QFuture<void>> threads;
 
     // Compute all rays for each light.
-    for(auto it = lights.begin(); it != lights.end(); ++it)
+    for(size_t l = 0; l < lights.size(); ++l)
     {
-        const auto& currentLight = *it;
+        const auto& currentLight = lights[l];
         const float energyForOneRay = currentLight->mat()->light_power / float(nbRaysPerLight);
 
+        const vec3& va = currentLight->vertice(0);
+        const vec3& vb = currentLight->vertice(1);
+        const vec3& vc = currentLight->vertice(2);
+
         for(size_t i = 0; i < nbRaysPerLight; ++i)
         {
-            // Create a ray starting from the current light
-            // and going in a random direction.
-            vec3 rayDir = random_in_unit_sphere(rng);
+            vec3 rayDir;
+            float rayEnergy = energyForOneRay;
 
-            const vec3& va = currentLight->vertice(0);
-            const vec3& vb = currentLight->vertice(1);
-            const vec3& vc = currentLight->vertice(2);
-
-            // Make it point in the correct direction.
-            if(dot(rayDir, cross(vc - va, vb - va)) > 0.0f)
+            if (importance)
+            {
+                rayDir = emissions[l].sample(rng, rayEnergy);
+            }
+            else
             {
-                rayDir = -rayDir;
+                // Create a ray starting from the current light
+                // and going in a random direction.
+                rayDir = random_in_unit_sphere(rng);
+
+                // Make it point in the correct direction.
+                if(dot(rayDir, cross(vc - va, vb - va)) > 0.0f)
+                {
+                    rayDir = -rayDir;
+                }
             }
 
             const Ray r(random_point_in_triangle(va, vb, vc, rng), rayDir);
 
 #ifdef FORCE_SINGLE_THREAD
-            trace_photon_ray(r, ray_max_depth, grid, energyForOneRay, rng);
+            trace_photon_ray(r, ray_max_depth, grid, rayEnergy, rng);
 #else
-            QFuture<void> future = QtConcurrent::run(compute, r, energyForOneRay);
+            QFuture<void> future = QtConcurrent::run(compute, r, rayEnergy);
             threads.push_back(future);
 #endif
         }
@@ -199,12 +764,16 @@ void PhotonMap::compute_map(
         threads.at(i).waitForFinished();
     }
 
+    m_importance = nullptr;
+
     const int pm_elapsed = timer.elapsed();
 
     const QString message =
         QString("generated ")
         + QString::number(map.size())
-        +  QString(" photons in ")
+        +  QString(" photons from ")
+        + QString::number(nbRaysPerLight * lights.size())
+        +  QString(" rays in ")
         + ((pm_elapsed > 1000)
             ? (QString::number(pm_elapsed / 1000) + "s.")
             : (QString::number(pm_elapsed % 1000) + "ms."));
@@ -212,10 +781,278 @@ void PhotonMap::compute_map(
     Logger::log_info(message.toStdString().c_str());
 }
 
+void PhotonMap::compute_caustic_map(
+    const size_t                    samples,
+    const size_t                    ray_max_depth,
+    const VoxelGridAccelerator&     grid,
+    const MeshGroup&                lights,
+    const MeshGroup&                metallic,
+    RNG&                            rng)
+{
+    if (lights.empty() || metallic.empty())
+        return;
+
+    QTime timer;
+    timer.start();
+
+    // Bounding sphere of the metallic objects.
+    AABB bbox(metallic[0]->vertice(0));
+    for (const auto& mesh : metallic)
+    {
+        for (size_t i = 0; i < 3; ++i)
+            bbox.add_point(mesh->vertice(i));
+    }
+
+    const vec3 center = (bbox.min + bbox.max) * 0.5f;
+    const float radius = length(bbox.max - bbox.min) * 0.5f;
+
+    const size_t nbRaysPerLight = samples / lights.size();
+
+    // Job for computing a photon path
+    auto compute =
+    [&](
+        const Ray&                      r,
+        const float                     inEnergy
+       )
+    {
+        this->trace_caustic_ray(r, ray_max_depth, grid, inEnergy, rng);
+    };
+
+    std::vector<QFuture<void>> threads;
+
+    for (auto it = lights.begin(); it != lights.end(); ++it)
+    {
+        const auto& currentLight = *it;
+
+        const vec3& va = currentLight->vertice(0);
+        const vec3& vb = currentLight->vertice(1);
+        const vec3& vc = currentLight->vertice(2);
+        const vec3 light_normal = normalize(cross(vb - va, vc - va));
+
+        // Cone from the light toward the bounding sphere.
+        // Lights inside the sphere emit in the whole hemisphere.
+        const vec3 to_center = center - (va + vb + vc) / 3.0f;
+        const float center_distance = length(to_center);
+        const bool inside = center_distance <= radius;
+        const vec3 axis = inside ? light_normal : to_center / center_distance;
+        const float cos_max = inside
+            ? 0.0f
+            : sqrt(std::max(0.0f, 1.0f - (radius * radius) / (center_distance * center_distance)));
+
+        // Lights emit uniformly in their hemisphere: a photon
+        // in the cone carries the power of its solid angle.
+        const float energyForOneRay =
+            currentLight->mat()->light_power * (1.0f - cos_max) / float(nbRaysPerLight);
+
+        for (size_t i = 0; i < nbRaysPerLight; ++i)
+        {
+            const vec3 rayDir = random_in_solid_cone(axis, cos_max, rng);
+
+            // The light does not emit backward.
+            if (dot(rayDir, light_normal) <= 0.0f)
+                continue;
+
+            const Ray r(random_point_in_triangle(va, vb, vc, rng), rayDir);
+
+#ifdef FORCE_SINGLE_THREAD
+            trace_caustic_ray(r, ray_max_depth, grid, energyForOneRay, rng);
+#else
+            QFuture<void> future = QtConcurrent::run(compute, r, energyForOneRay);
+            threads.push_back(future);
+#endif
+        }
+    }
+
+    // Waiting for tracing to end.
+    for (size_t i = 0; i < threads.size(); ++i)
+    {
+        threads.at(i).waitForFinished();
+    }
+
+    const int elapsed = timer.elapsed();
+
+    const QString message =
+        QString("generated ")
+        + QString::number(map.size())
+        + QString(" caustic photons in ")
+        + ((elapsed > 1000)
+            ? (QString::number(elapsed / 1000) + "s.")
+            : (QString::number(elapsed % 1000) + "ms."));
+
+    Logger::log_info(message.toStdString().c_str());
+}
+
+uint64_t PhotonMap::scene_key(
+    const MeshGroup&                world,
+    const size_t                    samples,
+    const size_t                    ray_max_depth,
+    const bool                      caustics)
+{
+    uint64_t hash = 14695981039346656037ull;
+
+    hash_value(hash, uint64_t(samples));
+    hash_value(hash, uint64_t(ray_max_depth));
+    hash_value(hash, uint8_t(caustics));
+
+    const vector<const Material*> materials = world_materials(world);
+
+    for (const Material* mat : materials)
+    {
+        hash_value(hash, mat->albedo);
+        hash_value(hash, mat->light_power);
+        hash_value(hash, mat->kd);
+        hash_value(hash, mat->ks);
+        hash_value(hash, mat->specularExponent);
+        hash_value(hash, mat->metal);
+        hash_value(hash, mat->roughness);
+    }
+
+    for (const auto& mesh : world)
+    {
+        for (size_t i = 0; i < 3; ++i)
+            hash_value(hash, mesh->vertice(i));
+
+        const size_t material = find(materials.begin(), materials.end(), mesh->mat().get()) - materials.begin();
+        hash_value(hash, uint32_t(material));
+    }
+
+    return hash;
+}
+
+bool PhotonMap::save(
+    const string&                   filename,
+    const uint64_t                  key,
+    const MeshGroup&                world) const
+{
+    ofstream file(filename, ios::binary | ios::trunc);
+
+    if (!file.is_open())
+    {
+        Logger::log_warning("could not write the photon map file " + filename + ".");
+        return false;
+    }
+
+    const vector<const Material*> materials = world_materials(world);
+
+    file.write(PHOTON_FILE_MAGIC, 4);
+    file.write(reinterpret_cast<const char*>(&key), sizeof(key));
+    file.write(reinterpret_cast<const char*>(&m_balanced), sizeof(m_balanced));
+
+    // Materials of the map, as indices in the materials of the world.
+    const uint32_t materials_count = static_cast<uint32_t>(m_materials.size());
+    file.write(reinterpret_cast<const char*>(&materials_count), sizeof(materials_count));
+
+    for (const Material* mat : m_materials)
+    {
+        const uint32_t index = static_cast<uint32_t>(
+            find(materials.begin(), materials.end(), mat) - materials.begin());
+        file.write(reinterpret_cast<const char*>(&index), sizeof(index));
+    }
+
+    const uint64_t photons_count = map.size();
+    file.write(reinterpret_cast<const char*>(&photons_count), sizeof(photons_count));
+    file.write(reinterpret_cast<const char*>(map.data()), map.size() * sizeof(Photon));
+
+    if (!file)
+    {
+        Logger::log_warning("could not write the photon map file " + filename + ".");
+        return false;
+    }
+
+    Logger::log_debug("saved " + to_string(map.size()) + " photons to " + filename + ".");
+
+    return true;
+}
+
+bool PhotonMap::load(
+    const string&                   filename,
+    const uint64_t                  key,
+    const MeshGroup&                world)
+{
+    ifstream file(filename, ios::binary);
+
+    if (!file.is_open())
+        return false;
+
+    char magic[4];
+    uint64_t file_key;
+    bool balanced;
+    uint32_t materials_count;
+
+    file.read(magic, 4);
+    file.read(reinterpret_cast<char*>(&file_key), sizeof(file_key));
+    file.read(reinterpret_cast<char*>(&balanced), sizeof(balanced));
+    file.read(reinterpret_cast<char*>(&materials_count), sizeof(materials_count));
+
+    if (!file || memcmp(magic, PHOTON_FILE_MAGIC, 4) != 0 || file_key != key)
+        return false;
+
+    const vector<const Material*> materials = world_materials(world);
+    vector<const Material*> map_materials(materials_count);
+
+    for (uint32_t i = 0; i < materials_count; ++i)
+    {
+        uint32_t index;
+        file.read(reinterpret_cast<char*>(&index), sizeof(index));
+
+        if (!file || index >= materials.size())
+            return false;
+
+        map_materials[i] = materials[index];
+    }
+
+    uint64_t photons_count;
+    file.read(reinterpret_cast<char*>(&photons_count), sizeof(photons_count));
+
+    if (!file)
+        return false;
+
+    // The photons must fill the rest of the file, so that
+    // a corrupted count does not allocate a huge map.
+    const streampos photons_begin = file.tellg();
+    file.seekg(0, ios::end);
+    const streamoff photons_bytes = file.tellg() - photons_begin;
+    file.seekg(photons_begin);
+
+    if (!file || photons_bytes < 0 || photons_count != uint64_t(photons_bytes) / sizeof(Photon))
+        return false;
+
+    vector<Photon> photons(photons_count);
+    file.read(reinterpret_cast<char*>(photons.data()), photons_count * sizeof(Photon));
+
+    if (!file)
+        return false;
+
+    for (const Photon& photon : photons)
+    {
+        if (photon.material() >= materials_count)
+            return false;
+    }
+
+    map.swap(photons);
+    m_materials.swap(map_materials);
+    m_balanced = balanced;
+
+    Logger::log_info("loaded " + to_string(map.size()) + " photons from " + filename + ".");
+
+    return true;
+}
+
+size_t PhotonMap::size() const
+{
+    return map.size();
+}
+
 const Photon& PhotonMap::photon(const size_t index) const
 {
     assert(index < map.size());
-    return *map[index];
+    return map[index];
+}
+
+const Material& PhotonMap::material(const Photon& photon) const
+{
+    assert(photon.material() < m_materials.size());
+    return *m_materials[photon.material()];
 }
 
 
@@ -223,15 +1060,26 @@ const Photon& PhotonMap::photon(const size_t index) const
 // PhotonTree class implementation.
 //
 
-PhotonTree::PhotonTree(const PhotonMap& map)
+PhotonTree::PhotonTree(PhotonMap& map)
   : map(map)
-  , m_index(3, map, nanoflann::KDTreeSingleIndexAdaptorParams(10)) // leaf max size
+  , m_irradiance_step(0)
 {
+    // Photons loaded from a file may already be in kd-tree order.
+    if (map.m_balanced)
+        return;
+
     QTime timer;
     timer.start();
 
     // Build the kd-tree.
-    m_index.buildIndex();
+    vector<size_t> indices(map.map.size());
+    for (size_t i = 0; i < indices.size(); ++i)
+        indices[i] = i;
+
+    vector<Photon> heap(map.map.size());
+    balance_photons(map.map, indices.data(), indices.data() + indices.size(), 0, heap);
+    map.map.swap(heap);
+    map.m_balanced = true;
 
     const int kd_elapsed = timer.elapsed();
 
@@ -242,15 +1090,164 @@ PhotonTree::PhotonTree(const PhotonMap& map)
             : (QString::number(kd_elapsed % 1000) + "ms."));
 
     Logger::log_info(message.toStdString().c_str());
+    Logger::log_debug(
+        "photon map size: " + to_string(map.map.size() * sizeof(Photon) / 1024) + " KiB.");
+}
+
+size_t PhotonTree::find_nearest(
+    const vec3&                     point,
+    const size_t                    count,
+    const float                     max_squared_dist,
+    vector<pair<size_t, float>>&    results) const
+{
+    const size_t found = search_nearest(point, count, max_squared_dist, results);
+
+    Stats::add(StatCounter::PhotonLookups);
+    Stats::add(StatCounter::PhotonsFound, found);
+
+    return found;
 }
 
-size_t PhotonTree::find_in_radius(
+size_t PhotonTree::search_nearest(
     const vec3&                     point,
-    const float                     radius,
+    const size_t                    count,
+    const float                     max_squared_dist,
     vector<pair<size_t, float>>&    results) const
 {
-    static nanoflann::SearchParams search_params(32, 0.0f, true); // true means we want photons to be sorted by dist
+    NearestPhotons nearest(count, max_squared_dist, results);
+
+    if (count > 0 && !map.map.empty())
+        locate_photons(map.map, 0, point, nearest);
 
-    return m_index.radiusSearch(glm::value_ptr(point), radius, results, search_params);
+    return nearest.size();
 }
 
+void PhotonTree::precompute_irradiance(
+    const size_t                    step,
+    const size_t                    count,
+    const float                     max_squared_dist)
+{
+    assert(step > 0);
+
+    QTime timer;
+    timer.start();
+
+    const size_t estimates_count = (map.map.size() + step - 1) / step;
+
+    m_irradiance_step = step;
+    m_irradiance_color.assign(estimates_count, vec3(0.0f));
+    m_irradiance_weight.assign(estimates_count, 0.0f);
+    m_irradiance_photons.assign(estimates_count, 0);
+
+    // Job computing the estimates of [begin, end).
+    auto compute =
+    [&](
+        const size_t                begin,
+        const size_t                end)
+    {
+        vector<pair<size_t, float>> photons;
+        photons.reserve(count);
+
+        // The estimates are not render lookups: they are left out of the statistics.
+        for (size_t i = begin; i < end; ++i)
+        {
+            const size_t found = search_nearest(
+                map.map[i * step].pos(), count, max_squared_dist, photons);
+
+            if (found == 0)
+                continue;
+
+            // The farthest photon is on top of the heap.
+            const float coef = 1.0f / (COUCOUS_M_PI * sqrt(photons[0].second));
+
+            vec3 color(0.0f);
+            float weight = 0.0f;
+
+            for (size_t p = 0; p < found; ++p)
+            {
+                const Photon& photon = map.map[photons[p].first];
+
+                weight += photon.energy;
+                color += (map.material(photon).albedo * photon.energy) * coef;
+            }
+
+            m_irradiance_color[i] = color;
+            m_irradiance_weight[i] = weight;
+            m_irradiance_photons[i] = static_cast<uint32_t>(found);
+        }
+    };
+
+#ifdef FORCE_SINGLE_THREAD
+    compute(0, estimates_count);
+#else
+    std::vector<QFuture<void>> threads;
+
+    for (size_t begin = 0; begin < estimates_count; begin += IRRADIANCE_ESTIMATES_PER_JOB)
+    {
+        const size_t end = std::min(begin + IRRADIANCE_ESTIMATES_PER_JOB, estimates_count);
+        threads.push_back(QtConcurrent::run(compute, begin, end));
+    }
+
+    for (size_t i = 0; i < threads.size(); ++i)
+    {
+        threads.at(i).waitForFinished();
+    }
+#endif
+
+    const int elapsed = timer.elapsed();
+
+    const QString message =
+        QString("precomputed irradiance at ")
+        + QString::number(estimates_count)
+        + QString(" photons in ")
+        + ((elapsed > 1000)
+            ? (QString::number(elapsed / 1000) + "s.")
+            : (QString::number(elapsed % 1000) + "ms."));
+
+    Logger::log_info(message.toStdString().c_str());
+}
+
+bool PhotonTree::has_irradiance() const
+{
+    return m_irradiance_step > 0;
+}
+
+bool PhotonTree::find_irradiance(
+    const vec3&                     point,
+    const vec3&                     normal,
+    const float                     max_squared_dist,
+    vec3&                           color,
+    float&                          weight) const
+{
+    assert(has_irradiance());
+
+    const vector<Photon>& photons = map.map;
+    const size_t step = m_irradiance_step;
+
+    // Only photons holding an estimate and lit from
+    // the same side of the surface are candidates.
+    auto accept = [&photons, &normal, step](const size_t index)
+    {
+        return index % step == 0 && dot(photons[index].direction(), normal) < 0.0f;
+    };
+
+    if (photons.empty())
+        return false;
+
+    size_t nearest = photons.size();
+    float nearest_dist = max_squared_dist;
+    locate_nearest_photon(photons, 0, point, accept, nearest, nearest_dist);
+
+    // A lookup finds the photons of the estimate it fetches.
+    Stats::add(StatCounter::PhotonLookups);
+
+    if (nearest == photons.size())
+        return false;
+
+    color = m_irradiance_color[nearest / step];
+    weight = m_irradiance_weight[nearest / step];
+
+    Stats::add(StatCounter::PhotonsFound, m_irradiance_photons[nearest / step]);
+
+    return true;
+}
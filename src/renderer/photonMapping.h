@@ -12,37 +12,61 @@
 
 // glm includes.
 #include <glm/glm.hpp>
-#include <glm/gtc/type_ptr.hpp>
-
-// nanoflann inclues.
-#include <nanoflann/nanoflann.hpp>
 
 // Standard library includes
-#include <map>
-#include <random>
+#include <cstdint>
+#include <string>
 #include <utility>
 #include <vector>
 
 // Forward declarations.
+class ImportanceMap;
 class RNG;
 
+//
+// A photon packed in 20 bytes, so that large maps
+// stay in contiguous and cache friendly memory:
+//  - position:     3 floats.
+//  - energy:       1 float. Photons only carry a scalar power,
+//                  their color comes from the material they hit.
+//  - direction:    incoming direction quantized in spherical
+//                  coordinates, 1 byte per angle.
+//  - flags:        material index in the photon map (14 bits)
+//                  and kd-tree split axis (2 bits).
+//
+
 class Photon
 {
   public:
+    Photon();
+
     Photon(
         const glm::vec3&    position,
         const glm::vec3&    inDirection,
         const float         energy,
-        const Material*     mat);
+        const size_t        material);
 
     static float compute_energy(
         const float inEnergy,
         const float fr);
 
-    const glm::vec3     position;
-    const glm::vec3     inDirection;
-    const float         energy;
-    const Material*     mat;
+    glm::vec3 pos() const;
+
+    // Decode the incoming direction.
+    glm::vec3 direction() const;
+
+    size_t material() const;
+
+    size_t axis() const;
+    void set_axis(const size_t axis);
+
+    float               position[3];
+    float               energy;
+
+  private:
+    std::uint8_t        m_theta;
+    std::uint8_t        m_phi;
+    std::uint16_t       m_flags;
 };
 
 
@@ -52,36 +76,74 @@ class Photon
 
 class PhotonMap
 {
+    friend class PhotonTree;
+
   public:
     PhotonMap();
-    ~PhotonMap();
-
-    inline size_t kdtree_get_point_count() const {
-        return map.size();
-    }
-
-    inline float kdtree_get_pt(const size_t idx, int dim) const
-    {
-        if(dim == 0)
-            return map[idx]->position.x;
-        else if(dim == 1)
-            return map[idx]->position.y;
-        else
-            return map[idx]->position.z;
-    }
-
-    template<class BBOX>
-    bool kdtree_get_bbox(BBOX&) const { return false; }
 
+    // Emit samples photons from the lights, shared evenly between them.
+    // With an importance map, lights emit more toward the important
+    // directions and photons stored in unimportant regions are thinned
+    // out: the emission budget is the same, fewer photons are stored.
     void compute_map(
         const size_t                    samples,
         const size_t                    ray_max_depth,
         const VoxelGridAccelerator&     grid,
         const MeshGroup&                lights,
+        RNG&                            rng,
+        const ImportanceMap*            importance = nullptr);
+
+    // Only store photons that reached a diffuse surface after bouncing
+    // on metallic ones (LS+D paths). Photons are emitted toward the
+    // bounding sphere of the metallic objects instead of the whole
+    // hemisphere, so few of them are wasted on diffuse surfaces.
+    void compute_caustic_map(
+        const size_t                    samples,
+        const size_t                    ray_max_depth,
+        const VoxelGridAccelerator&     grid,
+        const MeshGroup&                lights,
+        const MeshGroup&                metallic,
         RNG&                            rng);
 
+    // Key of the photon maps of a world: a hash of its geometry,
+    // its materials and the photon tracing settings. Photons thinned by
+    // an importance map are reweighted, so the key ignores the views:
+    // a map traced for some views stays unbiased for the others.
+    static std::uint64_t scene_key(
+        const MeshGroup&                world,
+        const size_t                    samples,
+        const size_t                    ray_max_depth,
+        const bool                      caustics = false);
+
+    // Save the photons to a compact binary file. Balanced photons are
+    // saved in kd-tree order, so loading them needs no rebuild. Materials
+    // are saved as indices in the distinct materials of the world.
+    bool save(
+        const std::string&              filename,
+        const std::uint64_t             key,
+        const MeshGroup&                world) const;
+
+    // Load photons saved with the same key.
+    // Returns false if the file does not match.
+    bool load(
+        const std::string&              filename,
+        const std::uint64_t             key,
+        const MeshGroup&                world);
+
+    // Store a photon, and the material it hit. Thread safe.
+    void add_photon(
+        const glm::vec3&                position,
+        const glm::vec3&                inDirection,
+        const float                     energy,
+        const Material*                 mat);
+
+    size_t size() const;
+
     const Photon& photon(const size_t index) const;
 
+    // Material hit by the given photon.
+    const Material& material(const Photon& photon) const;
+
   private:
     void trace_photon_ray(
         const Ray&                      r,
@@ -91,42 +153,85 @@ class PhotonMap
         RNG&                            rng,
         const size_t                    depth = 0);
 
-    void add_photon(const Photon* photon);
+    void trace_caustic_ray(
+        const Ray&                      r,
+        const size_t                    ray_max_depth,
+        const VoxelGridAccelerator&     grid,
+        const float                     inEnergy,
+        RNG&                            rng,
+        const size_t                    depth = 0);
 
-    std::vector<const Photon*>                map;
+    std::vector<Photon>                       map;
+    std::vector<const Material*>              m_materials;
+    const ImportanceMap*                      m_importance;
+    bool                                      m_balanced;
     QMutex                                    mapMutex;
     float                                     alpha;
 };
 
 
 //
-// Kd-tree structure for a PhotonMap
+// Left-balanced kd-tree over a PhotonMap.
+//
+// The tree is stored in place in the photon map: once balanced,
+// photons are laid out as a binary heap (children of photon i are
+// 2i + 1 and 2i + 2) and each photon keeps its split axis, so the
+// tree needs no extra memory and lookups walk a contiguous array.
 //
 
 class PhotonTree
 {
-  private:
-    typedef nanoflann::KDTreeSingleIndexAdaptor<
-        nanoflann::L2_Simple_Adaptor<float, PhotonMap>,
-        PhotonMap,
-        3,
-        size_t> PhotonTreeIndex;
-
   public:
     // The kd-tree is built when the constructor is called.
-    PhotonTree(const PhotonMap& map);
+    // It reorders the photons of the map, unless they were
+    // loaded already balanced.
+    PhotonTree(PhotonMap& map);
 
     const PhotonMap& map;
 
-    size_t find_in_radius(
+    // Find the count nearest photons whose squared distance to the point
+    // is below max_squared_dist. Results are kept in a bounded max-heap
+    // on the squared distance: nothing is sorted and at most count photons
+    // are ever stored. results[0] is the farthest photon found.
+    size_t find_nearest(
         const glm::vec3&                        point,
-        const float                             radius,
+        const size_t                            count,
+        const float                             max_squared_dist,
         std::vector<std::pair<size_t, float>>&  results) const;
 
+    // Precompute the photon density estimate at one photon out of step,
+    // from its count nearest photons within max_squared_dist (Christensen).
+    // Estimates are computed in parallel and stored as a color sum and a
+    // weight, the sum of the energies of the photons used.
+    void precompute_irradiance(
+        const size_t                            step,
+        const size_t                            count,
+        const float                             max_squared_dist);
+
+    bool has_irradiance() const;
+
+    // Fetch the precomputed estimate of the nearest photon arriving on the
+    // side of the surface the normal points to. Returns false if there is
+    // none within max_squared_dist.
+    bool find_irradiance(
+        const glm::vec3&                        point,
+        const glm::vec3&                        normal,
+        const float                             max_squared_dist,
+        glm::vec3&                              color,
+        float&                                  weight) const;
+
   private:
-    // Nanoflann used to search in the kd-tree.
-    PhotonTreeIndex m_index;
+    size_t                                      m_irradiance_step;
+    std::vector<glm::vec3>                      m_irradiance_color;
+    std::vector<float>                          m_irradiance_weight;
+    std::vector<std::uint32_t>                  m_irradiance_photons; // used by each estimate
+
+    // find_nearest without counting the lookup in the statistics.
+    size_t search_nearest(
+        const glm::vec3&                        point,
+        const size_t                            count,
+        const float                             max_squared_dist,
+        std::vector<std::pair<size_t, float>>&  results) const;
 };
 
 #endif
-
@@ -0,0 +1,280 @@
+// Interface.
+#include "renderer/progressivephotonmap.h"
+
+// couscous includes.
+#include "common/logger.h"
+#include "renderer/camera.h"
+#include "renderer/gridaccelerator.h"
+#include "renderer/material.h"
+#include "renderer/photonMapping.h"
+#include "renderer/rng.h"
+#include "renderer/stats.h"
+#include "renderer/utility.h"
+
+// Qt includes.
+#include <QFuture>
+#ifdef _MSC_VER
+#include <QtConcurrent/QtConcurrentRun>
+#else
+#include <QtConcurrentRun>
+#endif
+
+// Standard includes.
+#include <algorithm>
+#include <functional>
+#include <limits>
+
+using namespace glm;
+using namespace std;
+
+#define COUCOUS_M_PI 3.1416f
+#define COUCOUS_M_INV_PI 1.0f / 3.1416f
+
+// Fraction of the new photons kept at each iteration.
+// Lower values shrink the radius faster.
+#define SPPM_ALPHA 0.7f
+
+// Maximum number of photons gathered by a visible point per iteration.
+// When it is reached, the radius shrinks to the farthest gathered photon.
+#define SPPM_MAX_PHOTONS 256
+
+// Bounces on metallic surfaces before a visible point is dropped.
+#define SPPM_MAX_DEPTH 8
+
+// Rows of pixels processed by a job.
+#define SPPM_ROWS_PER_JOB 16
+
+//
+// ProgressivePhotonMap class implementation.
+//
+
+ProgressivePhotonMap::ProgressivePhotonMap(
+    const RenderSettings&           settings,
+    const float                     initial_radius)
+  : m_settings(settings)
+  , m_iterations(0)
+{
+    Pixel pixel;
+    pixel.emitted = vec3(0.0f);
+    pixel.flux = vec3(0.0f);
+    pixel.squared_radius = initial_radius * initial_radius;
+    pixel.photons = 0.0f;
+
+    m_pixels.assign(settings.width * settings.height, pixel);
+    m_points.resize(settings.width * settings.height);
+}
+
+void ProgressivePhotonMap::iterate(
+    const Camera&                   camera,
+    const VoxelGridAccelerator&     grid,
+    const MeshGroup&                lights,
+    RNG&                            rng)
+{
+    const size_t height = m_settings.height;
+
+    // Run a job per band of rows.
+    auto run_jobs = [&](const std::function<void (size_t, size_t)>& job)
+    {
+        vector<QFuture<void>> threads;
+
+        for (size_t y = 0; y < height; y += SPPM_ROWS_PER_JOB)
+        {
+            const size_t y2 = std::min(y + SPPM_ROWS_PER_JOB, height);
+
+            if (m_settings.parallel)
+                threads.push_back(QtConcurrent::run(job, y, y2));
+            else
+                job(y, y2);
+        }
+
+        for (size_t i = 0; i < threads.size(); ++i)
+        {
+            threads.at(i).waitForFinished();
+        }
+    };
+
+    // Find the visible points of this iteration.
+    run_jobs([&](const size_t y1, const size_t y2)
+    {
+        trace_camera_rays(camera, grid, rng, y1, y2);
+    });
+
+    // Trace a photon pass, it only lives for this iteration.
+    {
+        PhotonMap pmap;
+        pmap.compute_map(m_settings.photons_count, 32, grid, lights, rng);
+
+        PhotonTree ptree(pmap);
+
+        run_jobs([&](const size_t y1, const size_t y2)
+        {
+            gather_photons(ptree, y1, y2);
+        });
+    }
+
+    ++m_iterations;
+
+    Logger::log_debug("progressive photon mapping iteration " + to_string(m_iterations) + " done.");
+}
+
+size_t ProgressivePhotonMap::iterations() const
+{
+    return m_iterations;
+}
+
+vec3 ProgressivePhotonMap::radiance(
+    const size_t                    x,
+    const size_t                    y) const
+{
+    if (m_iterations == 0)
+        return vec3(0.0f);
+
+    const Pixel& pixel = m_pixels[y * m_settings.width + x];
+    const float iterations = static_cast<float>(m_iterations);
+
+    // Photon energies are normalized per pass,
+    // so each pass carries the whole light power.
+    const vec3 reflected = pixel.flux / (COUCOUS_M_PI * pixel.squared_radius * iterations);
+
+    return pixel.emitted / iterations + reflected;
+}
+
+void ProgressivePhotonMap::trace_camera_rays(
+    const Camera&                   camera,
+    const VoxelGridAccelerator&     grid,
+    RNG&                            rng,
+    const size_t                    y1,
+    const size_t                    y2)
+{
+    const size_t width = m_settings.width;
+    const size_t height = m_settings.height;
+
+    for (size_t y = y1; y < y2; ++y)
+    {
+        for (size_t x = 0; x < width; ++x)
+        {
+            // In Qt, y is going from top to bottom.
+            const vec2 uv(
+                (x + rng.next()) / static_cast<float>(width),
+                (height - y - 1 + rng.next()) / static_cast<float>(height));
+
+            const size_t index = y * width + x;
+
+            trace_visible_point(
+                camera.get_ray(uv.x, uv.y), grid, rng, m_pixels[index], m_points[index]);
+        }
+    }
+}
+
+void ProgressivePhotonMap::trace_visible_point(
+    const Ray&                      r,
+    const VoxelGridAccelerator&     grid,
+    RNG&                            rng,
+    Pixel&                          pixel,
+    VisiblePoint&                   point) const
+{
+    point.valid = false;
+
+    Ray ray = r;
+    HitRecord rec;
+
+    Stats::add(StatCounter::CameraRays);
+
+    for (size_t depth = 0; depth < SPPM_MAX_DEPTH; ++depth)
+    {
+        if (!grid.hit(ray, 0.0001f, numeric_limits<float>::max(), rec))
+            return;
+
+        // Display lights only by showing the emissive value.
+        if (rec.mat->light)
+        {
+            pixel.emitted += min(rec.mat->emission, vec3(1.0f));
+            return;
+        }
+
+        // Follow metallic reflections until a diffuse surface is found.
+        if (rec.mat->metallic)
+        {
+            const vec3 scattered = reflect(ray.dir, rec.normal);
+            ray = Ray(rec.p, rec.mat->roughness
+                ? random_in_cone(scattered, rec.mat->roughness, rng)
+                : scattered);
+
+            // Check validity.
+            if (dot(ray.dir, rec.normal) <= 0.0f)
+                return;
+
+            continue;
+        }
+
+        point.position = rec.p;
+        point.normal = rec.normal;
+        point.brdf = rec.mat->albedo * rec.mat->kd * COUCOUS_M_INV_PI;
+        point.valid = true;
+        return;
+    }
+}
+
+void ProgressivePhotonMap::gather_photons(
+    const PhotonTree&               ptree,
+    const size_t                    y1,
+    const size_t                    y2)
+{
+    const size_t width = m_settings.width;
+
+    // Scratch buffers are owned by the worker thread.
+    thread_local ShadingScratch scratch;
+
+    for (size_t i = y1 * width; i < y2 * width; ++i)
+    {
+        const VisiblePoint& point = m_points[i];
+
+        if (!point.valid)
+            continue;
+
+        Pixel& pixel = m_pixels[i];
+
+        const size_t found = ptree.find_nearest(
+            point.position, SPPM_MAX_PHOTONS, pixel.squared_radius, scratch.photons);
+
+        // The gather was truncated: shrink the disc to the gathered
+        // photons and scale the statistics of the previous iterations.
+        if (found == SPPM_MAX_PHOTONS && scratch.photons[0].second > 0.0f)
+        {
+            const float shrink = scratch.photons[0].second / pixel.squared_radius;
+
+            pixel.squared_radius *= shrink;
+            pixel.flux *= shrink;
+            pixel.photons *= shrink;
+        }
+
+        // Only photons arriving on the visible side of the surface count.
+        vec3 flux(0.0f);
+        float photons = 0.0f;
+
+        for (size_t p = 0; p < found; ++p)
+        {
+            const Photon& photon = ptree.map.photon(scratch.photons[p].first);
+
+            if (dot(photon.direction(), point.normal) >= 0.0f)
+                continue;
+
+            flux += ptree.map.material(photon).albedo * photon.energy;
+            photons += 1.0f;
+        }
+
+        scratch.reset();
+
+        if (photons == 0.0f)
+            continue;
+
+        // Keep a fraction of the new photons and shrink
+        // the radius so that the density is preserved.
+        const float kept_photons = pixel.photons + SPPM_ALPHA * photons;
+        const float ratio = kept_photons / (pixel.photons + photons);
+
+        pixel.squared_radius *= ratio;
+        pixel.flux = (pixel.flux + point.brdf * flux) * ratio;
+        pixel.photons = kept_photons;
+    }
+}
@@ -0,0 +1,96 @@
+#ifndef RENDERER_PROGRESSIVEPHOTONMAP_H
+#define RENDERER_PROGRESSIVEPHOTONMAP_H
+
+// couscous includes.
+#include "renderer/integrator.h"
+#include "renderer/visualobject.h"
+
+// glm includes.
+#include <glm/glm.hpp>
+
+// Standard includes.
+#include <cstddef>
+#include <vector>
+
+// Forward declarations.
+class Camera;
+class RNG;
+class VoxelGridAccelerator;
+
+//
+// Stochastic progressive photon mapping.
+//
+// Each iteration traces one jittered camera ray per pixel to find a
+// visible point, then traces a photon pass whose photons are gathered
+// around the visible points and discarded right away. Only per-pixel
+// statistics are kept between iterations: the gather radius of each
+// pixel shrinks as photons accumulate, so the estimate converges while
+// the memory used by photons stays bounded by one pass.
+//
+
+class ProgressivePhotonMap
+{
+  public:
+    ProgressivePhotonMap(
+        const RenderSettings&           settings,
+        const float                     initial_radius);
+
+    // Trace one camera pass and one photon pass.
+    void iterate(
+        const Camera&                   camera,
+        const VoxelGridAccelerator&     grid,
+        const MeshGroup&                lights,
+        RNG&                            rng);
+
+    size_t iterations() const;
+
+    // Current estimate of the given pixel.
+    glm::vec3 radiance(
+        const size_t                    x,
+        const size_t                    y) const;
+
+  private:
+    // Statistics of a pixel, kept across iterations.
+    struct Pixel
+    {
+        glm::vec3   emitted;
+        glm::vec3   flux;
+        float       squared_radius;
+        float       photons;
+    };
+
+    // Diffuse surface seen through a pixel during an iteration.
+    struct VisiblePoint
+    {
+        glm::vec3   position;
+        glm::vec3   normal;
+        glm::vec3   brdf;
+        bool        valid;
+    };
+
+    void trace_camera_rays(
+        const Camera&                   camera,
+        const VoxelGridAccelerator&     grid,
+        RNG&                            rng,
+        const size_t                    y1,
+        const size_t                    y2);
+
+    void trace_visible_point(
+        const Ray&                      r,
+        const VoxelGridAccelerator&     grid,
+        RNG&                            rng,
+        Pixel&                          pixel,
+        VisiblePoint&                   point) const;
+
+    void gather_photons(
+        const PhotonTree&               ptree,
+        const size_t                    y1,
+        const size_t                    y2);
+
+    const RenderSettings&       m_settings;
+    std::vector<Pixel>          m_pixels;
+    std::vector<VisiblePoint>   m_points;
+    size_t                      m_iterations;
+};
+
+#endif // RENDERER_PROGRESSIVEPHOTONMAP_H
@@ -0,0 +1,76 @@
+#ifndef RENDERER_RAYPACKET_H
+#define RENDERER_RAYPACKET_H
+
+// couscous includes.
+#include "renderer/ray.h"
+
+// glm includes.
+#include <glm/glm.hpp>
+
+// Standard includes.
+#include <cassert>
+#include <cstddef>
+#include <limits>
+
+// Forward declarations.
+class Triangle;
+
+// Maximum number of rays of a packet: a block of 4 * 4 pixels.
+#define RAY_PACKET_SIZE 16
+
+//
+// Packets of coherent rays.
+//
+// Rays are stored by coordinate, so that the loops testing a shape
+// against all the rays of a packet can be vectorized by the compiler.
+//
+
+struct RayPacket
+{
+    float       origin[3][RAY_PACKET_SIZE];
+    float       dir[3][RAY_PACKET_SIZE];
+    size_t      size = 0;
+
+    void add(const Ray& r)
+    {
+        assert(size < RAY_PACKET_SIZE);
+
+        for (size_t a = 0; a < 3; ++a)
+        {
+            origin[a][size] = r.origin[a];
+            dir[a][size] = r.dir[a];
+        }
+
+        ++size;
+    }
+
+    Ray ray(const size_t i) const
+    {
+        return Ray(
+            glm::vec3(origin[0][i], origin[1][i], origin[2][i]),
+            glm::vec3(dir[0][i], dir[1][i], dir[2][i]));
+    }
+};
+
+// Closest triangle hit by each ray of a packet, without its attributes.
+// The triangle is null for the rays hitting nothing.
+struct PacketHits
+{
+    float               t[RAY_PACKET_SIZE];
+    float               u[RAY_PACKET_SIZE];
+    float               v[RAY_PACKET_SIZE];
+    const Triangle*     triangle[RAY_PACKET_SIZE];
+
+    PacketHits(const float tmax = std::numeric_limits<float>::max())
+    {
+        for (size_t i = 0; i < RAY_PACKET_SIZE; ++i)
+        {
+            t[i] = tmax;
+            u[i] = 0.0f;
+            v[i] = 0.0f;
+            triangle[i] = nullptr;
+        }
+    }
+};
+
+#endif // RENDERER_RAYPACKET_H
@@ -3,14 +3,20 @@
 
 // couscous includes.
 #include "renderer/gridaccelerator.h"
+#include "renderer/importancemap.h"
+#include "renderer/irradiancecache.h"
 #include "renderer/material.h"
 #include "renderer/samplegenerator.h"
 #include "renderer/utility.h"
 #include "renderer/visualobject.h"
 #include "renderer/photonMapping.h"
+#include "renderer/progressivephotonmap.h"
+#include "renderer/raypacket.h"
 #include "renderer/rng.h"
+#include "renderer/stats.h"
 #include "renderer/utility.h"
 #include "common/logger.h"
+#include "common/tracer.h"
 
 // Math includes.
 #include <glm/glm.hpp>
@@ -22,13 +28,19 @@
 #else
 #include <QtConcurrentRun>
 #endif
+#include <QDir>
 #include <QTime>
 
 // Standard includes.
 #include <algorithm>
+#include <chrono>
 #include <cmath>
+#include <cstdint>
 #include <limits>
+#include <memory>
+#include <string>
 #include <utility>
+#include <vector>
 
 using namespace glm;
 using namespace std;
@@ -39,20 +51,111 @@ using namespace std;
 #define COUCOUS_M_INV_PI 1.0f / 3.1416f
 #define MAX_PHOTONS_COUNT 100
 
+// Maximum number of bounces of photon paths.
+#define PHOTONS_MAX_DEPTH 32
+
+// Final gathering uses an irradiance estimate precomputed
+// at one photon out of IRRADIANCE_PHOTON_STEP.
+#define IRRADIANCE_PHOTON_STEP 4
+
+// Irradiance cache records use this many times
+// more rays than a direct final gather.
+#define IRRADIANCE_CACHE_RAYS_SCALE 16
+
+// Ward's error bound of the irradiance cache.
+#define IRRADIANCE_CACHE_ERROR 0.3f
+
+// The irradiance cache is seeded at one pixel out of
+// IRRADIANCE_CACHE_SEED_STEP along each axis before rendering.
+#define IRRADIANCE_CACHE_SEED_STEP 8
+
+// Caustics are estimated from at most CAUSTIC_PHOTONS_COUNT photons
+// in a radius of CAUSTIC_RADIUS_SCALE voxels.
+#define CAUSTIC_PHOTONS_COUNT 64
+#define CAUSTIC_RADIUS_SCALE 0.25f
+
+// The importance pass traces one camera ray every IMPORTANCE_PIXELS_STEP
+// pixels along each axis, and at most IMPORTANCE_GATHER_RAYS final
+// gather rays from each of their hits.
+#define IMPORTANCE_PIXELS_STEP 4
+#define IMPORTANCE_GATHER_RAYS 4
+
+// Camera rays of blocks of PACKET_BLOCK_SIZE * PACKET_BLOCK_SIZE
+// pixels are traced as a packet.
+#define PACKET_BLOCK_SIZE 4
+
 namespace
 {
+    // File of the saved photon map with the given key.
+    string photon_map_filename(const uint64_t key)
+    {
+        const QString directory = QDir::currentPath() + "/photons";
+        QDir().mkpath(directory);
+
+        return (directory + "/" + QString::number(qulonglong(key), 16) + ".cpm").toStdString();
+    }
+
+    // Log the counters of the render, as a summary and as JSON.
+    void log_stats()
+    {
+        const RenderStats stats = Stats::collect();
+
+        Logger::log_info("render statistics: " + stats.to_string());
+        Logger::log_info("render statistics json: " + stats.to_json());
+    }
+
+    // False color of a heat in [0, 1], from blue to red.
+    QRgb heat_color(const float heat)
+    {
+        static const vec3 ramp[5] =
+        {
+            vec3(0.0f, 0.0f, 1.0f),
+            vec3(0.0f, 1.0f, 1.0f),
+            vec3(0.0f, 1.0f, 0.0f),
+            vec3(1.0f, 1.0f, 0.0f),
+            vec3(1.0f, 0.0f, 0.0f)
+        };
+
+        const float x = std::min(std::max(heat, 0.0f), 1.0f) * 4.0f;
+        const size_t i = std::min(static_cast<size_t>(x), size_t(3));
+        const vec3 color = mix(ramp[i], ramp[i + 1], x - static_cast<float>(i));
+
+        return qRgb(
+            static_cast<int>(255.0f * color[0]),
+            static_cast<int>(255.0f * color[1]),
+            static_cast<int>(255.0f * color[2]));
+    }
+
     bool is_vec3_nan(const vec3& lhs)
     {
         return lhs.x != lhs.x || lhs.y != lhs.y || lhs.z != lhs.z;
     }
 
+    // Shading functions take the closest hit of their ray when it was
+    // already traced, as camera rays are traced by packets, or null.
+    // A given record without material is a miss.
+    bool closest_hit(
+        const Ray&                      r,
+        const HitRecord*                camera_hit,
+        const VoxelGridAccelerator&     grid,
+        HitRecord&                      rec)
+    {
+        if (camera_hit == nullptr)
+            return grid.hit(r, 0.0001f, numeric_limits<float>::max(), rec);
+
+        rec = *camera_hit;
+
+        return rec.mat != nullptr;
+    }
+
     vec3 get_albedo(
         const Ray&                      r,
+        const HitRecord*                camera_hit,
         const VoxelGridAccelerator&     grid)
     {
         HitRecord rec;
 
-        if(grid.hit(r, 0.0001f, numeric_limits<float>::max(), rec))
+        if(closest_hit(r, camera_hit, grid, rec))
             return rec.mat->albedo;
         else
             return vec3(0.0f);
@@ -60,11 +163,12 @@ namespace
 
     vec3 get_normal(
         const Ray&                      r,
+        const HitRecord*                camera_hit,
         const VoxelGridAccelerator&     grid)
     {
         HitRecord rec;
 
-        if(grid.hit(r, 0.0001f, numeric_limits<float>::max(), rec))
+        if(closest_hit(r, camera_hit, grid, rec))
             return 0.5f * vec3(rec.normal.x + 1.0f, rec.normal.y + 1.0f, rec.normal.z + 1.0f);
         else
             return vec3(0.0f);
@@ -72,6 +176,7 @@ namespace
 
     vec3 get_ray_photon_map(
         const Ray&                                      r,
+        const HitRecord*                                camera_hit,
         const VoxelGridAccelerator&                     grid,
         const PhotonTree&                               ptree,
         vector<pair<size_t, float>>&                    photons_find_result)
@@ -80,21 +185,20 @@ namespace
 
         HitRecord rec;
 
-        if(grid.hit(r, 0.0001f, numeric_limits<float>::max(), rec))
+        if(closest_hit(r, camera_hit, grid, rec))
         {
             if (rec.mat->light)
                 return vec3(0.0f);
 
-            photons_find_result.clear();
-            size_t photons_count = ptree.find_in_radius(rec.p, radius, photons_find_result);
+            // We don't take all photons into acount.
+            const size_t photons_count = ptree.find_nearest(
+                rec.p, MAX_PHOTONS_COUNT, radius, photons_find_result);
 
             if (photons_count == 0)
                 return vec3(0.0f);
 
-            // We don't take all photons into acount.
-            photons_count = photons_count > MAX_PHOTONS_COUNT ? MAX_PHOTONS_COUNT : photons_count;
-
-            const float max_dist = sqrt(photons_find_result[photons_count - 1].second);
+            // The farthest photon is on top of the heap.
+            const float max_dist = sqrt(photons_find_result[0].second);
 
             float weight = 0.0f;
             vec3 color(0.0f);
@@ -107,7 +211,7 @@ namespace
                 const float pweight = photon.energy;
 
                 weight += pweight;
-                color += (photon.mat->albedo * pweight) / (3.14f * max_dist);
+                color += (ptree.map.material(photon).albedo * pweight) / (3.14f * max_dist);
             }
 
             return (color / weight);
@@ -118,8 +222,55 @@ namespace
         }
     }
 
+    // Accumulate the photons seen by a final gather ray.
+    // The precomputed estimate of the nearest photon is used when there is
+    // one, otherwise the density is estimated from the nearest photons.
+    void gather_photons(
+        const PhotonTree&                               ptree,
+        const HitRecord&                                rec,
+        const float                                     radius,
+        vector<pair<size_t, float>>&                    photons_find_result,
+        vec3&                                           color,
+        float&                                          weight)
+    {
+        if (ptree.has_irradiance())
+        {
+            vec3 irradiance_color;
+            float irradiance_weight;
+
+            if (ptree.find_irradiance(rec.p, rec.normal, radius, irradiance_color, irradiance_weight))
+            {
+                color += irradiance_color;
+                weight += irradiance_weight;
+            }
+
+            return;
+        }
+
+        // We don't take all photons into acount.
+        const size_t photons_count = ptree.find_nearest(
+            rec.p, MAX_PHOTONS_COUNT, radius, photons_find_result);
+
+        if (photons_count == 0)
+            return;
+
+        // The farthest photon is on top of the heap.
+        const float max_dist = sqrt(photons_find_result[0].second);
+        const float coef = 1.0f / (COUCOUS_M_PI * max_dist);
+
+        for (size_t i = 0; i < photons_count; ++i)
+        {
+            const size_t index = photons_find_result[i].first;
+            const auto& photon = ptree.map.photon(index);
+
+            weight += photon.energy;
+            color += (ptree.map.material(photon).albedo * photon.energy) * coef;
+        }
+    }
+
     vec3 get_direct_diffuse(
         const Ray&                                      r,
+        const HitRecord*                                camera_hit,
         const size_t                                    directLightRaysCount,
         const VoxelGridAccelerator&                     grid,
         const MeshGroup&                                lights,
@@ -127,17 +278,18 @@ namespace
     {
         HitRecord rec;
 
-        if (grid.hit(r, 0.0001f, numeric_limits<float>::max(), rec))
+        if (closest_hit(r, camera_hit, grid, rec))
         {
             // Display lights only by showing the emissive value.
             if(rec.mat->light)
                 return min(rec.mat->emission, vec3(1.0f));
 
             HitRecord directLightRec;
-            vector<vec3> lightPoints;
             const Material* mat = rec.mat;
             vec3 diffuse(0.0f);
 
+            Stats::add(StatCounter::ShadowRays, lights.size() * directLightRaysCount);
+
             // We cast n rau per lights.
             for (size_t l = 0; l < lights.size(); ++l)
             {
@@ -175,6 +327,7 @@ namespace
 
     vec3 get_direct_specular(
         const Ray&                                      r,
+        const HitRecord*                                camera_hit,
         const size_t                                    directLightRaysCount,
         const VoxelGridAccelerator&                     grid,
         const MeshGroup&                                lights,
@@ -182,7 +335,7 @@ namespace
     {
         HitRecord rec;
 
-        if (grid.hit(r, 0.0001f, numeric_limits<float>::max(), rec))
+        if (closest_hit(r, camera_hit, grid, rec))
         {
             // Display lights only by showing the emissive value.
             if(rec.mat->light)
@@ -194,6 +347,8 @@ namespace
             const vec3 V = -r.dir;
             vec3 specular(0.0f);
 
+            Stats::add(StatCounter::ShadowRays, lights.size() * directLightRaysCount);
+
             // We cast n rau per lights.
             for (size_t l = 0; l < lights.size(); ++l)
             {
@@ -232,6 +387,7 @@ namespace
 
     vec3 get_direct_phong(
         const Ray&                                      r,
+        const HitRecord*                                camera_hit,
         const size_t                                    directLightRaysCount,
         const VoxelGridAccelerator&                     grid,
         const MeshGroup&                                lights,
@@ -240,7 +396,7 @@ namespace
     {
         HitRecord rec;
 
-        if (grid.hit(r, 0.0001f, numeric_limits<float>::max(), rec))
+        if (closest_hit(r, camera_hit, grid, rec))
         {
             // Display lights only by showing the emissive value.
             if(rec.mat->light)
@@ -261,7 +417,7 @@ namespace
                 if (dot(reflected.dir, rec.normal) <= 0.0f)
                     return vec3(0.0f);
 
-                return get_direct_phong(reflected, directLightRaysCount, grid, lights, rng, max_depth - 1);
+                return get_direct_phong(reflected, nullptr, directLightRaysCount, grid, lights, rng, max_depth - 1);
             }
 
             HitRecord directLightRec;
@@ -270,6 +426,8 @@ namespace
             const vec3 V = -r.dir;
             const float ray_count = static_cast<float>(lights.size() * directLightRaysCount);
 
+            Stats::add(StatCounter::ShadowRays, lights.size() * directLightRaysCount);
+
             // We cast n rays per lights.
             for (size_t l = 0; l < lights.size(); ++l)
             {
@@ -315,6 +473,7 @@ namespace
 
     vec3 get_indirect_light(
         const Ray&                                      r,
+        const HitRecord*                                camera_hit,
         const size_t                                    indirectLightRaysCount,
         const VoxelGridAccelerator&                     grid,
         const PhotonTree&                               ptree,
@@ -323,7 +482,7 @@ namespace
     {
         HitRecord rec;
 
-        if (grid.hit(r, 0.0001f, numeric_limits<float>::max(), rec))
+        if (closest_hit(r, camera_hit, grid, rec))
         {
             // Display lights only by showing the emissive value.
             if(rec.mat->light)
@@ -339,6 +498,8 @@ namespace
             size_t nbSuccessfullRays = 0;
             float photons_weight = 0.0f;
 
+            Stats::add(StatCounter::GatherRays, indirectLightRaysCount);
+
             for(size_t i = 0; i < indirectLightRaysCount; ++i)
             {
                 // Generate random direction.
@@ -350,54 +511,200 @@ namespace
                     && dot(rec.normal, indirect_dir) > 0.0f)
                 {
                     nbSuccessfullRays++;
-                    photons_find_result.clear();
-                    size_t photons_count = ptree.find_in_radius(recIndirect.p, radius, photons_find_result);
+                    gather_photons(
+                        ptree, recIndirect, radius, photons_find_result, indirect, photons_weight);
+                }
+            }
+
+            return indirect / photons_weight;
+        }
+        else
+        {
+            return vec3(0.0f);
+        }
+    }
 
-                    if (photons_count == 0)
-                        continue;
+    // Light focused on a diffuse point by metallic surfaces,
+    // estimated from the caustic photons in a small radius.
+    vec3 get_caustic(
+        const HitRecord&                                rec,
+        const VoxelGridAccelerator&                     grid,
+        const PhotonTree&                               caustic_tree,
+        vector<pair<size_t, float>>&                    photons_find_result)
+    {
+        const float radius = grid.voxel_size() * CAUSTIC_RADIUS_SCALE;
 
-                    // We don't take all photons into acount.
-                    photons_count = photons_count > MAX_PHOTONS_COUNT ? MAX_PHOTONS_COUNT : photons_count;
+        const size_t photons_count = caustic_tree.find_nearest(
+            rec.p, CAUSTIC_PHOTONS_COUNT, radius * radius, photons_find_result);
 
-                    // Photons are ordered.
-                    const float max_dist = sqrt(photons_find_result[photons_count - 1].second);
-                    const float coef = 1.0f / (COUCOUS_M_PI * max_dist);
+        if (photons_count == 0)
+            return vec3(0.0f);
 
-                    vec3 color(0.0f);
+        // When the search is full, the photons cover the
+        // disc of the farthest one instead of the whole radius.
+        const float squared_radius = photons_count == CAUSTIC_PHOTONS_COUNT
+            ? std::max(photons_find_result[0].second, 1.0e-8f)
+            : radius * radius;
 
-                    for (size_t i = 0; i < photons_count; ++i)
-                    {
-                        const size_t index = photons_find_result[i].first;
-                        const auto& photon = ptree.map.photon(index);
+        float energy = 0.0f;
 
-                        photons_weight += photon.energy;
-                        indirect += (photon.mat->albedo * photon.energy) * coef;
-                    }
-                }
+        for (size_t i = 0; i < photons_count; ++i)
+        {
+            const auto& photon = caustic_tree.map.photon(photons_find_result[i].first);
+
+            // Only photons arriving on the visible side of the surface count.
+            if (dot(photon.direction(), rec.normal) < 0.0f)
+                energy += photon.energy;
+        }
+
+        return rec.mat->albedo * rec.mat->kd * COUCOUS_M_INV_PI
+            * (energy / (COUCOUS_M_PI * squared_radius));
+    }
+
+    // Indirect light at a diffuse point, interpolated from the irradiance
+    // cache. A new record is computed when no record is valid there.
+    vec3 get_cached_indirect_light(
+        const HitRecord&                                rec,
+        const size_t                                    indirectLightRaysCount,
+        const VoxelGridAccelerator&                     grid,
+        const PhotonTree&                               ptree,
+        RNG&                                            rng,
+        ShadingScratch&                                 scratch,
+        IrradianceCache&                                irradiance_cache)
+    {
+        vec3 irradiance;
+
+        if (irradiance_cache.lookup(rec.p, rec.normal, irradiance))
+            return irradiance;
+
+        size_t theta_count, phi_count;
+        IrradianceCache::strata(
+            indirectLightRaysCount * IRRADIANCE_CACHE_RAYS_SCALE, theta_count, phi_count);
+
+        // Compute the photons search radius.
+        const float radius = grid.voxel_size() * 1.5f;
+
+        vector<vec3>& radiance = scratch.hemisphere_radiance;
+        vector<float>& distances = scratch.hemisphere_distance;
+        radiance.assign(theta_count * phi_count, vec3(0.0f));
+        distances.assign(theta_count * phi_count, numeric_limits<float>::infinity());
+
+        HitRecord recIndirect;
+        float weight = 0.0f;
+
+        Stats::add(StatCounter::GatherRays, theta_count * phi_count);
+
+        for (size_t j = 0; j < theta_count; ++j)
+        {
+            for (size_t k = 0; k < phi_count; ++k)
+            {
+                const vec3 indirect_dir = IrradianceCache::sample_direction(
+                    rec.normal, theta_count, phi_count, j, k, rng.next(), rng.next());
+
+                if (!grid.hit(Ray(rec.p, indirect_dir), 0.000001f, numeric_limits<float>::max(), recIndirect))
+                    continue;
+
+                const size_t index = j * phi_count + k;
+                distances[index] = std::max(distance(rec.p, recIndirect.p), 0.0001f);
+
+                gather_photons(ptree, recIndirect, radius, scratch.photons, radiance[index], weight);
             }
+        }
 
-            return indirect / photons_weight;
+        // Same estimate as the uncached final gather: the photons colors
+        // over their weights, summed on the samples that hit something.
+        // Samples are scaled so that their mean, stored by the record,
+        // is this estimate, and misses add nothing to it.
+        if (weight > 0.0f)
+        {
+            const float scale = static_cast<float>(radiance.size()) / weight;
+
+            for (vec3& l : radiance)
+                l *= scale;
         }
-        else
+
+        return irradiance_cache.insert(rec.p, rec.normal, theta_count, phi_count, radiance, distances);
+    }
+
+    // Direct light at a diffuse point of the final render.
+    vec3 get_final_direct(
+        const Ray&                                      r,
+        const HitRecord&                                rec,
+        const size_t                                    directLightRaysCount,
+        const VoxelGridAccelerator&                     grid,
+        const MeshGroup&                                lights,
+        RNG&                                            rng)
+    {
+        HitRecord directLightRec;
+        const Material* mat = rec.mat;
+        vec3 specular(0.0f), diffuse(0.0f);
+        const vec3 V = -r.dir;
+        const float ray_count = static_cast<float>(lights.size() * directLightRaysCount);
+
+        Stats::add(StatCounter::ShadowRays, lights.size() * directLightRaysCount);
+
+        // We cast n rays per lights.
+        for (size_t l = 0; l < lights.size(); ++l)
         {
-            return vec3(0.0f);
+            const auto& light = lights[l];
+            const vec3& va = light->vertice(0);
+            const vec3& vb = light->vertice(1);
+            const vec3& vc = light->vertice(2);
+
+            // Compute direct lighting by sending rays to lights.
+            for(size_t i = 0; i < directLightRaysCount; ++i)
+            {
+                const vec3 currentPointOnLight = random_point_in_triangle(va, vb, vc, rng);
+                const vec3 currentLightDir = normalize(currentPointOnLight - rec.p);
+
+                bool answ = grid.hit(Ray(rec.p, currentLightDir), 0.0001f, numeric_limits<float>::max(), directLightRec);
+
+                // Only take into account emissive materials.
+                if (answ && directLightRec.mat->light)
+                {
+                    const Material* light_mat = directLightRec.mat;
+
+                    vec3 R = reflect(-currentLightDir, rec.normal);
+
+                    specular += light_mat->light_power
+                        * pow(std::max(0.0f, dot(R, V)), mat->specularExponent);
+
+                    diffuse += mat->albedo * light_mat->emission *
+                        std::max(0.0f, dot(rec.normal, currentLightDir));
+                }
+            }
         }
+
+        vec3 direct = (
+            diffuse * mat->kd * COUCOUS_M_INV_PI
+            + specular * mat->ks * ((ray_count + 2.0f) * COUCOUS_M_INV_2PI))
+            / ray_count;
+
+        if (is_vec3_nan(direct))
+            direct = vec3(0.0f);
+
+        return direct;
     }
 
     vec3 get_final(
         const Ray&                                      r,
+        const HitRecord*                                camera_hit,
         const size_t                                    directLightRaysCount,
         const size_t                                    indirectLightRaysCount,
         const VoxelGridAccelerator&                     grid,
         const MeshGroup&                                lights,
         const PhotonTree&                               ptree,
+        const PhotonTree*                               caustic_tree,
         RNG&                                            rng,
-        vector<pair<size_t, float>>&                    photons_find_result,
+        ShadingScratch&                                 scratch,
+        IrradianceCache*                                irradiance_cache,
         size_t                                          max_depth = 8)
     {
+        vector<pair<size_t, float>>& photons_find_result = scratch.photons;
+
         HitRecord rec;
 
-        if (grid.hit(r, 0.0001f, numeric_limits<float>::max(), rec))
+        if (closest_hit(r, camera_hit, grid, rec))
         {
             // Display lights only by showing the emissive value.
             if(rec.mat->light)
@@ -418,61 +725,20 @@ namespace
                 if (dot(reflected.dir, rec.normal) <= 0.0f)
                     return vec3(0.0f);
 
-                return get_direct_phong(reflected, directLightRaysCount, grid, lights, rng, max_depth - 1);
+                return get_direct_phong(reflected, nullptr, directLightRaysCount, grid, lights, rng, max_depth - 1);
             }
 
             // Compute direct light.
-            vec3 direct(0.0f);
-            {
-                HitRecord directLightRec;
-                const Material* mat = rec.mat;
-                vec3 specular(0.0f), diffuse(0.0f);
-                const vec3 V = -r.dir;
-                const float ray_count = static_cast<float>(lights.size() * directLightRaysCount);
-
-                // We cast n rays per lights.
-                for (size_t l = 0; l < lights.size(); ++l)
-                {
-                    const auto& light = lights[l];
-                    const vec3& va = light->vertice(0);
-                    const vec3& vb = light->vertice(1);
-                    const vec3& vc = light->vertice(2);
-
-                    // Compute direct lighting by sending rays to lights.
-                    for(size_t i = 0; i < directLightRaysCount; ++i)
-                    {
-                        const vec3 currentPointOnLight = random_point_in_triangle(va, vb, vc, rng);
-                        const vec3 currentLightDir = normalize(currentPointOnLight - rec.p);
-
-                        bool answ = grid.hit(Ray(rec.p, currentLightDir), 0.0001f, numeric_limits<float>::max(), directLightRec);
-
-                        // Only take into account emissive materials.
-                        if (answ && directLightRec.mat->light)
-                        {
-                            const Material* light_mat = directLightRec.mat;
-
-                            vec3 R = reflect(-currentLightDir, rec.normal);
-
-                            specular += light_mat->light_power
-                                * pow(std::max(0.0f, dot(R, V)), mat->specularExponent);
-
-                            diffuse += mat->albedo * light_mat->emission *
-                                std::max(0.0f, dot(rec.normal, currentLightDir));
-                        }
-                    }
-                }
-
-                direct = (
-                    diffuse * mat->kd * COUCOUS_M_INV_PI
-                    + specular * mat->ks * ((ray_count + 2.0f) * COUCOUS_M_INV_2PI))
-                    / ray_count;
-
-                if (is_vec3_nan(direct))
-                    direct = vec3(0.0f);
-            }
+            const vec3 direct = get_final_direct(r, rec, directLightRaysCount, grid, lights, rng);
 
             // Compute indirect light.
             vec3 indirect(0.0f);
+            if (irradiance_cache)
+            {
+                indirect = get_cached_indirect_light(
+                    rec, indirectLightRaysCount, grid, ptree, rng, scratch, *irradiance_cache);
+            }
+            else
             {
                 // Compute the photons search radius.
                 const float radius = grid.voxel_size() * 1.5f;
@@ -482,6 +748,8 @@ namespace
                 size_t nbSuccessfullRays = 0;
                 float photons_weight = 0.0f;
 
+                Stats::add(StatCounter::GatherRays, indirectLightRaysCount);
+
                 for(size_t i = 0; i < indirectLightRaysCount; ++i)
                 {
                     // Generate random direction.
@@ -493,29 +761,8 @@ namespace
                         && dot(rec.normal, indirect_dir) > 0.0f)
                     {
                         nbSuccessfullRays++;
-                        photons_find_result.clear();
-                        size_t photons_count = ptree.find_in_radius(recIndirect.p, radius, photons_find_result);
-
-                        if (photons_count == 0)
-                            continue;
-
-                        // We don't take all photons into acount.
-                        photons_count = photons_count > MAX_PHOTONS_COUNT ? MAX_PHOTONS_COUNT : photons_count;
-
-                        // Photons are ordered.
-                        const float max_dist = sqrt(photons_find_result[photons_count - 1].second);
-                        const float coef = 1.0f / (COUCOUS_M_PI * max_dist);
-
-                        vec3 color(0.0f);
-
-                        for (size_t i = 0; i < photons_count; ++i)
-                        {
-                            const size_t index = photons_find_result[i].first;
-                            const auto& photon = ptree.map.photon(index);
-
-                            photons_weight += photon.energy;
-                            indirect += (photon.mat->albedo * photon.energy) * coef;
-                        }
+                        gather_photons(
+                            ptree, recIndirect, radius, photons_find_result, indirect, photons_weight);
                     }
                 }
 
@@ -525,7 +772,12 @@ namespace
                     indirect = vec3(0.0f);
             }
 
-            return min(direct + indirect, vec3(1.0f));
+            // Compute caustics.
+            vec3 caustic(0.0f);
+            if (caustic_tree)
+                caustic = get_caustic(rec, grid, *caustic_tree, photons_find_result);
+
+            return min(direct + indirect + caustic, vec3(1.0f));
         }
 #if 0
         if (grid.hit(r, 0.0001f, numeric_limits<float>::max(), rec))
@@ -549,14 +801,18 @@ namespace
                 if (dot(reflected.dir, rec.normal) <= 0.0f)
                     return vec3(0.0f);
 
-                return get_final(reflected, directLightRaysCount, indirectLightRaysCount, grid, lights, ptree, rng, photons_find_result, max_depth - 1);
+                return get_final(reflected, directLightRaysCount, indirectLightRaysCount, grid, lights, ptree, caustic_tree, rng, scratch, irradiance_cache, max_depth - 1);
             }
 
             // Compute Phong.
             float directLightIntensity = 0.0f, diffuseComp = 0.0f;
             vec3 diffuse, specular, albedo;
             HitRecord directLightRec;
-            vector<vec3> lightPoints;
+
+            // Only the count and the first visible light point are used,
+            // no need to keep them all.
+            size_t lightPointsCount = 0;
+            vec3 firstLightPoint(0.0f);
 
             vec3 indirectColor = vec3(0.0f);
 
@@ -583,7 +839,8 @@ namespace
                     diffuseComp += std::max(0.0f, dot(rec.normal, currentLightDir));
 
                     // Keep in memory valid lights point directions : valid light point means a visible one
-                    lightPoints.push_back(currentLightDir);
+                    if (lightPointsCount++ == 0)
+                        firstLightPoint = currentLightDir;
                 }
             }
 
@@ -628,25 +885,25 @@ namespace
 
             diffuse = glm::vec3(0.0f);
 
-            if(lightPoints.size() > 0)
+            if(lightPointsCount > 0)
             {
-                diffuse = directLightIntensity * albedo  * (diffuseComp / lightPoints.size());
+                diffuse = directLightIntensity * albedo  * (diffuseComp / lightPointsCount);
             }
 
             // Compute specular part
             specular = glm::vec3(0.0f);
 
-            for(unsigned int i=0; i<lightPoints.size(); i++)
+            for(unsigned int i=0; i<lightPointsCount; i++)
             {
-                glm::vec3 rVec = (2*(glm::dot(glm::normalize(rec.normal), lightPoints[0])) * glm::normalize(rec.normal)) - lightPoints[0];
+                glm::vec3 rVec = (2*(glm::dot(glm::normalize(rec.normal), firstLightPoint)) * glm::normalize(rec.normal)) - firstLightPoint;
                 // Try inverse here
                 //specular += rec.mat->albedo * (directLightIntensity) * std::pow(std::max(0.0f, glm::dot(glm::normalize((r.origin - rec.p)), glm::normalize(rVec))), rec.mat->specularExponent) ;
                 specular += rec.mat->albedo * (directLightIntensity) * std::pow(std::max(0.0f, glm::dot(glm::normalize((r.origin - rec.p)), glm::normalize(rVec))), 2.0f) ;
             }
 
-            if(lightPoints.size()>0)
+            if(lightPointsCount>0)
             {
-                specular = specular / (float)lightPoints.size();
+                specular = specular / (float)lightPointsCount;
             }
 
             // Security check
@@ -660,124 +917,170 @@ namespace
             return vec3(0.0f);
         }
     }
-}
 
-void Render::get_render_image(
-    const size_t                    width,
-    const size_t                    height,
-    const size_t                    spp,
-    const Camera&                   camera,
-    const MeshGroup&                world,
-    const size_t                    direct_light_rays_count,
-    const size_t                    indirect_light_rays_count,
-    const size_t                    photons_count,
-    const bool                      parallel,
-    const bool                      get_normal_color,
-    const bool                      get_albedo_color,
-    const bool                      display_photon_map,
-    const bool                      direct_diffuse,
-    const bool                      direct_specular,
-    const bool                      direct_phong,
-    const bool                      indirect_light,
-    QImage&                         image,
-    QProgressBar&                   progressBar)
-{
-    // Create a random number generator.
-    RNG rng;
+    //
+    // Integrators.
+    //
 
-    // Get lights from the scene.
-    const MeshGroup lights = fetch_lights(world);
-    Logger::log_debug(to_string(lights.size()) + " light triangles");
-    Logger::log_debug(to_string(world.size() - lights.size()) + " triangles in the scene");
+    struct NormalIntegrator
+    {
+        static vec3 li(const Ray& r, ShadingContext& ctx)
+        {
+            return get_normal(r, ctx.camera_hit, ctx.grid);
+        }
+    };
+
+    struct AlbedoIntegrator
+    {
+        static vec3 li(const Ray& r, ShadingContext& ctx)
+        {
+            return get_albedo(r, ctx.camera_hit, ctx.grid);
+        }
+    };
 
-    // Create the grid accelerator.
-    VoxelGridAccelerator grid(world);
+    struct PhotonMapIntegrator
+    {
+        static vec3 li(const Ray& r, ShadingContext& ctx)
+        {
+            return get_ray_photon_map(r, ctx.camera_hit, ctx.grid, ctx.ptree, ctx.scratch.photons);
+        }
+    };
 
-    Logger::log_debug("fetching photons in a radius of " + to_string(grid.voxel_size()));
+    struct DirectDiffuseIntegrator
+    {
+        static vec3 li(const Ray& r, ShadingContext& ctx)
+        {
+            return get_direct_diffuse(
+                r, ctx.camera_hit, ctx.settings.direct_light_rays_count, ctx.grid, ctx.lights, ctx.rng);
+        }
+    };
 
-    // Create photon map.
-    PhotonMap pmap;
-    pmap.compute_map(photons_count, 32, grid, lights, rng);
+    struct DirectSpecularIntegrator
+    {
+        static vec3 li(const Ray& r, ShadingContext& ctx)
+        {
+            return get_direct_specular(
+                r, ctx.camera_hit, ctx.settings.direct_light_rays_count, ctx.grid, ctx.lights, ctx.rng);
+        }
+    };
 
-    // Create photon tree.
-    PhotonTree ptree(pmap);
+    struct DirectPhongIntegrator
+    {
+        static vec3 li(const Ray& r, ShadingContext& ctx)
+        {
+            return get_direct_phong(
+                r, ctx.camera_hit, ctx.settings.direct_light_rays_count, ctx.grid, ctx.lights, ctx.rng);
+        }
+    };
 
-    progressBar.setValue(53);
-    progressBar.setRange(0, int((width/64)*(height/64)));
+    struct IndirectLightIntegrator
+    {
+        static vec3 li(const Ray& r, ShadingContext& ctx)
+        {
+            return get_indirect_light(
+                r, ctx.camera_hit, ctx.settings.indirect_light_rays_count, ctx.grid, ctx.ptree,
+                ctx.rng, ctx.scratch.photons);
+        }
+    };
 
-    // Precompute subpixel samples position
-    const size_t dimension_size = static_cast<size_t>(std::max(1, static_cast<int>(sqrt(spp))));
-    const size_t samples = dimension_size * dimension_size;
+    struct FinalIntegrator
+    {
+        static vec3 li(const Ray& r, ShadingContext& ctx)
+        {
+            return get_final(
+                r, ctx.camera_hit, ctx.settings.direct_light_rays_count, ctx.settings.indirect_light_rays_count,
+                ctx.grid, ctx.lights, ctx.ptree, ctx.caustic_tree, ctx.rng, ctx.scratch,
+                ctx.irradiance_cache);
+        }
+    };
 
-    SampleGenerator generator(dimension_size, rng);
-    size_t x0, x1, x2, y0, y1, y2;
 
-    // Thread handles
-    vector<QFuture<void>> threads;
+    //
+    // Tile rendering.
+    //
 
-    // Job for rendering a given tile.
-    auto compute =
-    [&](
-        size_t x1,
-        size_t x2,
-        size_t y1,
-        size_t y2)
+    // Everything shared by the tiles of a frame.
+    struct FrameContext
+    {
+        const RenderSettings&           settings;
+        const Camera&                   camera;
+        const VoxelGridAccelerator&     grid;
+        const MeshGroup&                lights;
+        const PhotonTree&               ptree;
+        const PhotonTree*               caustic_tree;
+        IrradianceCache*                irradiance_cache;
+        const size_t                    samples;
+        SampleGenerator&                generator;
+        RNG&                            rng;
+        QImage&                         image;
+    };
+
+    // Draw the subpixel positions of the samples of the pixels of a block.
+    // Samples are drawn pixel after pixel, so that each pixel goes through
+    // all the strata.
+    void draw_block_samples(
+        const FrameContext&             frame,
+        const size_t                    block_pixels,
+        vector<vec2>&                   subpixels)
+    {
+        subpixels.resize(block_pixels * frame.samples);
+
+        for (size_t i = 0; i < subpixels.size(); ++i)
+            subpixels[i] = frame.generator.next();
+    }
+
+    // Trace the camera rays of the given sample of the pixels of a block.
+    void trace_block_sample(
+        const FrameContext&             frame,
+        const size_t                    x1,
+        const size_t                    x2,
+        const size_t                    y1,
+        const size_t                    y2,
+        const size_t                    sample,
+        const vector<vec2>&             subpixels,
+        RayPacket&                      packet,
+        HitRecord*                      recs)
     {
-        // Create a unique photon buffer for each thread.
-        vector<pair<size_t, float>> photons_find_result;
+        const vec2 frame_size(frame.settings.width, frame.settings.height);
+
+        packet.size = 0;
 
         for (size_t y = y1; y < y2; ++y)
         {
             for (size_t x = x1; x < x2; ++x)
             {
                 // In Qt, y is going from top to bottom.
-                const vec2 pt(x, height - y - 1);
-                const vec2 frame(width, height);
+                const vec2 pt(x, frame.settings.height - y - 1);
+                const vec2& subpixel_pos = subpixels[packet.size * frame.samples + sample];
+                const vec2 uv(
+                    (pt.x + subpixel_pos.x) / frame_size.x,
+                    (pt.y + subpixel_pos.y) / frame_size.y);
 
-                vec3 color(0.0f, 0.0f, 0.0f);
-                for (size_t i = 0; i < samples; ++i)
-                {
-                    const vec2 subpixel_pos = generator.next();
-                    const vec2 uv(
-                        (pt.x + subpixel_pos.x) / frame.x,
-                        (pt.y + subpixel_pos.y) / frame.y);
-                    const Ray r = camera.get_ray(uv.x, uv.y);
+                packet.add(frame.camera.get_ray(uv.x, uv.y));
+            }
+        }
 
-                    if(get_normal_color)
-                    {
-                        color += get_normal(r, grid);
-                    }
-                    else if(get_albedo_color)
-                    {
-                        color += get_albedo(r, grid);
-                    }
-                    else if (display_photon_map)
-                    {
-                        color += get_ray_photon_map(r, grid, ptree, photons_find_result);
-                    }
-                    else if (direct_diffuse)
-                    {
-                        color += get_direct_diffuse(r, direct_light_rays_count, grid, lights, rng);
-                    }
-                    else if (direct_specular)
-                    {
-                        color += get_direct_specular(r, direct_light_rays_count, grid, lights, rng);
-                    }
-                    else if (direct_phong)
-                    {
-                        color += get_direct_phong(r, direct_light_rays_count, grid, lights, rng);
-                    }
-                    else if (indirect_light)
-                    {
-                        color += get_indirect_light(r, indirect_light_rays_count, grid, ptree, rng, photons_find_result);
-                    }
-                    else
-                    {
-                        color += get_final(r, direct_light_rays_count, indirect_light_rays_count, grid, lights, ptree, rng, photons_find_result);
-                    }
-                }
+        Stats::add(StatCounter::CameraRays, packet.size);
 
-                color /= static_cast<float>(samples);
+        frame.grid.hit_packet(packet, 0.0001f, recs);
+    }
+
+    // Write the summed samples of the pixels of a block to the image.
+    void set_block_pixels(
+        const FrameContext&             frame,
+        const size_t                    x1,
+        const size_t                    x2,
+        const size_t                    y1,
+        const size_t                    y2,
+        const vec3*                     colors)
+    {
+        size_t i = 0;
+
+        for (size_t y = y1; y < y2; ++y)
+        {
+            for (size_t x = x1; x < x2; ++x, ++i)
+            {
+                vec3 color = colors[i] / static_cast<float>(frame.samples);
                 color = vec3(sqrt(color[0]), sqrt(color[1]), sqrt(color[2]));
                 color.x = std::min(color.x, 1.0f);
                 color.y = std::min(color.y, 1.0f);
@@ -788,64 +1091,890 @@ void Render::get_render_image(
                     static_cast<int>(255.0f * color[1]),
                     static_cast<int>(255.0f * color[2]));
 
-                image.setPixel(x, y, rgb_color);
+                frame.image.setPixel(x, y, rgb_color);
             }
         }
-    };
+    }
 
-    // Starts rendering.
-    Logger::log_info("rendering...");
+    // Render the pixels of a tile with the given integrator.
+    template <typename Integrator>
+    void render_tile(
+        const FrameContext&             frame,
+        const size_t                    x1,
+        const size_t                    x2,
+        const size_t                    y1,
+        const size_t                    y2)
+    {
+        // Scratch buffers are owned by the worker thread and
+        // stay allocated across tiles and renders.
+        thread_local ShadingScratch scratch;
+        thread_local vector<vec2> subpixels;
+
+        ShadingContext ctx = {
+            frame.settings,
+            frame.grid,
+            frame.lights,
+            frame.ptree,
+            frame.caustic_tree,
+            frame.rng,
+            scratch,
+            frame.irradiance_cache,
+            nullptr
+        };
+
+        RayPacket packet;
+        HitRecord camera_recs[RAY_PACKET_SIZE];
+        vec3 colors[RAY_PACKET_SIZE];
+
+        for (size_t by = y1; by < y2; by += PACKET_BLOCK_SIZE)
+        {
+            for (size_t bx = x1; bx < x2; bx += PACKET_BLOCK_SIZE)
+            {
+                const size_t bx2 = std::min(bx + PACKET_BLOCK_SIZE, x2);
+                const size_t by2 = std::min(by + PACKET_BLOCK_SIZE, y2);
 
-    QTime render_timer;
-    render_timer.start();
-    progressBar.setVisible(true);
+                draw_block_samples(frame, (bx2 - bx) * (by2 - by), subpixels);
+
+                for (size_t i = 0; i < RAY_PACKET_SIZE; ++i)
+                    colors[i] = vec3(0.0f);
+
+                for (size_t s = 0; s < frame.samples; ++s)
+                {
+                    trace_block_sample(frame, bx, bx2, by, by2, s, subpixels, packet, camera_recs);
+
+                    for (size_t i = 0; i < packet.size; ++i)
+                    {
+                        ctx.camera_hit = &camera_recs[i];
+                        colors[i] += Integrator::li(packet.ray(i), ctx);
+                        scratch.reset();
+                    }
+                }
+
+                ctx.camera_hit = nullptr;
+
+                set_block_pixels(frame, bx, bx2, by, by2, colors);
+            }
+        }
+    }
+
+    // Final gather rays of the diffuse points of a block.
+    struct GatherStream
+    {
+        // A diffuse point seen by a camera ray: its pixel in the block,
+        // its direct and caustic light, and the light it gathers.
+        struct Point
+        {
+            size_t      pixel;
+            vec3        normal;
+            vec3        light;
+            vec3        indirect;
+            float       weight;
+        };
+
+        vector<Point>       points;
+        vector<Ray>         rays;
+        vector<uint32_t>    ray_points;
+        vector<HitRecord>   recs;
+
+        // Photon lookups by cell of the hit point, then by ray.
+        vector<pair<uint64_t, uint32_t>> order;
+    };
+
+    // Cell of a point in a lattice of the given cell size,
+    // packed in 21 bits per axis, z being the most significant.
+    uint64_t lookup_cell(
+        const vec3&                     p,
+        const float                     inv_cell_size)
+    {
+        const uint64_t mask = (uint64_t(1) << 21) - 1;
+
+        return (uint64_t(int64_t(floor(p.x * inv_cell_size))) & mask)
+            | ((uint64_t(int64_t(floor(p.y * inv_cell_size))) & mask) << 21)
+            | ((uint64_t(int64_t(floor(p.z * inv_cell_size))) & mask) << 42);
+    }
+
+    // Render the pixels of a tile with the final integrator, in waves:
+    // the camera rays of all the samples of a block are shaded first,
+    // and the final gather rays of their diffuse points are traced
+    // together as a stream. Photons are then looked up sorted by the
+    // cell of the hit points, so that successive lookups visit the
+    // same nodes of the photon tree.
+    void render_tile_stream(
+        const FrameContext&             frame,
+        const size_t                    x1,
+        const size_t                    x2,
+        const size_t                    y1,
+        const size_t                    y2)
+    {
+        // Records of the irradiance cache are computed depth first.
+        if (frame.irradiance_cache)
+        {
+            render_tile<FinalIntegrator>(frame, x1, x2, y1, y2);
+            return;
+        }
+
+        thread_local ShadingScratch scratch;
+        thread_local vector<vec2> subpixels;
+        thread_local GatherStream stream;
+
+        ShadingContext ctx = {
+            frame.settings,
+            frame.grid,
+            frame.lights,
+            frame.ptree,
+            frame.caustic_tree,
+            frame.rng,
+            scratch,
+            frame.irradiance_cache,
+            nullptr
+        };
+
+        const size_t gather_rays_count = frame.settings.indirect_light_rays_count;
+        const float radius = frame.grid.voxel_size() * 1.5f;
+        const float inv_cell_size = 1.0f / frame.grid.voxel_size();
+
+        RayPacket packet;
+        HitRecord camera_recs[RAY_PACKET_SIZE];
+        vec3 colors[RAY_PACKET_SIZE];
+
+        for (size_t by = y1; by < y2; by += PACKET_BLOCK_SIZE)
+        {
+            for (size_t bx = x1; bx < x2; bx += PACKET_BLOCK_SIZE)
+            {
+                const size_t bx2 = std::min(bx + PACKET_BLOCK_SIZE, x2);
+                const size_t by2 = std::min(by + PACKET_BLOCK_SIZE, y2);
+
+                draw_block_samples(frame, (bx2 - bx) * (by2 - by), subpixels);
+
+                for (size_t i = 0; i < RAY_PACKET_SIZE; ++i)
+                    colors[i] = vec3(0.0f);
+
+                stream.points.clear();
+                stream.rays.clear();
+                stream.ray_points.clear();
+
+                // Shade the camera hits and generate the gather rays.
+                for (size_t s = 0; s < frame.samples; ++s)
+                {
+                    trace_block_sample(frame, bx, bx2, by, by2, s, subpixels, packet, camera_recs);
+
+                    for (size_t i = 0; i < packet.size; ++i)
+                    {
+                        const Ray r = packet.ray(i);
+                        const HitRecord& rec = camera_recs[i];
+
+                        // Misses, lights and metals are shaded depth first.
+                        if (rec.mat == nullptr || rec.mat->light || rec.mat->metallic)
+                        {
+                            ctx.camera_hit = &rec;
+                            colors[i] += FinalIntegrator::li(r, ctx);
+                            scratch.reset();
+                            continue;
+                        }
+
+                        GatherStream::Point point;
+                        point.pixel = i;
+                        point.normal = rec.normal;
+                        point.light = get_final_direct(
+                            r, rec, frame.settings.direct_light_rays_count,
+                            frame.grid, frame.lights, frame.rng);
+                        point.indirect = vec3(0.0f);
+                        point.weight = 0.0f;
+
+                        if (frame.caustic_tree)
+                            point.light += get_caustic(rec, frame.grid, *frame.caustic_tree, scratch.photons);
+
+                        scratch.reset();
+
+                        for (size_t j = 0; j < gather_rays_count; ++j)
+                        {
+                            stream.rays.push_back(Ray(rec.p, random_in_hemisphere(rec.normal, frame.rng)));
+                            stream.ray_points.push_back(static_cast<uint32_t>(stream.points.size()));
+                        }
+
+                        stream.points.push_back(point);
+                    }
+                }
+
+                ctx.camera_hit = nullptr;
+
+                // Trace the gather rays of the block together.
+                Stats::add(StatCounter::GatherRays, stream.rays.size());
+                frame.grid.hit_stream(stream.rays, 0.000001f, stream.recs);
+
+                // Gather photons where the rays hit, sorted by cell.
+                stream.order.clear();
+
+                for (size_t j = 0; j < stream.rays.size(); ++j)
+                {
+                    const GatherStream::Point& point = stream.points[stream.ray_points[j]];
+
+                    if (stream.recs[j].mat && dot(point.normal, stream.rays[j].dir) > 0.0f)
+                    {
+                        stream.order.push_back(make_pair(
+                            lookup_cell(stream.recs[j].p, inv_cell_size), static_cast<uint32_t>(j)));
+                    }
+                }
+
+                sort(stream.order.begin(), stream.order.end());
+
+                for (const pair<uint64_t, uint32_t>& lookup : stream.order)
+                {
+                    const uint32_t j = lookup.second;
+                    GatherStream::Point& point = stream.points[stream.ray_points[j]];
+                    gather_photons(
+                        frame.ptree, stream.recs[j], radius, scratch.photons, point.indirect, point.weight);
+                }
+
+                scratch.reset();
+
+                for (const GatherStream::Point& point : stream.points)
+                {
+                    vec3 indirect = point.indirect / point.weight;
+
+                    if (is_vec3_nan(indirect))
+                        indirect = vec3(0.0f);
+
+                    colors[point.pixel] += min(point.light + indirect, vec3(1.0f));
+                }
+
+                set_block_pixels(frame, bx, bx2, by, by2, colors);
+            }
+        }
+    }
+
+    // Create the irradiance cache records seen from a
+    // sparse lattice of pixels centers of rows [y1, y2).
+    void seed_irradiance_cache(
+        const FrameContext&             frame,
+        const size_t                    y1,
+        const size_t                    y2)
+    {
+        TraceScope trace("seed rows", "\"y\": " + to_string(y1));
+
+        const size_t width = frame.settings.width;
+        const size_t height = frame.settings.height;
+
+        // Scratch buffers are owned by the worker thread.
+        thread_local ShadingScratch scratch;
+
+        HitRecord rec;
+
+        for (size_t y = y1; y < y2; y += IRRADIANCE_CACHE_SEED_STEP)
+        {
+            for (size_t x = 0; x < width; x += IRRADIANCE_CACHE_SEED_STEP)
+            {
+                // In Qt, y is going from top to bottom.
+                const Ray r = frame.camera.get_ray(
+                    (x + 0.5f) / static_cast<float>(width),
+                    (height - y - 1 + 0.5f) / static_cast<float>(height));
+
+                Stats::add(StatCounter::CameraRays);
+
+                if (!frame.grid.hit(r, 0.0001f, numeric_limits<float>::max(), rec)
+                    || rec.mat->light
+                    || rec.mat->metallic)
+                    continue;
+
+                get_cached_indirect_light(
+                    rec, frame.settings.indirect_light_rays_count, frame.grid,
+                    frame.ptree, frame.rng, scratch, *frame.irradiance_cache);
+
+                scratch.reset();
+            }
+        }
+    }
+
+    typedef void (*TileRenderer)(
+        const FrameContext&             frame,
+        const size_t                    x1,
+        const size_t                    x2,
+        const size_t                    y1,
+        const size_t                    y2);
 
-    // Create tile jobs or render tiles.
-    for (y0 = 0; y0 < height; y0+=64)
+    // Returns the tile loop specialized for the integrator of the settings.
+    TileRenderer get_tile_renderer(const RenderSettings& settings)
     {
-        for (x0 = 0; x0 < width; x0+=64)
+        switch (settings.integrator)
         {
-            x1 = x0;
-            y1 = y0;
-            x2 = std::min(x0+64, width);
-            y2 = std::min(y0+64, height);
+          case IntegratorType::Normal:
+            return &render_tile<NormalIntegrator>;
+          case IntegratorType::Albedo:
+            return &render_tile<AlbedoIntegrator>;
+          case IntegratorType::PhotonMap:
+            return &render_tile<PhotonMapIntegrator>;
+          case IntegratorType::DirectDiffuse:
+            return &render_tile<DirectDiffuseIntegrator>;
+          case IntegratorType::DirectSpecular:
+            return &render_tile<DirectSpecularIntegrator>;
+          case IntegratorType::DirectPhong:
+            return &render_tile<DirectPhongIntegrator>;
+          case IntegratorType::IndirectLight:
+            return &render_tile<IndirectLightIntegrator>;
+          case IntegratorType::ProgressivePhotonMap:
+          case IntegratorType::Final:
+            break;
+        }
+
+        if (settings.stream_tracing)
+            return &render_tile_stream;
+
+        return &render_tile<FinalIntegrator>;
+    }
+}
+
+void Render::get_render_image(
+    const RenderSettings&           settings,
+    const Camera&                   camera,
+    const MeshGroup&                world,
+    const InstanceGroup&            instances,
+    QImage&                         image,
+    QProgressBar&                   progressBar)
+{
+    const vector<RenderView> views(1, RenderView{ camera, settings.width, settings.height });
+    vector<QImage> images;
+
+    get_batch_images(settings, views, world, instances, images, progressBar);
+
+    if (!images.empty())
+        image = images[0];
+}
+
+// Lighting structures of a geometry, shared by the frames rendered with it.
+struct Render::SceneLighting
+{
+    PhotonMap                       pmap;
+    unique_ptr<PhotonTree>          ptree;
+    PhotonMap                       caustic_map;
+    unique_ptr<PhotonTree>          caustic_tree;
+    unique_ptr<IrradianceCache>     irradiance_cache;
+};
+
+void Render::get_batch_images(
+    const RenderSettings&           settings,
+    const vector<RenderView>&       views,
+    const MeshGroup&                world,
+    const InstanceGroup&            instances,
+    vector<QImage>&                 images,
+    QProgressBar&                   progressBar)
+{
+    images.clear();
+    m_heatmaps.clear();
+
+    if (views.empty())
+        return;
+
+    for (size_t f = 0; f < views.size(); ++f)
+        images.push_back(QImage(int(views[f].width), int(views[f].height), QImage::Format_RGB888));
+
+    m_heatmaps.resize(views.size());
+
+    Stats::reset();
+    TraceScope trace("render");
+
+    // Create a random number generator.
+    RNG rng;
+
+    // Get lights from the scene.
+    Tracer::begin("fetch lights");
+    const MeshGroup lights = fetch_lights(world);
+    Tracer::end("fetch lights");
+    Logger::log_debug(to_string(lights.size()) + " light triangles");
+    Logger::log_debug(to_string(world.size() - lights.size()) + " triangles in the scene");
+
+    // Create the grid accelerator, shared by all the frames.
+    Tracer::begin("build grid");
+    VoxelGridAccelerator grid(world, instances);
+    Tracer::end("build grid");
+
+    // Progressive photon mapping traces its own photon passes.
+    if (settings.integrator == IntegratorType::ProgressivePhotonMap)
+    {
+        for (size_t f = 0; f < views.size(); ++f)
+            render_progressive(settings, views[f], grid, lights, rng, images[f], progressBar);
+
+        log_stats();
+        return;
+    }
+
+    SceneLighting lighting;
+    build_lighting(settings, views, world, instances, grid, lights, rng, lighting);
+    render_frames(settings, views, grid, lights, lighting, rng, images, m_heatmaps, progressBar);
+
+    log_stats();
+}
+
+void Render::get_sequence_images(
+    const RenderSettings&           settings,
+    const RenderSequence&           sequence,
+    const MeshGroup&                world,
+    const InstanceGroup&            instances,
+    vector<QImage>&                 images,
+    QProgressBar&                   progressBar)
+{
+    // Without moving meshes, the frames are a batch of views.
+    if (sequence.animated.empty())
+    {
+        get_batch_images(settings, sequence.views, world, instances, images, progressBar);
+        return;
+    }
+
+    images.clear();
+    m_heatmaps.clear();
+
+    const vector<RenderView>& views = sequence.views;
 
-            if (parallel)
+    if (views.empty())
+        return;
+
+    for (size_t f = 0; f < views.size(); ++f)
+        images.push_back(QImage(int(views[f].width), int(views[f].height), QImage::Format_RGB888));
+
+    m_heatmaps.resize(views.size());
+
+    Stats::reset();
+    TraceScope trace("render sequence");
+
+    // Create a random number generator.
+    RNG rng;
+
+    // Start the meshes at their first frame transform.
+    MeshGroup moved;
+    vector<AABB> previous_bboxes;
+
+    for (const AnimatedMesh& animated : sequence.animated)
+    {
+        assert(animated.transforms.size() == views.size());
+
+        animated.mesh->set_transform(animated.transforms[0]);
+
+        for (const Shape& triangle : animated.triangles)
+        {
+            triangle->update_bbox();
+            moved.push_back(triangle);
+        }
+    }
+
+    previous_bboxes.resize(moved.size());
+
+    // Lights may move, but the list of light triangles does not change.
+    Tracer::begin("fetch lights");
+    const MeshGroup lights = fetch_lights(world);
+    Tracer::end("fetch lights");
+    Logger::log_debug(to_string(lights.size()) + " light triangles");
+    Logger::log_debug(to_string(world.size() - lights.size()) + " triangles in the scene");
+
+    Tracer::begin("build grid");
+    unique_ptr<VoxelGridAccelerator> grid(new VoxelGridAccelerator(world, instances));
+    Tracer::end("build grid");
+
+    // Transforms of the next frame are computed while the current one renders.
+    QFuture<void> staging;
+
+    auto stage_frame = [&](const size_t f)
+    {
+        TraceScope trace("stage transforms", "\"frame\": " + to_string(f));
+
+        for (const AnimatedMesh& animated : sequence.animated)
+            animated.mesh->stage_transform(animated.transforms[f]);
+    };
+
+    QTime sequence_timer;
+    sequence_timer.start();
+
+    for (size_t f = 0; f < views.size(); ++f)
+    {
+        TraceScope frame_trace("frame", "\"frame\": " + to_string(f));
+
+        if (f > 0)
+        {
+            TraceScope refit_trace("refit grid");
+
+            QTime refit_timer;
+            refit_timer.start();
+
+            staging.waitForFinished();
+
+            for (size_t i = 0; i < moved.size(); ++i)
+                previous_bboxes[i] = moved[i]->bbox();
+
+            for (const AnimatedMesh& animated : sequence.animated)
+                animated.mesh->commit_transform();
+
+            for (const Shape& triangle : moved)
+                triangle->update_bbox();
+
+            // The grid keeps its bounds and resolution and only updates
+            // the voxels of the moved triangles, unless they left it,
+            // and it is then rebuilt.
+            if (!grid->refit(moved, previous_bboxes))
             {
-                QFuture<void> future = QtConcurrent::run(compute, x1, x2, y1, y2);
-                threads.push_back(future);
+                Logger::log_debug("meshes moved out of the grid, rebuilding it.");
+                grid.reset(new VoxelGridAccelerator(world, instances));
             }
+
+            Logger::log_debug(
+                "frame " + to_string(f) + ": geometry updated in "
+                + to_string(refit_timer.elapsed()) + "ms.");
+        }
+
+        if (f + 1 < views.size())
+        {
+            if (settings.parallel)
+                staging = QtConcurrent::run(stage_frame, f + 1);
             else
+                stage_frame(f + 1);
+        }
+
+        Logger::log_info("rendering frame " + to_string(f + 1) + "/" + to_string(views.size()) + "...");
+
+        const vector<RenderView> frame_views(1, views[f]);
+        vector<QImage> frame_images(1, images[f]);
+        vector<QImage> frame_heatmaps(1);
+
+        if (settings.integrator == IntegratorType::ProgressivePhotonMap)
+        {
+            render_progressive(settings, views[f], *grid, lights, rng, frame_images[0], progressBar);
+        }
+        else
+        {
+            // Photons follow the moving meshes, so lighting is rebuilt every frame.
+            SceneLighting lighting;
+            build_lighting(settings, frame_views, world, instances, *grid, lights, rng, lighting);
+            render_frames(settings, frame_views, *grid, lights, lighting, rng, frame_images, frame_heatmaps, progressBar);
+        }
+
+        images[f] = frame_images[0];
+        m_heatmaps[f] = frame_heatmaps[0];
+    }
+
+    const int elapsed = sequence_timer.elapsed();
+
+    QString message =
+        QString("sequence of ") + QString::number(views.size()) + " frames finished in "
+        + ((elapsed > 1000)
+            ? (QString::number(elapsed / 1000) + "s.")
+            : (QString::number(elapsed % 1000) + "ms."));
+
+    Logger::log_info(message.toStdString().c_str());
+
+    log_stats();
+}
+
+void Render::build_lighting(
+    const RenderSettings&           settings,
+    const vector<RenderView>&       views,
+    const MeshGroup&                world,
+    const InstanceGroup&            instances,
+    const VoxelGridAccelerator&     grid,
+    const MeshGroup&                lights,
+    RNG&                            rng,
+    SceneLighting&                  lighting)
+{
+    Logger::log_debug("fetching photons in a radius of " + to_string(grid.voxel_size()));
+
+    // Photon maps of fixed-lighting scenes are reused across renders.
+    // Their key and their materials only cover the triangles of the world.
+    PhotonMap& pmap = lighting.pmap;
+    const bool reuse_photons = settings.reuse_photons && instances.empty();
+
+    if (settings.reuse_photons && !instances.empty())
+        Logger::log_info("photon maps are not reused: the scene has instances.");
+
+    // Find where photons will be looked up from any of the
+    // views, so that they are emitted and stored there in priority.
+    const bool gathers = settings.integrator == IntegratorType::Final
+        || settings.integrator == IntegratorType::IndirectLight;
+    const bool use_importance = settings.photons_importance
+        && (gathers || settings.integrator == IntegratorType::PhotonMap);
+    const size_t importance_gather_rays =
+        gathers ? std::min(settings.indirect_light_rays_count, size_t(IMPORTANCE_GATHER_RAYS)) : 0;
+
+    uint64_t photons_key = 0;
+    string photons_file;
+    bool photons_loaded = false;
+
+    if (reuse_photons)
+    {
+        photons_key = PhotonMap::scene_key(world, settings.photons_count, PHOTONS_MAX_DEPTH);
+        photons_file = photon_map_filename(photons_key);
+        photons_loaded = pmap.load(photons_file, photons_key, world);
+    }
+
+    if (!photons_loaded)
+    {
+        unique_ptr<ImportanceMap> importance;
+
+        if (use_importance)
+        {
+            // Cells must cover the photon search radius,
+            // which is used as a squared distance.
+            const float radius = grid.voxel_size() * 1.5f;
+
+            TraceScope trace("importance map");
+
+            importance.reset(new ImportanceMap(std::max(grid.voxel_size(), sqrt(radius))));
+
+            for (size_t f = 0; f < views.size(); ++f)
             {
-                emit on_tile_begin(x1, y1, x2, y2);
-                compute(x1, x2, y1, y2);
-                progressBar.setValue(int((y0/64)*(width/64)+(x0/64)));
-                emit on_tile_end(x1, y1, x2, y2, image);
+                importance->compute(
+                    views[f].camera, grid, views[f].width, views[f].height, IMPORTANCE_PIXELS_STEP,
+                    importance_gather_rays, settings.parallel, rng);
             }
         }
+
+        // Create photon map.
+        TraceScope trace("trace photons");
+        pmap.compute_map(settings.photons_count, PHOTONS_MAX_DEPTH, grid, lights, rng, importance.get());
     }
 
-    y0 = 0;
-    x0 = 0;
+    // Create photon tree.
+    Tracer::begin("build photon tree");
+    lighting.ptree.reset(new PhotonTree(pmap));
+    Tracer::end("build photon tree");
+
+    if (reuse_photons && !photons_loaded)
+        pmap.save(photons_file, photons_key, world);
+
+    // Final gathering only needs one estimate per gather ray.
+    if (settings.integrator == IntegratorType::Final
+        || settings.integrator == IntegratorType::IndirectLight)
+    {
+        TraceScope trace("precompute irradiance");
+        lighting.ptree->precompute_irradiance(
+            IRRADIANCE_PHOTON_STEP, MAX_PHOTONS_COUNT, grid.voxel_size() * 1.5f);
+    }
 
-    for(size_t i = 0; i < threads.size(); ++i)
+    // Caustics are rendered from a dedicated map, queried in a small radius.
+    // It is reused along with the main map, under its own key.
+    if (settings.caustic_photons_count > 0 && settings.integrator == IntegratorType::Final)
     {
-        // Compute thread's tile position.
-        x2 = std::min(x0 + 64, width);
-        y2 = std::min(y0 + 64, height);
+        PhotonMap& caustic_map = lighting.caustic_map;
+        uint64_t caustics_key = 0;
+        string caustics_file;
+        bool caustics_loaded = false;
 
-        emit on_tile_begin(x0, y0, x2, y2);
-        threads.at(i).waitForFinished();
-        emit on_tile_end(x0, y0, x2, y2, image);
-        progressBar.setValue(int(i));
+        if (reuse_photons)
+        {
+            caustics_key = PhotonMap::scene_key(
+                world, settings.caustic_photons_count, PHOTONS_MAX_DEPTH, true);
+            caustics_file = photon_map_filename(caustics_key);
+            caustics_loaded = caustic_map.load(caustics_file, caustics_key, world);
+        }
+
+        if (!caustics_loaded)
+        {
+            TraceScope trace("caustic photons");
+
+            caustic_map.compute_caustic_map(
+                settings.caustic_photons_count, PHOTONS_MAX_DEPTH, grid, lights, fetch_metallic(world), rng);
+        }
+
+        if (caustic_map.size() > 0)
+            lighting.caustic_tree.reset(new PhotonTree(caustic_map));
+
+        // Scenes without caustics save an empty map,
+        // so that they are not traced again either.
+        if (reuse_photons && !caustics_loaded)
+            caustic_map.save(caustics_file, caustics_key, world);
+    }
 
-        x0 += 64;
+    // Irradiance does not depend on the view: the cache
+    // is shared by all the tiles of all the frames.
+    if (settings.irradiance_cache && settings.integrator == IntegratorType::Final)
+    {
+        lighting.irradiance_cache.reset(new IrradianceCache(
+            IRRADIANCE_CACHE_ERROR, grid.voxel_size() * 0.25f, grid.voxel_size() * 8.0f));
+    }
+}
+
+void Render::render_frames(
+    const RenderSettings&           settings,
+    const vector<RenderView>&       views,
+    const VoxelGridAccelerator&     grid,
+    const MeshGroup&                lights,
+    SceneLighting&                  lighting,
+    RNG&                            rng,
+    vector<QImage>&                 images,
+    vector<QImage>&                 heatmaps,
+    QProgressBar&                   progressBar)
+{
+    assert(images.size() == views.size());
+    assert(heatmaps.size() == views.size());
+
+    progressBar.setValue(53);
+
+    // Each frame renders with its own image size.
+    vector<RenderSettings> frames_settings(views.size(), settings);
+
+    for (size_t f = 0; f < views.size(); ++f)
+    {
+        frames_settings[f].width = views[f].width;
+        frames_settings[f].height = views[f].height;
+    }
+
+    // Precompute subpixel samples position
+    const size_t dimension_size = static_cast<size_t>(std::max(1, static_cast<int>(sqrt(settings.spp))));
+    const size_t samples = dimension_size * dimension_size;
+
+    SampleGenerator generator(dimension_size, rng);
+
+    // Thread handles
+    vector<QFuture<void>> threads;
+
+    vector<FrameContext> frames;
+    frames.reserve(views.size());
+
+    for (size_t f = 0; f < views.size(); ++f)
+    {
+        frames.push_back(FrameContext{
+            frames_settings[f],
+            views[f].camera,
+            grid,
+            lights,
+            *lighting.ptree,
+            lighting.caustic_tree.get(),
+            lighting.irradiance_cache.get(),
+            samples,
+            generator,
+            rng,
+            images[f]
+        });
+    }
 
-        if (x0 >= width)
+    // The render mode is resolved once for the whole batch.
+    const TileRenderer render_tile_job = get_tile_renderer(settings);
+
+    // Populate the irradiance cache from all the views before rendering the tiles.
+    if (lighting.irradiance_cache)
+    {
+        TraceScope trace("seed irradiance cache");
+
+        QTime seed_timer;
+        seed_timer.start();
+
+        for (size_t f = 0; f < frames.size(); ++f)
+        {
+            const size_t height = views[f].height;
+
+            for (size_t y1 = 0; y1 < height; y1 += 64)
+            {
+                const size_t y2 = std::min(y1 + 64, height);
+
+                if (settings.parallel)
+                    threads.push_back(QtConcurrent::run(seed_irradiance_cache, frames[f], y1, y2));
+                else
+                    seed_irradiance_cache(frames[f], y1, y2);
+            }
+        }
+
+        for (size_t i = 0; i < threads.size(); ++i)
         {
-            x0 = 0;
-            y0 += 64;
+            threads.at(i).waitForFinished();
         }
+
+        threads.clear();
+
+        Logger::log_info(
+            "seeded the irradiance cache with " + to_string(lighting.irradiance_cache->size())
+            + " records in " + to_string(seed_timer.elapsed()) + "ms.");
+    }
+
+    // Tiles of all the frames, in frame then scanline order.
+    struct Tile
+    {
+        size_t frame;
+        size_t x1, x2, y1, y2;
+    };
+
+    vector<Tile> tiles;
+
+    for (size_t f = 0; f < views.size(); ++f)
+    {
+        const size_t width = views[f].width;
+        const size_t height = views[f].height;
+
+        for (size_t y0 = 0; y0 < height; y0 += 64)
+        {
+            for (size_t x0 = 0; x0 < width; x0 += 64)
+            {
+                const Tile tile = { f, x0, std::min(x0 + 64, width), y0, std::min(y0 + 64, height) };
+                tiles.push_back(tile);
+            }
+        }
+    }
+
+    // Counters and wall time in microseconds of each tile.
+    vector<RenderStats> tiles_stats(tiles.size());
+    vector<double> tiles_time(tiles.size());
+
+    // Job for rendering a given tile.
+    auto compute = [&](const size_t i)
+    {
+        const Tile& tile = tiles[i];
+        const RenderStats before = Stats::thread_stats();
+        const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+        TraceScope trace(
+            "tile",
+            "\"frame\": " + to_string(tile.frame)
+            + ", \"x\": " + to_string(tile.x1) + ", \"y\": " + to_string(tile.y1));
+
+        render_tile_job(frames[tile.frame], tile.x1, tile.x2, tile.y1, tile.y2);
+
+        tiles_time[i] = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+        tiles_stats[i] = Stats::thread_stats() - before;
+    };
+
+    // Samples rendered in a tile.
+    auto tile_samples = [&](const Tile& tile)
+    {
+        return (tile.x2 - tile.x1) * (tile.y2 - tile.y1) * samples;
+    };
+
+    // Starts rendering.
+    Logger::log_info(
+        views.size() > 1
+            ? "rendering " + to_string(views.size()) + " frames..."
+            : string("rendering..."));
+
+    TraceScope trace("render tiles");
+
+    QTime render_timer;
+    render_timer.start();
+    progressBar.setRange(0, int(tiles.size()));
+    progressBar.setVisible(true);
+
+    // Tiles of the next frames keep the threads busy
+    // while the tiles of the first frames are reported.
+    if (settings.parallel)
+    {
+        for (size_t i = 0; i < tiles.size(); ++i)
+            threads.push_back(QtConcurrent::run(compute, i));
+    }
+
+    for (size_t i = 0; i < tiles.size(); ++i)
+    {
+        const Tile& tile = tiles[i];
+
+        if (i == 0 || tiles[i - 1].frame != tile.frame)
+            emit on_frame_begin(views[tile.frame].width, views[tile.frame].height);
+
+        emit on_tile_begin(tile.x1, tile.y1, tile.x2, tile.y2);
+
+        if (settings.parallel)
+            threads.at(i).waitForFinished();
+        else
+            compute(i);
+
+        Logger::log_debug(
+            "tile " + to_string(tile.x1) + "," + to_string(tile.y1)
+            + " of frame " + to_string(tile.frame) + ": "
+            + to_string(static_cast<int>(tiles_time[i] / 1000.0)) + "ms, "
+            + to_string(tile_samples(tile)) + " samples, " + tiles_stats[i].to_json());
+
+        emit on_tile_end(tile.x1, tile.y1, tile.x2, tile.y2, images[tile.frame]);
+        progressBar.setValue(int(i));
     }
 
     progressBar.setValue(progressBar.maximum());
@@ -860,5 +1989,129 @@ void Render::get_render_image(
             : (QString::number(elapsed % 1000) + "ms."));
 
     Logger::log_info(message.toStdString().c_str());
+
+    if (tiles.empty())
+        return;
+
+    // Tiles are colored by their time per sample, relative to the slowest
+    // tile of all the frames, as tiles on the image borders are smaller.
+    vector<double> tiles_sample_time(tiles.size());
+
+    for (size_t i = 0; i < tiles.size(); ++i)
+        tiles_sample_time[i] = tiles_time[i] / static_cast<double>(tile_samples(tiles[i]));
+
+    vector<double> sorted_sample_time = tiles_sample_time;
+    sort(sorted_sample_time.begin(), sorted_sample_time.end());
+
+    const double max_sample_time = sorted_sample_time.back();
+
+    for (size_t f = 0; f < views.size(); ++f)
+    {
+        heatmaps[f] = QImage(int(views[f].width), int(views[f].height), QImage::Format_RGB888);
+        heatmaps[f].fill(qRgb(0, 0, 0));
+    }
+
+    for (size_t i = 0; i < tiles.size(); ++i)
+    {
+        const Tile& tile = tiles[i];
+        const QRgb color = heat_color(
+            max_sample_time > 0.0 ? static_cast<float>(tiles_sample_time[i] / max_sample_time) : 0.0f);
+
+        for (size_t y = tile.y1; y < tile.y2; ++y)
+        {
+            for (size_t x = tile.x1; x < tile.x2; ++x)
+                heatmaps[tile.frame].setPixel(int(x), int(y), color);
+        }
+    }
+
+    Logger::log_info(
+        "time per sample of the tiles: "
+        + to_string(sorted_sample_time.front()) + "us min, "
+        + to_string(sorted_sample_time[sorted_sample_time.size() / 2]) + "us median, "
+        + to_string(max_sample_time) + "us max.");
 }
 
+
+const vector<QImage>& Render::heatmaps() const
+{
+    return m_heatmaps;
+}
+
+void Render::render_progressive(
+    const RenderSettings&           settings,
+    const RenderView&               view,
+    const VoxelGridAccelerator&     grid,
+    const MeshGroup&                lights,
+    RNG&                            rng,
+    QImage&                         image,
+    QProgressBar&                   progressBar)
+{
+    const size_t width = view.width;
+    const size_t height = view.height;
+    const size_t iterations = std::max(settings.spp, size_t(1));
+    const Camera& camera = view.camera;
+
+    if (lights.empty())
+    {
+        Logger::log_error("No lights were found in scene. Please, add at least one light before lighting computation.");
+        return;
+    }
+
+    emit on_frame_begin(width, height);
+
+    RenderSettings frame_settings = settings;
+    frame_settings.width = width;
+    frame_settings.height = height;
+
+    ProgressivePhotonMap sppm(frame_settings, grid.voxel_size());
+
+    Logger::log_info(
+        "rendering " + to_string(iterations) + " progressive photon mapping iterations of "
+        + to_string(settings.photons_count) + " photons...");
+
+    QTime render_timer;
+    render_timer.start();
+    progressBar.setRange(0, int(iterations));
+    progressBar.setVisible(true);
+
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        emit on_tile_begin(0, 0, width, height);
+
+        TraceScope trace("progressive iteration", "\"iteration\": " + to_string(i));
+
+        sppm.iterate(camera, grid, lights, rng);
+
+        // Show the current estimate.
+        for (size_t y = 0; y < height; ++y)
+        {
+            for (size_t x = 0; x < width; ++x)
+            {
+                vec3 color = sppm.radiance(x, y);
+                color = vec3(sqrt(color[0]), sqrt(color[1]), sqrt(color[2]));
+                color = min(color, vec3(1.0f));
+
+                image.setPixel(x, y, qRgb(
+                    static_cast<int>(255.0f * color[0]),
+                    static_cast<int>(255.0f * color[1]),
+                    static_cast<int>(255.0f * color[2])));
+            }
+        }
+
+        emit on_tile_end(0, 0, width, height, image);
+        progressBar.setValue(int(i + 1));
+    }
+
+    progressBar.setValue(progressBar.maximum());
+    progressBar.setVisible(false);
+
+    const int elapsed = render_timer.elapsed();
+
+    QString message =
+        QString("rendering finished in ")
+        + ((elapsed > 1000)
+            ? (QString::number(elapsed / 1000) + "s.")
+            : (QString::number(elapsed % 1000) + "ms."));
+
+    Logger::log_info(message.toStdString().c_str());
+}
@@ -10,14 +10,20 @@
 
 // couscous includes.
 #include "renderer/camera.h"
+#include "renderer/instance.h"
+#include "renderer/integrator.h"
 #include "renderer/ray.h"
 #include "renderer/visualobject.h"
 #include "renderer/samplegenerator.h"
+#include "renderer/sequence.h"
 #include "renderer/photonMapping.h"
 
 // Math includes.
 #include <glm/vec3.hpp>
 
+// Standard includes.
+#include <vector>
+
 // Forward declaration.
 class PhotonMap;
 class PhotonTree;
@@ -29,26 +35,46 @@ class Render : public QObject
     Q_OBJECT
   public:
     void get_render_image(
-        const size_t                    width,
-        const size_t                    height,
-        const size_t                    spp,
+        const RenderSettings&           settings,
         const Camera&                   camera,
         const MeshGroup&                world,
-        const size_t                    direct_light_rays_count,
-        const size_t                    indirect_light_rays_count,
-        const size_t                    photons_count,
-        const bool                      parallel,
-        const bool                      get_normal_color,
-        const bool                      get_albedo_color,
-        const bool                      display_photon_map,
-        const bool                      direct_diffuse,
-        const bool                      direct_specular,
-        const bool                      direct_phong,
-        const bool                      indirect_light,
+        const InstanceGroup&            instances,
         QImage&                         image,
         QProgressBar&                   progressBar);
 
-  signals:
+    // Render an image per view. The accelerator, the photon maps and the
+    // irradiance cache are built once and shared by all the views, and
+    // the tiles of all the frames are scheduled together.
+    void get_batch_images(
+        const RenderSettings&           settings,
+        const std::vector<RenderView>&  views,
+        const MeshGroup&                world,
+        const InstanceGroup&            instances,
+        std::vector<QImage>&            images,
+        QProgressBar&                   progressBar);
+
+    // Render an image per frame of an animation. The accelerator is
+    // refit to the moving meshes, and the transforms of the next frame
+    // are computed while the current frame renders. The lighting of
+    // each frame is still computed before its image, not overlapped.
+    void get_sequence_images(
+        const RenderSettings&           settings,
+        const RenderSequence&           sequence,
+        const MeshGroup&                world,
+        const InstanceGroup&            instances,
+        std::vector<QImage>&            images,
+        QProgressBar&                   progressBar);
+
+    // False color heatmaps of the time spent per sample in each tile,
+    // for the frames of the last render. Heatmaps of frames rendered
+    // with progressive photon mapping are null images.
+    const std::vector<QImage>& heatmaps() const;
+
+
+    // Emitted before the first tile of a frame begins.
+    void on_frame_begin(
+        const size_t                    width,
+        const size_t                    height);
 
     // Emitted when a tile begins.
     void on_tile_begin(
@@ -64,6 +90,45 @@ class Render : public QObject
         const size_t                    x1,
         const size_t                    y1,
         const QImage&                   frame);
+
+  private:
+    struct SceneLighting;
+
+    // Build the photon maps and the irradiance cache
+    // used to render the given views.
+    void build_lighting(
+        const RenderSettings&           settings,
+        const std::vector<RenderView>&  views,
+        const MeshGroup&                world,
+        const InstanceGroup&            instances,
+        const VoxelGridAccelerator&     grid,
+        const MeshGroup&                lights,
+        RNG&                            rng,
+        SceneLighting&                  lighting);
+
+    // Render the tiles of all the views, reporting them in frame order.
+    void render_frames(
+        const RenderSettings&           settings,
+        const std::vector<RenderView>&  views,
+        const VoxelGridAccelerator&     grid,
+        const MeshGroup&                lights,
+        SceneLighting&                  lighting,
+        RNG&                            rng,
+        std::vector<QImage>&            images,
+        std::vector<QImage>&            heatmaps,
+        QProgressBar&                   progressBar);
+
+    // Render with stochastic progressive photon mapping.
+    void render_progressive(
+        const RenderSettings&           settings,
+        const RenderView&               view,
+        const VoxelGridAccelerator&     grid,
+        const MeshGroup&                lights,
+        RNG&                            rng,
+        QImage&                         image,
+        QProgressBar&                   progressBar);
+
+    std::vector<QImage>                 m_heatmaps;
 };
 
 #endif // RENDER_H
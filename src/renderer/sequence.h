@@ -0,0 +1,44 @@
+#ifndef RENDERER_SEQUENCE_H
+#define RENDERER_SEQUENCE_H
+
+// couscous includes.
+#include "renderer/camera.h"
+#include "renderer/visualobject.h"
+
+// glm includes.
+#include <glm/glm.hpp>
+
+// Standard includes.
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+// A camera pose of a batch render, with the size of its image.
+struct RenderView
+{
+    Camera                          camera;
+    size_t                          width;
+    size_t                          height;
+};
+
+// A mesh moved rigidly by an animation sequence.
+struct AnimatedMesh
+{
+    std::shared_ptr<TriangleMesh>   mesh;
+
+    // Triangles of the mesh in the world.
+    MeshGroup                       triangles;
+
+    // Transform of the mesh at each frame.
+    std::vector<glm::mat4>          transforms;
+};
+
+// The frames of an animation: a view per frame, and the meshes that move.
+// Meshes that are not listed keep their transform for the whole sequence.
+struct RenderSequence
+{
+    std::vector<RenderView>         views;
+    std::vector<AnimatedMesh>       animated;
+};
+
+#endif // RENDERER_SEQUENCE_H
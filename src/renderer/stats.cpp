@@ -0,0 +1,198 @@
+// Interface.
+#include "renderer/stats.h"
+
+// Qt includes.
+#include <QMutex>
+#include <QMutexLocker>
+
+// Standard includes.
+#include <algorithm>
+#include <atomic>
+#include <sstream>
+#include <vector>
+
+using namespace std;
+
+#define STATS_COUNTERS_COUNT static_cast<size_t>(StatCounter::Count)
+
+namespace
+{
+    const char* const counter_names[STATS_COUNTERS_COUNT] =
+    {
+        "camera_rays",
+        "shadow_rays",
+        "gather_rays",
+        "photon_rays",
+        "voxels_visited",
+        "nodes_visited",
+        "triangles_tested",
+        "photon_lookups",
+        "photons_found"
+    };
+
+    double photons_per_lookup(const RenderStats& stats)
+    {
+        const uint64_t lookups = stats[StatCounter::PhotonLookups];
+
+        return lookups > 0
+            ? static_cast<double>(stats[StatCounter::PhotonsFound]) / static_cast<double>(lookups)
+            : 0.0;
+    }
+
+    struct ThreadCounters;
+
+    // Counters of the running threads, and the sum of
+    // the counters of the threads that exited.
+    struct Registry
+    {
+        QMutex                      lock;
+        vector<ThreadCounters*>     threads;
+        RenderStats                 exited;
+    };
+
+    Registry& registry()
+    {
+        static Registry instance;
+        return instance;
+    }
+
+    // Counters of a thread. Only their thread writes them: relaxed
+    // loads and stores are enough for other threads to read them.
+    struct ThreadCounters
+    {
+        atomic<uint64_t>            counters[STATS_COUNTERS_COUNT];
+
+        ThreadCounters()
+        {
+            for (size_t i = 0; i < STATS_COUNTERS_COUNT; ++i)
+                counters[i].store(0, memory_order_relaxed);
+
+            QMutexLocker locker(&registry().lock);
+            registry().threads.push_back(this);
+        }
+
+        ~ThreadCounters()
+        {
+            QMutexLocker locker(&registry().lock);
+
+            for (size_t i = 0; i < STATS_COUNTERS_COUNT; ++i)
+                registry().exited.counters[i] += counters[i].load(memory_order_relaxed);
+
+            vector<ThreadCounters*>& threads = registry().threads;
+            threads.erase(remove(threads.begin(), threads.end(), this), threads.end());
+        }
+
+        RenderStats stats() const
+        {
+            RenderStats stats;
+
+            for (size_t i = 0; i < STATS_COUNTERS_COUNT; ++i)
+                stats.counters[i] = counters[i].load(memory_order_relaxed);
+
+            return stats;
+        }
+    };
+
+    ThreadCounters& thread_counters()
+    {
+        thread_local ThreadCounters counters;
+        return counters;
+    }
+}
+
+//
+// RenderStats implementation.
+//
+
+uint64_t RenderStats::operator[](const StatCounter counter) const
+{
+    return counters[static_cast<size_t>(counter)];
+}
+
+RenderStats RenderStats::operator-(const RenderStats& rhs) const
+{
+    RenderStats stats;
+
+    for (size_t i = 0; i < STATS_COUNTERS_COUNT; ++i)
+        stats.counters[i] = counters[i] - rhs.counters[i];
+
+    return stats;
+}
+
+string RenderStats::to_string() const
+{
+    ostringstream stream;
+
+    stream
+        << (*this)[StatCounter::CameraRays] << " camera rays, "
+        << (*this)[StatCounter::ShadowRays] << " shadow rays, "
+        << (*this)[StatCounter::GatherRays] << " gather rays, "
+        << (*this)[StatCounter::PhotonRays] << " photon rays, "
+        << (*this)[StatCounter::VoxelsVisited] << " voxels and "
+        << (*this)[StatCounter::NodesVisited] << " nodes visited, "
+        << (*this)[StatCounter::TrianglesTested] << " triangles tested, "
+        << (*this)[StatCounter::PhotonLookups] << " photon lookups of "
+        << photons_per_lookup(*this) << " photons.";
+
+    return stream.str();
+}
+
+string RenderStats::to_json() const
+{
+    ostringstream stream;
+
+    stream << "{";
+
+    for (size_t i = 0; i < STATS_COUNTERS_COUNT; ++i)
+        stream << "\"" << counter_names[i] << "\": " << counters[i] << ", ";
+
+    stream << "\"photons_per_lookup\": " << photons_per_lookup(*this) << "}";
+
+    return stream.str();
+}
+
+
+//
+// Stats class implementation.
+//
+
+void Stats::add(const StatCounter counter, const uint64_t n)
+{
+    atomic<uint64_t>& value = thread_counters().counters[static_cast<size_t>(counter)];
+    value.store(value.load(memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+RenderStats Stats::thread_stats()
+{
+    return thread_counters().stats();
+}
+
+RenderStats Stats::collect()
+{
+    QMutexLocker locker(&registry().lock);
+
+    RenderStats stats = registry().exited;
+
+    for (const ThreadCounters* thread : registry().threads)
+    {
+        const RenderStats thread_stats = thread->stats();
+
+        for (size_t i = 0; i < STATS_COUNTERS_COUNT; ++i)
+            stats.counters[i] += thread_stats.counters[i];
+    }
+
+    return stats;
+}
+
+void Stats::reset()
+{
+    QMutexLocker locker(&registry().lock);
+
+    registry().exited = RenderStats();
+
+    for (ThreadCounters* thread : registry().threads)
+    {
+        for (size_t i = 0; i < STATS_COUNTERS_COUNT; ++i)
+            thread->counters[i].store(0, memory_order_relaxed);
+    }
+}
@@ -0,0 +1,65 @@
+#ifndef RENDERER_STATS_H
+#define RENDERER_STATS_H
+
+// Standard includes.
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+//
+// Render statistics.
+//
+// Each thread increments its own counters, without synchronization,
+// and the counters of all the threads are summed when the statistics
+// are collected. Hot loops count locally and add their counts once per
+// traversal or per shading point.
+//
+
+enum class StatCounter
+{
+    CameraRays,
+    ShadowRays,
+    GatherRays,
+    PhotonRays,
+    VoxelsVisited,
+    NodesVisited,
+    TrianglesTested,
+    PhotonLookups,
+    PhotonsFound,
+    Count
+};
+
+struct RenderStats
+{
+    std::uint64_t   counters[static_cast<size_t>(StatCounter::Count)] = {};
+
+    std::uint64_t operator[](const StatCounter counter) const;
+
+    // Counters of the render without the given ones.
+    RenderStats operator-(const RenderStats& rhs) const;
+
+    // One line summary.
+    std::string to_string() const;
+
+    // JSON object with a member per counter.
+    std::string to_json() const;
+};
+
+class Stats
+{
+  public:
+    // Add n to a counter of the calling thread.
+    static void add(const StatCounter counter, const std::uint64_t n = 1);
+
+    // Counters of the calling thread.
+    static RenderStats thread_stats();
+
+    // Sum of the counters of all the threads.
+    static RenderStats collect();
+
+    // Zero the counters of all the threads.
+    // Must be called while no thread is rendering.
+    static void reset();
+};
+
+#endif // RENDERER_STATS_H
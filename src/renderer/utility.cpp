@@ -6,6 +6,7 @@
 #include "renderer/rng.h"
 
 // Standard includes.
+#include <algorithm>
 #include <cmath>
 #include <cstddef>
 
@@ -71,3 +72,22 @@ vec3 random_in_cone(const vec3& direction, const float roughness, RNG& rng)
     return direction + roughness * random_in_unit_sphere(rng);
 }
 
+
+void make_basis(const vec3& normal, vec3& tangent, vec3& bitangent)
+{
+    const vec3 up = std::abs(normal.x) > 0.9f ? vec3(0.0f, 1.0f, 0.0f) : vec3(1.0f, 0.0f, 0.0f);
+    tangent = normalize(cross(up, normal));
+    bitangent = cross(normal, tangent);
+}
+
+vec3 random_in_solid_cone(const vec3& axis, const float cos_max, RNG& rng)
+{
+    const float cos_theta = 1.0f - rng.next() * (1.0f - cos_max);
+    const float sin_theta = sqrt(std::max(0.0f, 1.0f - cos_theta * cos_theta));
+    const float phi = 2.0f * 3.1416f * rng.next();
+
+    vec3 tangent, bitangent;
+    make_basis(axis, tangent, bitangent);
+
+    return (tangent * cos(phi) + bitangent * sin(phi)) * sin_theta + axis * cos_theta;
+}
@@ -24,4 +24,11 @@ glm::vec3 random_point_on_lights(const MeshGroup& lights, RNG& rng);
 
 glm::vec3 random_in_cone(const glm::vec3& direction, const float roughness, RNG& rng);
 
+// Build an orthonormal basis around the given unit normal.
+void make_basis(const glm::vec3& normal, glm::vec3& tangent, glm::vec3& bitangent);
+
+// Uniform random unit direction in the cone around
+// the given unit axis whose half angle has cosine cos_max.
+glm::vec3 random_in_solid_cone(const glm::vec3& axis, const float cos_max, RNG& rng);
+
 #endif // RENDERER_UTILITY_H
@@ -1,5 +1,6 @@
 // Interface.
 #include "renderer/material.h"
+#include "renderer/raypacket.h"
 #include "renderer/visualobject.h"
 
 // Standard includes.
@@ -13,6 +14,10 @@ using namespace std;
 
 #define COUCOUS_M_PI 3.1416f
 
+// Use the watertight triangle intersection: rays do not leak between
+// triangles sharing an edge, at the cost of a few more operations.
+// #define TRIANGLE_WATERTIGHT
+
 //
 // 3D Object data structures implementation.
 //
@@ -34,6 +39,9 @@ bool hit_world(
         hit_something |= object->hit(r, tmin, rec.t, rec);
     }
 
+    if (hit_something)
+        rec.triangle->compute_attributes(r, rec);
+
     return hit_something;
 }
 
@@ -55,6 +63,19 @@ MeshGroup fetch_lights(const MeshGroup& world)
     return lights;
 }
 
+MeshGroup fetch_metallic(const MeshGroup& world)
+{
+    MeshGroup metallic;
+
+    for (const auto& mesh : world)
+    {
+        if (mesh->mat()->metallic)
+            metallic.push_back(mesh);
+    }
+
+    return metallic;
+}
+
 
 //
 // Usual shapes implementation.
@@ -71,6 +92,8 @@ TriangleMesh::TriangleMesh(
     const bool                      smooth_shading)
   : m_triangle_count(triangle_count)
   , m_vertices_count(vertices_count)
+  , m_normals_count(smooth_shading ? vertices_count : triangle_count)
+  , m_transform(transform)
   , m_mat(material)
   , m_smooth_shading(smooth_shading)
 {
@@ -82,22 +105,11 @@ TriangleMesh::TriangleMesh(
     m_indices.reserve(triangle_count * 3);
     copy(indices, &indices[m_triangle_count * 3], back_inserter(m_indices));
 
-    // Copy vertices.
+    // Transform vertices and normals. Most meshes never move: the
+    // untransformed copies are only made once a mesh is moved.
     m_vertices.reset(new vec3[m_vertices_count]);
-    for (size_t i = 0; i < vertices_count; ++i)
-    {
-        m_vertices[i] = transform * vec4(vertices[i], 1.0f);
-    }
-
-    const mat3 normals_transform = transpose(inverse(transform));
-
-    // Copy normals.
-    const size_t normal_count = smooth_shading ? m_vertices_count : m_triangle_count;
-    m_normals.reset(new vec3[normal_count]);
-    for (size_t i = 0; i < normal_count; ++i)
-    {
-        m_normals[i] = normalize(normals_transform * normals[i]);
-    }
+    m_normals.reset(new vec3[m_normals_count]);
+    transform_mesh(vertices, normals, transform, m_vertices.get(), m_normals.get());
 }
 
 std::shared_ptr<Material> TriangleMesh::getMaterial()
@@ -110,6 +122,74 @@ size_t TriangleMesh::getTriangleCount()
     return m_triangle_count;
 }
 
+void TriangleMesh::set_transform(const mat4& transform)
+{
+    stage_transform(transform);
+    commit_transform();
+}
+
+void TriangleMesh::stage_transform(const mat4& transform)
+{
+    if (!m_staged_vertices)
+    {
+        // Bring the mesh back to object space, only the
+        // direction of the normals matters.
+        const mat4 vertices_transform = inverse(m_transform);
+        const mat3 normals_transform = transpose(m_transform);
+
+        m_object_vertices.reset(new vec3[m_vertices_count]);
+        m_object_normals.reset(new vec3[m_normals_count]);
+
+        for (size_t i = 0; i < m_vertices_count; ++i)
+            m_object_vertices[i] = vertices_transform * vec4(m_vertices[i], 1.0f);
+
+        for (size_t i = 0; i < m_normals_count; ++i)
+            m_object_normals[i] = normals_transform * m_normals[i];
+
+        m_staged_vertices.reset(new vec3[m_vertices_count]);
+        m_staged_normals.reset(new vec3[m_normals_count]);
+    }
+
+    transform_mesh(
+        m_object_vertices.get(),
+        m_object_normals.get(),
+        transform,
+        m_staged_vertices.get(),
+        m_staged_normals.get());
+
+    m_staged_transform = transform;
+}
+
+void TriangleMesh::commit_transform()
+{
+    assert(m_staged_vertices);
+
+    // The previous buffers are reused by the next staged transform.
+    swap(m_vertices, m_staged_vertices);
+    swap(m_normals, m_staged_normals);
+    m_transform = m_staged_transform;
+}
+
+void TriangleMesh::transform_mesh(
+    const vec3*                     vertices,
+    const vec3*                     normals,
+    const mat4&                     transform,
+    vec3*                           out_vertices,
+    vec3*                           out_normals) const
+{
+    for (size_t i = 0; i < m_vertices_count; ++i)
+    {
+        out_vertices[i] = transform * vec4(vertices[i], 1.0f);
+    }
+
+    const mat3 normals_transform = transpose(inverse(transform));
+
+    for (size_t i = 0; i < m_normals_count; ++i)
+    {
+        out_normals[i] = normalize(normals_transform * normals[i]);
+    }
+}
+
 Triangle::Triangle(
     const shared_ptr<TriangleMesh>&     mesh,
     const size_t                        indice)
@@ -121,13 +201,7 @@ Triangle::Triangle(
     assert(*(m_indices + 1) == m_mesh->m_indices[3 * indice + 1]);
     assert(*(m_indices + 2) == m_mesh->m_indices[3 * indice + 2]);
 
-    const vec3& v0 = m_mesh->m_vertices[*m_indices];
-    const vec3& v1 = m_mesh->m_vertices[*(m_indices + 1)];
-    const vec3& v2 = m_mesh->m_vertices[*(m_indices + 2)];
-
-    m_bbox = AABB(v0);
-    m_bbox.add_point(v1);
-    m_bbox.add_point(v2);
+    update_bbox();
 }
 
 bool Triangle::hit(
@@ -136,37 +210,156 @@ bool Triangle::hit(
     const float                     tmax,
     HitRecord&                      rec) const
 {
-    const vec3& v0 = m_mesh->m_vertices[*m_indices];
-    const vec3& v1 = m_mesh->m_vertices[*(m_indices + 1)];
-    const vec3& v2 = m_mesh->m_vertices[*(m_indices + 2)];
-    const vec3 v0v1 = v1 - v0;
-    const vec3 v0v2 = v2 - v0;
+#ifdef TRIANGLE_WATERTIGHT
+    // Transform the vertices in a space where the ray starts at the origin
+    // along +z, then compute the barycentric coordinates as 2D edge
+    // functions. The order of the axes only depends on the ray, so
+    // neighbour triangles agree on the sign of their shared edge.
+    const vec3 abs_dir = abs(r.dir);
+    const int kz = (abs_dir.x > abs_dir.y)
+        ? (abs_dir.x > abs_dir.z ? 0 : 2)
+        : (abs_dir.y > abs_dir.z ? 1 : 2);
+    int kx = (kz + 1) % 3;
+    int ky = (kx + 1) % 3;
+
+    // Keep the winding of the triangles.
+    if (r.dir[kz] < 0.0f)
+        swap(kx, ky);
+
+    const float sx = r.dir[kx] / r.dir[kz];
+    const float sy = r.dir[ky] / r.dir[kz];
+    const float sz = 1.0f / r.dir[kz];
+
+    const vec3 a = m_v0 - r.origin;
+    const vec3 b = a + m_e1;
+    const vec3 c = a + m_e2;
+
+    const float ax = a[kx] - sx * a[kz];
+    const float ay = a[ky] - sy * a[kz];
+    const float bx = b[kx] - sx * b[kz];
+    const float by = b[ky] - sy * b[kz];
+    const float cx = c[kx] - sx * c[kz];
+    const float cy = c[ky] - sy * c[kz];
+
+    float e0 = cx * by - cy * bx;
+    float e1 = ax * cy - ay * cx;
+    float e2 = bx * ay - by * ax;
+
+    // Exactly on an edge: compute again in double precision.
+    if (e0 == 0.0f || e1 == 0.0f || e2 == 0.0f)
+    {
+        e0 = static_cast<float>(static_cast<double>(cx) * by - static_cast<double>(cy) * bx);
+        e1 = static_cast<float>(static_cast<double>(ax) * cy - static_cast<double>(ay) * cx);
+        e2 = static_cast<float>(static_cast<double>(bx) * ay - static_cast<double>(by) * ax);
+    }
 
-    const vec3 h = cross(r.dir, v0v2);
-    const float a = dot(v0v1, h);
+    // Outside or behind ?
+    if (e0 < 0.0f || e1 < 0.0f || e2 < 0.0f)
+        return false;
+
+    const float det = e0 + e1 + e2;
+
+    if (det == 0.0f)
+        return false;
+
+    const float scaled_t = sz * (e0 * a[kz] + e1 * b[kz] + e2 * c[kz]);
+
+    if (scaled_t <= 0.0f || scaled_t < tmin * det || scaled_t >= tmax * det)
+        return false;
+
+    const float f = 1.0f / det;
+    const float t = scaled_t * f;
+    const float u = e1 * f;
+    const float v = e2 * f;
+#else
+    const vec3 h = cross(r.dir, m_e2);
+    const float a = dot(m_e1, h);
 
     // Parallel or behind ?
     if (a <= 0.0f)
         return false;
 
     const float f = 1.0f / a;
-    const vec3 s = r.origin - v0;
+    const vec3 s = r.origin - m_v0;
     const float u = f * dot(s, h);
 
     if (u < 0.0f || u > 1.0f)
         return false;
 
-    const vec3 q = cross(s, v0v1);
+    const vec3 q = cross(s, m_e1);
     const float v = f * dot(r.dir, q);
 
     if (v < 0.0f || u + v > 1.0f)
         return false;
 
-    const float t = f * dot(v0v2, q);
+    const float t = f * dot(m_e2, q);
 
     if (t <= 0.0f || t >= tmax || t < tmin)
         return false;
+#endif
+
+    rec.t = t;
+    rec.u = u;
+    rec.v = v;
+    rec.triangle = this;
+
+    return true;
+}
 
+void Triangle::hit_packet(
+    const RayPacket&                packet,
+    const float                     tmin,
+    PacketHits&                     hits) const
+{
+#ifdef TRIANGLE_WATERTIGHT
+    HitRecord rec;
+
+    for (size_t i = 0; i < packet.size; ++i)
+    {
+        if (hit(packet.ray(i), tmin, hits.t[i], rec))
+        {
+            hits.t[i] = rec.t;
+            hits.u[i] = rec.u;
+            hits.v[i] = rec.v;
+            hits.triangle[i] = this;
+        }
+    }
+#else
+    // Möller-Trumbore, with the hits selected instead of branched on.
+    for (size_t i = 0; i < packet.size; ++i)
+    {
+        const vec3 dir(packet.dir[0][i], packet.dir[1][i], packet.dir[2][i]);
+        const vec3 s(
+            packet.origin[0][i] - m_v0.x,
+            packet.origin[1][i] - m_v0.y,
+            packet.origin[2][i] - m_v0.z);
+
+        const vec3 h = cross(dir, m_e2);
+        const float a = dot(m_e1, h);
+        const float f = 1.0f / a;
+        const float u = f * dot(s, h);
+
+        const vec3 q = cross(s, m_e1);
+        const float v = f * dot(dir, q);
+        const float t = f * dot(m_e2, q);
+
+        const bool hit =
+            a > 0.0f
+            && u >= 0.0f && v >= 0.0f && u + v <= 1.0f
+            && t > 0.0f && t >= tmin && t < hits.t[i];
+
+        hits.t[i] = hit ? t : hits.t[i];
+        hits.u[i] = hit ? u : hits.u[i];
+        hits.v[i] = hit ? v : hits.v[i];
+        hits.triangle[i] = hit ? this : hits.triangle[i];
+    }
+#endif
+}
+
+void Triangle::compute_attributes(
+    const Ray&                      r,
+    HitRecord&                      rec) const
+{
     if (!m_mesh->m_smooth_shading)
     {
         rec.normal = m_mesh->m_normals[m_triangle_indice];
@@ -177,19 +370,12 @@ bool Triangle::hit(
         const vec3& n0 = m_mesh->m_normals[*m_indices];
         const vec3& n1 = m_mesh->m_normals[*(m_indices + 1)];
         const vec3& n2 = m_mesh->m_normals[*(m_indices + 2)];
-        const float w = 1.0f - u - v;
-        rec.normal = u * n1 + v * n2 + w * n0;
+        const float w = 1.0f - rec.u - rec.v;
+        rec.normal = rec.u * n1 + rec.v * n2 + w * n0;
     }
 
-    //const vec3 normal = normalize(cross(v0v1, v0v2));
-    //const vec3& normal = m_normal;
-    //const vec3& v0 = m_mesh->m_vertices[*m_indices];
     rec.mat = m_mesh->m_mat.get();
-    rec.p = r.origin + r.dir * t;
-    rec.t = t;
-    rec.triangle = this;
-
-    return true;
+    rec.p = r.origin + r.dir * rec.t;
 }
 
 const AABB& Triangle::bbox() const
@@ -208,6 +394,26 @@ const vec3& Triangle::vertice(const size_t indice) const
     return m_mesh->m_vertices[*(m_indices + indice)];
 }
 
+const shared_ptr<TriangleMesh>& Triangle::mesh() const
+{
+    return m_mesh;
+}
+
+void Triangle::update_bbox()
+{
+    const vec3& v0 = m_mesh->m_vertices[*m_indices];
+    const vec3& v1 = m_mesh->m_vertices[*(m_indices + 1)];
+    const vec3& v2 = m_mesh->m_vertices[*(m_indices + 2)];
+
+    m_bbox = AABB(v0);
+    m_bbox.add_point(v1);
+    m_bbox.add_point(v2);
+
+    m_v0 = v0;
+    m_e1 = v1 - v0;
+    m_e2 = v2 - v0;
+}
+
 //
 // Mesh generation implementation.
 //
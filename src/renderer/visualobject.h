@@ -14,6 +14,8 @@
 
 // Forward declarations.
 class Material;
+struct PacketHits;
+struct RayPacket;
 class Triangle;
 
 //
@@ -21,9 +23,14 @@ class Triangle;
 //
 
 // Store informations about an intersection between a ray and an object.
+// Traversal only keeps t, the barycentric coordinates u and v of the
+// second and third vertices, and the triangle: the other attributes are
+// computed once for the closest hit.
 typedef struct HitRecord
 {
     float       t;
+    float       u;
+    float       v;
     glm::vec3   p;
     glm::vec3   normal;
     Material*   mat;
@@ -67,6 +74,9 @@ bool hit_world(
 // Returns all light objects from the given world.
 MeshGroup fetch_lights(const MeshGroup& world);
 
+// Returns all metallic objects from the given world.
+MeshGroup fetch_metallic(const MeshGroup& world);
+
 
 //
 // Usual shapes.
@@ -93,12 +103,40 @@ class TriangleMesh
 
     size_t getTriangleCount();
 
+    // Move the mesh to a new transform. Triangles bounding boxes
+    // must then be updated.
+    void set_transform(const glm::mat4& transform);
+
+    // Compute the vertices of a new transform aside, without changing
+    // the mesh, so that it can be done while the mesh is rendered.
+    // The first call keeps an untransformed copy of the mesh, the
+    // transform it was created with must be invertible.
+    void stage_transform(const glm::mat4& transform);
+
+    // Move the mesh to the staged transform.
+    void commit_transform();
+
   private:
+    // Transform vertices and normals of the mesh into the output arrays.
+    void transform_mesh(
+        const glm::vec3*                    vertices,
+        const glm::vec3*                    normals,
+        const glm::mat4&                    transform,
+        glm::vec3*                          out_vertices,
+        glm::vec3*                          out_normals) const;
+
     size_t                          m_triangle_count; // number of triangles
     size_t                          m_vertices_count; // number of vertices
+    size_t                          m_normals_count; // number of normals
     std::vector<size_t>             m_indices; // each triangle vertex indices
     std::unique_ptr<glm::vec3[]>    m_vertices;
     std::unique_ptr<glm::vec3[]>    m_normals;
+    glm::mat4                       m_transform; // of the vertices
+    std::unique_ptr<glm::vec3[]>    m_object_vertices; // before the transform, once moved
+    std::unique_ptr<glm::vec3[]>    m_object_normals;
+    std::unique_ptr<glm::vec3[]>    m_staged_vertices;
+    std::unique_ptr<glm::vec3[]>    m_staged_normals;
+    glm::mat4                       m_staged_transform;
     std::shared_ptr<Material>       m_mat;
     bool                            m_smooth_shading;
 };
@@ -111,7 +149,11 @@ class Triangle : public VisualObject
         const std::shared_ptr<TriangleMesh>&    mesh,
         const size_t                            indice); // indice of the triangle first vertex in the mesh
 
-    // Möller-Trumbore algorithm.
+    // Möller-Trumbore algorithm, or the watertight algorithm
+    // of Woop et al. when TRIANGLE_WATERTIGHT is defined.
+    // Only the front side of triangles is hit.
+    // Only t, u, v and the triangle of the record are set,
+    // see compute_attributes().
     bool hit(
         const Ray&                          r,
         const float                         tmin,
@@ -122,13 +164,36 @@ class Triangle : public VisualObject
 
     const std::shared_ptr<Material>& mat() const override;
 
+    // Test all the rays of the packet, keeping the hits closer than the
+    // current ones. Same as hit() on each ray, without early exits.
+    void hit_packet(
+        const RayPacket&                    packet,
+        const float                         tmin,
+        PacketHits&                         hits) const;
+
+    // Set the position, normal and material of a hit found by hit().
+    void compute_attributes(
+        const Ray&                          r,
+        HitRecord&                          rec) const;
+
     const glm::vec3& vertice(const size_t indice) const;
 
+    const std::shared_ptr<TriangleMesh>& mesh() const;
+
+    // Fit the bounding box and the intersection
+    // data to the vertices after the mesh moved.
+    void update_bbox();
+
   private:
     std::shared_ptr<TriangleMesh>       m_mesh;
     size_t*                             m_indices;
     const size_t                        m_triangle_indice;
     AABB                                m_bbox;
+
+    // Intersection data: the first vertex and the two edges from it.
+    glm::vec3                           m_v0;
+    glm::vec3                           m_e1;
+    glm::vec3                           m_e2;
 };
 
 
@@ -7,15 +7,151 @@
 #include "test/catch.hpp"
 
 // couscous includes.
+#include "gui/scene.h"
 #include "renderer/aabb.h"
+#include "renderer/gridaccelerator.h"
+#include "renderer/material.h"
+#include "renderer/photonMapping.h"
 #include "renderer/ray.h"
+#include "renderer/raypacket.h"
+#include "renderer/sequence.h"
+#include "renderer/visualobject.h"
 
 // glm includes.
 #include <glm/glm.hpp>
 
+// Standard includes.
+#include <algorithm>
+#include <limits>
+#include <random>
+#include <utility>
+#include <vector>
+
 using namespace glm;
 using namespace std;
 
+namespace
+{
+    // The Cornell box with a finely subdivided cylinder,
+    // whose cells are dense enough to get grids of their own.
+    Scene dense_scene()
+    {
+        Scene scene;
+        Scene::preset("cornell_box", scene);
+
+        SceneObject cylinder("cylinder",
+            Transform(vec3(-30.0f, 30.0f, 20.0f), vec3(0.0f), vec3(20.0f)),
+            ObjectType::CYLINDER,
+            "white");
+        cylinder.subdivisions = 256;
+        cylinder.width = 1.0f;
+        cylinder.height = 2.0f;
+        cylinder.caps = true;
+        scene.objects.push_back(cylinder);
+
+        return scene;
+    }
+
+    // Random point in the Cornell box.
+    vec3 random_point(mt19937& engine)
+    {
+        uniform_real_distribution<float> uniform(-99.0f, 99.0f);
+        const float x = uniform(engine);
+        const float y = uniform(engine) + 100.0f;
+        const float z = uniform(engine);
+
+        return vec3(x, y, z);
+    }
+
+    // Random unit vector.
+    vec3 random_direction(mt19937& engine)
+    {
+        uniform_real_distribution<float> uniform(-1.0f, 1.0f);
+
+        while (true)
+        {
+            const float x = uniform(engine);
+            const float y = uniform(engine);
+            const float z = uniform(engine);
+            const vec3 d(x, y, z);
+
+            if (dot(d, d) > 0.01f && dot(d, d) <= 1.0f)
+                return normalize(d);
+        }
+    }
+
+    // Check a hit of the grid against the brute force hit of the world.
+    void check_hit(
+        const MeshGroup&    world,
+        const Ray&          r,
+        const bool          hit,
+        const HitRecord&    rec)
+    {
+        HitRecord expected;
+        const bool expected_hit = hit_world(world, r, 0.001f, numeric_limits<float>::max(), expected);
+
+        REQUIRE(hit == expected_hit);
+
+        if (hit)
+        {
+            REQUIRE(rec.t == Approx(expected.t));
+            REQUIRE(rec.triangle == expected.triangle);
+        }
+    }
+
+    // Trace random rays one by one, by packets and as a stream,
+    // and check their hits against the brute force hits.
+    void check_grid(
+        const MeshGroup&                world,
+        const VoxelGridAccelerator&     grid,
+        mt19937&                        engine)
+    {
+        const float tmin = 0.001f;
+        vector<Ray> rays;
+
+        for (size_t i = 0; i < 200; ++i)
+        {
+            const Ray r(random_point(engine), random_direction(engine));
+            rays.push_back(r);
+
+            HitRecord rec;
+            const bool hit = grid.hit(r, tmin, numeric_limits<float>::max(), rec);
+            check_hit(world, r, hit, rec);
+        }
+
+        vector<HitRecord> recs;
+        grid.hit_stream(rays, tmin, recs);
+
+        for (size_t i = 0; i < rays.size(); ++i)
+            check_hit(world, rays[i], recs[i].triangle != nullptr, recs[i]);
+
+        // Packets of coherent rays, like the camera rays of a block of pixels.
+        uniform_real_distribution<float> jitter(-0.05f, 0.05f);
+
+        for (size_t p = 0; p < 40; ++p)
+        {
+            const vec3 origin = random_point(engine);
+            const vec3 dir = random_direction(engine);
+
+            RayPacket packet;
+
+            for (size_t i = 0; i < RAY_PACKET_SIZE; ++i)
+            {
+                const float x = jitter(engine);
+                const float y = jitter(engine);
+                const float z = jitter(engine);
+                packet.add(Ray(origin, normalize(dir + vec3(x, y, z))));
+            }
+
+            HitRecord packet_recs[RAY_PACKET_SIZE];
+            grid.hit_packet(packet, tmin, packet_recs);
+
+            for (size_t i = 0; i < packet.size; ++i)
+                check_hit(world, packet.ray(i), packet_recs[i].mat != nullptr, packet_recs[i]);
+        }
+    }
+}
+
 int run_tests()
 {
     return Catch::Session().run();
@@ -61,3 +197,199 @@ TEST_CASE( "AABB Triangle creation", "[aabb]" )
     REQUIRE(bbox.max == expected_max);
 }
 
+TEST_CASE( "Sequence moves animated objects", "[sequence]" )
+{
+    Scene scene;
+    scene.materials.push_back(SceneMaterial("white", vec3(0.73f), 0.0f, 1.0f, 1.0f, 3.0f));
+
+    scene.objects.push_back(SceneObject("static",
+        Transform(vec3(0.0f), vec3(0.0f), vec3(1.0f)),
+        ObjectType::CUBE,
+        "white"));
+
+    SceneObject cube("cube",
+        Transform(vec3(0.0f, 1.0f, 0.0f), vec3(0.0f), vec3(2.0f)),
+        ObjectType::CUBE,
+        "white");
+    cube.animated = true;
+    cube.end_transform = Transform(vec3(10.0f, 1.0f, 0.0f), vec3(0.0f), vec3(2.0f));
+    scene.objects.push_back(cube);
+
+    MeshGroup world;
+    InstanceGroup instances;
+    RenderSequence sequence;
+    scene.create_sequence(3, 64, 64, world, instances, sequence);
+
+    // Only the animated cube is listed, with a transform per frame.
+    REQUIRE(sequence.animated.size() == 1);
+
+    const AnimatedMesh& animated = sequence.animated.front();
+    REQUIRE(animated.transforms.size() == 3);
+    REQUIRE(!animated.triangles.empty());
+
+    auto bounds = [&]()
+    {
+        AABB bbox(animated.triangles.front()->bbox());
+
+        for (const Shape& triangle : animated.triangles)
+        {
+            bbox.add_point(triangle->bbox().min);
+            bbox.add_point(triangle->bbox().max);
+        }
+
+        return bbox;
+    };
+
+    const AABB start = bounds();
+
+    // Move the cube to the last frame.
+    animated.mesh->stage_transform(animated.transforms[2]);
+    animated.mesh->commit_transform();
+
+    for (const Shape& triangle : animated.triangles)
+        triangle->update_bbox();
+
+    const AABB end = bounds();
+
+    for (int i = 0; i < 3; ++i)
+    {
+        const float offset = i == 0 ? 10.0f : 0.0f;
+        REQUIRE(end.min[i] == Approx(start.min[i] + offset));
+        REQUIRE(end.max[i] == Approx(start.max[i] + offset));
+    }
+}
+
+TEST_CASE( "Photon tree nearest photons", "[photons]" )
+{
+    const Material material(vec3(0.5f), 0.0f, 1.0f, 1.0f, 1.0f, 0.0f, 0.0f);
+
+    mt19937 engine(42);
+    uniform_real_distribution<float> uniform(-1.0f, 1.0f);
+
+    PhotonMap pmap;
+
+    for (size_t i = 0; i < 2000; ++i)
+    {
+        const vec3 position(uniform(engine), uniform(engine), uniform(engine));
+        pmap.add_photon(position, vec3(0.0f, -1.0f, 0.0f), 1.0f, &material);
+    }
+
+    // The tree reorders the photons: brute force runs on the balanced map.
+    const PhotonTree tree(pmap);
+    REQUIRE(pmap.size() == 2000);
+
+    const size_t counts[] = { 1, 8, 50, 5000 };
+    const float max_squared_dists[] = { 0.0001f, 0.01f, 0.25f, 100.0f };
+
+    for (size_t q = 0; q < 20; ++q)
+    {
+        const vec3 point(uniform(engine), uniform(engine), uniform(engine));
+
+        for (const size_t count : counts)
+        {
+            for (const float max_squared_dist : max_squared_dists)
+            {
+                // Brute force: photons strictly within the radius, nearest first.
+                vector<pair<float, size_t>> expected;
+
+                for (size_t i = 0; i < pmap.size(); ++i)
+                {
+                    const vec3 d = pmap.photon(i).pos() - point;
+                    const float squared_dist = dot(d, d);
+
+                    if (squared_dist < max_squared_dist)
+                        expected.push_back(make_pair(squared_dist, i));
+                }
+
+                sort(expected.begin(), expected.end());
+                expected.resize(std::min(expected.size(), count));
+
+                vector<pair<size_t, float>> results;
+                const size_t found = tree.find_nearest(point, count, max_squared_dist, results);
+
+                REQUIRE(found == expected.size());
+                REQUIRE(found <= count);
+
+                // Results are a heap: the farthest photon comes first.
+                vector<size_t> indices;
+
+                for (size_t i = 0; i < found; ++i)
+                {
+                    REQUIRE(results[i].second < max_squared_dist);
+                    REQUIRE(results[i].second <= results[0].second);
+                    indices.push_back(results[i].first);
+                }
+
+                vector<size_t> expected_indices;
+
+                for (const auto& photon : expected)
+                    expected_indices.push_back(photon.second);
+
+                sort(indices.begin(), indices.end());
+                sort(expected_indices.begin(), expected_indices.end());
+                REQUIRE(indices == expected_indices);
+
+                if (found > 0)
+                    REQUIRE(results[0].second == Approx(expected.back().first));
+            }
+        }
+    }
+}
+
+TEST_CASE( "Grid hits match the world hits", "[grid]" )
+{
+    Scene scene = dense_scene();
+
+    MeshGroup world;
+    InstanceGroup instances;
+    scene.create_scene(world, instances);
+    REQUIRE(instances.empty());
+
+    const VoxelGridAccelerator grid(world);
+
+    mt19937 engine(7);
+    check_grid(world, grid, engine);
+}
+
+TEST_CASE( "Grid hits match the world hits after refits", "[grid]" )
+{
+    Scene scene = dense_scene();
+
+    // The cylinder crosses the box and turns.
+    SceneObject& cylinder = scene.objects.back();
+    cylinder.animated = true;
+    cylinder.end_transform = Transform(vec3(40.0f, 60.0f, -30.0f), vec3(30.0f, 90.0f, 0.0f), vec3(20.0f));
+
+    MeshGroup world;
+    InstanceGroup instances;
+    RenderSequence sequence;
+    const size_t frames_count = 12;
+    scene.create_sequence(frames_count, 64, 64, world, instances, sequence);
+    REQUIRE(sequence.animated.size() == 1);
+
+    const AnimatedMesh& animated = sequence.animated.front();
+    animated.mesh->set_transform(animated.transforms[0]);
+
+    for (const Shape& triangle : animated.triangles)
+        triangle->update_bbox();
+
+    VoxelGridAccelerator grid(world);
+    vector<AABB> previous_bboxes(animated.triangles.size());
+
+    mt19937 engine(11);
+
+    for (size_t f = 1; f < frames_count; ++f)
+    {
+        for (size_t i = 0; i < animated.triangles.size(); ++i)
+            previous_bboxes[i] = animated.triangles[i]->bbox();
+
+        animated.mesh->stage_transform(animated.transforms[f]);
+        animated.mesh->commit_transform();
+
+        for (const Shape& triangle : animated.triangles)
+            triangle->update_bbox();
+
+        REQUIRE(grid.refit(animated.triangles, previous_bboxes));
+        check_grid(world, grid, engine);
+    }
+}